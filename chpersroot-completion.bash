@@ -14,56 +14,37 @@
 # [1] http://bash-completion.alioth.debian.org/
 
 
-# Parses out the rootdir specification for a command from the user's
-# configuration file.
+# Asks chpersroot about the configuration for a command, setting newroot to
+# the root to complete in and newhome and newsuhome to the home directory
+# that commands get there, for the user and for root.
 #
-# @param $1  The command name to use for finding the correct section of the
-#            configuration file.
+# @param $1  The command name, which chooses the configuration.
 #
-__chpersroot_newroot() {
-    local cmd CHPERSROOT_CONFIG
-    cmd=$1
-    : ${CHPERSROOT_CONFIG:=@@CONFIG_PATH@@}
-
-    sed -n -e "/\\[$cmd\\]/,/^\\[/ {
-        /^[ 	]*rootdir[ 	]*[:=]/ {
-            s/^[ 	]*rootdir[ 	]*[:=][ 	]*//
-            p
-            q
-        }
-    }" "$CHPERSROOT_CONFIG" 2>/dev/null
-}
-
-
-# Finds the home directory for the specified user within the chroot.
-#
-# @param $1  The UID of the target user.
-#
-__chpersroot_homedir() {
-    local userid IFS name password uid gid gecos directory shell
-    userid=$1
-    IFS=:
-    while read -r name password uid gid gecos directory shell; do
-        if [ "$uid" = "$userid" ]; then
-            echo "$directory"
-            break
-        fi
-    done <"$newroot/etc/passwd"
-}
-
+__chpersroot_query() {
+    local field lowerdir=
+    newcmd=$1 newroot= newhome= newsuhome=
+
+    while IFS= read -r -d '' field; do
+        case "$field" in
+        rootdir=*)
+            newroot=${field#rootdir=}
+            ;;
+        lowerdir=*)
+            lowerdir=${field#lowerdir=}
+            ;;
+        home=*)
+            newhome=${field#home=}
+            ;;
+        root_home=*)
+            newsuhome=${field#root_home=}
+            ;;
+        esac
+    done < <("$1" --query 2>/dev/null)
 
-# Prepends $newroot to each element of a path.
-#
-# @param $1  The path to process.
-#
-__chpersroot_process_path() {
-    local IFS=':'
-    set -- $1
-    while test $# != 0; do
-        printf "%s" "$newroot$1"
-        shift
-        test $# = 0 || printf :
-    done
+    # An overlay is only mounted on the root directory while a command runs,
+    # so complete from its top layer.
+    test -n "$lowerdir" && newroot=${lowerdir%%:*}
+    test -n "$newroot"
 }
 
 
@@ -112,18 +93,17 @@ __chpersroot_execfiles() {
 # the output in this case.
 #
 __chpersroot_compgen() {
-    local filter= args=() arg prefix uid
+    local filter= args=() arg prefix
     while test $# != 0; do
         arg=$1
         shift
         if test $# = 0 -a -n "$filter"; then
             if [ "${arg#/}" = "$arg" ]; then
                 if _complete_as_root; then
-                    uid=0
+                    prefix="$newroot$newsuhome/"
                 else
-                    uid=$EUID
+                    prefix="$newroot$newhome/"
                 fi
-                prefix="$newroot$(__chpersroot_homedir $uid)/"
             else
                 prefix=$newroot
             fi
@@ -233,24 +213,24 @@ __chpersroot_process_compopts() {
 }
 
 
-# Completes a command using the path inside the chroot.
+# Completes a command using the path inside the chroot, which chpersroot
+# keeps an index of so that the directories are not read every time.
 #
 __chpersroot_complete_path_command() {
-    if _complete_as_root; then
-        newpath=$(__chpersroot_process_path "@@ENV_SUPATH@@")
-    else
-        newpath=$(__chpersroot_process_path "@@ENV_PATH@@")
-    fi
+    local name option=--complete-command
+    _complete_as_root && option=--complete-root-command
 
-    local PATH=$newpath
-    COMPREPLY=( $(compgen -c -- "$cur") )
+    COMPREPLY=( $(compgen -A builtin -A keyword -- "$cur") )
+    while IFS= read -r -d '' name; do
+        COMPREPLY+=( "$name" )
+    done < <("$newcmd" "$option=$cur" 2>/dev/null)
 }
 
 
 # Completes a command inside the chroot.
 #
 __chpersroot_complete_command() {
-    local newpath cur
+    local cur
     _get_comp_words_by_ref cur
 
     case "$cur" in
@@ -318,18 +298,35 @@ __chpersroot_complete_args() {
 # Completion function for chpersroot.
 #
 _chpersroot() {
-    local newroot offset
+    local newcmd newroot newhome newsuhome offset
 
-    newroot=$(__chpersroot_newroot "$1")
-    [[ -z "$newroot" ]] && return 1
+    __chpersroot_query "$1" || return 1
 
-    if test $COMP_CWORD = 1; then
+    # Skip over options to chpersroot itself; the command starts at the
+    # first word that is not an option.
+    offset=1
+    while test $offset -lt $COMP_CWORD; do
+        case "${COMP_WORDS[offset]}" in
+        --)
+            offset=$((offset + 1))
+            break
+            ;;
+        --jobs|--results|--fan-out|--output-dir)
+            offset=$((offset + 2))
+            ;;
+        -*)
+            offset=$((offset + 1))
+            ;;
+        *)
+            break
+            ;;
+        esac
+    done
+
+    if test $COMP_CWORD = $offset; then
         __chpersroot_complete_command
         return
     fi
 
-    # Hardcode offset as 1 for now since chpersroot doesn't process any
-    # arguments at the moment.
-    offset=1
     __chpersroot_complete_args $offset "$@"
 }
@@ -0,0 +1,468 @@
+/*
+ * Define _GNU_SOURCE so we get open file description locks, fallocate(2)
+ * and memrchr(3).
+ */
+#define _GNU_SOURCE
+
+#include "audit.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <paths.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef SYSLOG_PATH
+#	define SYSLOG_PATH	_PATH_LOG
+#endif
+
+/*
+ * Records are kept in the spool exactly as they would have been sent, so
+ * they keep their original time and process, each one terminated by a NUL
+ * since commands can contain newlines.  They are forwarded from the front
+ * of the spool and then zeroed, punching a hole where we can, so the spool
+ * starts with the first non-zero byte and is emptied once it has all been
+ * forwarded.
+ */
+static struct {
+	const char* ident;
+	int sock;
+	int spool;
+} audit = { NULL, -1, -1 };
+
+/*
+ * Records forwarded when opening the audit log are limited to this many
+ * bytes, so that a backlog costs each invocation no more than this.
+ */
+#define FORWARD_LIMIT	16384
+
+/*
+ * The spool lives in RUN_DIR, which is usually in memory, so it only grows
+ * to about this many bytes.  Records that do not fit are dropped, and
+ * counted in a record at the end of the spool that is forwarded with the
+ * rest.
+ */
+#ifndef SPOOL_LIMIT
+#	define SPOOL_LIMIT	(4 << 20)
+#endif
+
+#define DROPPED_TAG	"[chpersroot-dropped records=\""
+#define DROPPED_MAX	256	/* longest record that can be a count */
+
+/*
+ * Format a record as syslog(3) would send it, setting *len to its length
+ * without the terminating NUL.
+ */
+static char*
+vformat_record(int priority, size_t* len, const char* fmt, va_list ap)
+{
+	char* record;
+	char stamp[32];
+	struct tm tm;
+	time_t now = time(NULL);
+	va_list copy;
+	int head;
+
+	strftime(stamp, sizeof(stamp), "%h %e %T", localtime_r(&now, &tm));
+	head = snprintf(NULL, 0, "<%d>%s %s[%d]: ", LOG_AUTHPRIV | priority,
+			stamp, audit.ident, (int) getpid());
+	va_copy(copy, ap);
+	*len = head + vsnprintf(NULL, 0, fmt, copy);
+	va_end(copy);
+
+	record = xmalloc(*len + 1);
+	snprintf(record, head + 1, "<%d>%s %s[%d]: ", LOG_AUTHPRIV | priority,
+		stamp, audit.ident, (int) getpid());
+	vsnprintf(record + head, *len - head + 1, fmt, ap);
+	return record;
+}
+
+static char*
+format_record(int priority, size_t* len, const char* fmt, ...)
+{
+	char* record;
+	va_list ap;
+
+	va_start(ap, fmt);
+	record = vformat_record(priority, len, fmt, ap);
+	va_end(ap);
+	return record;
+}
+
+static void
+connect_log(void)
+{
+	struct sockaddr_un addr;
+
+	if (audit.sock >= 0)
+		close(audit.sock);
+	audit.sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (audit.sock < 0)
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SYSLOG_PATH, sizeof(addr.sun_path) - 1);
+	if (connect(audit.sock, (struct sockaddr*) &addr, sizeof(addr))) {
+		close(audit.sock);
+		audit.sock = -1;
+	}
+}
+
+/*
+ * Send one record, without waiting unless flags says otherwise.  We never
+ * connect again once we might have left the host's filesystem, where the
+ * socket could belong to anyone, so if the system log has gone away the
+ * record is spooled instead.
+ */
+static int
+send_record(const char* record, size_t len, int flags)
+{
+	if (audit.sock < 0) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	return send(audit.sock, record, len, flags) >= 0 ? 0 : -1;
+}
+
+/*
+ * Only one process forwards records at a time, so that each is sent once.
+ * This is a lock on the first byte rather than flock(2), which guards each
+ * change to the spool and so must not wait for whoever is forwarding.
+ */
+static int
+lock_forwarding(int type, int wait)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 1;
+	return fcntl(audit.spool, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+}
+
+/*
+ * The number of records already counted as dropped by the record at the end
+ * of the spool, if that is where one is, setting *start to where it begins.
+ */
+static unsigned long
+last_dropped(off_t data, off_t size, off_t* start)
+{
+	char buf[DROPPED_MAX + 1];
+	char* rec;
+	char* tag;
+	off_t off = size - DROPPED_MAX > data ? size - DROPPED_MAX : data;
+	ssize_t n = pread(audit.spool, buf, size - off, off);
+
+	if (n <= 0 || n != size - off || buf[n - 1])
+		return 0;
+	rec = memrchr(buf, '\0', n - 1);
+	if (rec)
+		++rec;
+	else if (off == data)
+		rec = buf;
+	else
+		return 0;
+	tag = strstr(rec, "]: " DROPPED_TAG);
+	if (!tag)
+		return 0;
+	*start = off + (rec - buf);
+	return strtoul(tag + 3 + strlen(DROPPED_TAG), NULL, 10);
+}
+
+/*
+ * Count a record that did not fit in the spool.  If the spool already ends
+ * with a count, and nobody is forwarding it, it is replaced with one more.
+ * Called with the spool locked.
+ */
+static int
+note_dropped(off_t data, off_t size)
+{
+	unsigned long dropped = 0;
+	off_t start = size;
+	char* record;
+	size_t len;
+	ssize_t n;
+	int forwarding = lock_forwarding(F_WRLCK, 0);
+
+	if (!forwarding)
+		dropped = last_dropped(data, size, &start);
+	record = format_record(LOG_WARNING, &len, DROPPED_TAG "%lu\"]",
+			dropped + 1);
+	n = pwrite(audit.spool, record, len + 1, start);
+	if (n == (ssize_t) len + 1 && start + n < size)
+		ftruncate(audit.spool, start + n);
+	if (!forwarding)
+		lock_forwarding(F_UNLCK, 0);
+	free(record);
+	return n == (ssize_t) len + 1 ? 0 : -1;
+}
+
+/*
+ * Append records to the spool in a single write, holding the lock so that
+ * nobody empties the spool underneath us.  The lock is only ever held to
+ * change or read the spool, never while waiting for the system log.
+ * Records that would take the spool past SPOOL_LIMIT are only counted.
+ */
+static int
+spool_records(const char* records, size_t len)
+{
+	struct stat statbuf;
+	off_t data;
+	ssize_t n = -1;
+	int saved_errno;
+
+	if (flock(audit.spool, LOCK_EX))
+		return -1;
+	if (!fstat(audit.spool, &statbuf)) {
+		data = lseek(audit.spool, 0, SEEK_DATA);
+		if (data < 0)
+			data = statbuf.st_size;
+		if (statbuf.st_size - data + (off_t) len > SPOOL_LIMIT) {
+			note_dropped(data, statbuf.st_size);
+			flock(audit.spool, LOCK_UN);
+			errno = ENOSPC;
+			return -1;
+		}
+		n = pwrite(audit.spool, records, len, statbuf.st_size);
+	}
+	saved_errno = errno;
+	flock(audit.spool, LOCK_UN);
+	errno = saved_errno;
+	if (n < 0)
+		return -1;
+	if ((size_t) n != len) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read the records at the front of the spool into buf, up to size bytes.
+ * Sets *head to where they start and returns how many bytes were read.
+ */
+static ssize_t
+read_front(char* buf, size_t size, off_t* head)
+{
+	off_t off = lseek(audit.spool, 0, SEEK_DATA);
+	ssize_t n, skip;
+
+	if (off < 0)
+		off = 0;
+	for (;;) {
+		n = pread(audit.spool, buf, size, off);
+		if (n <= 0)
+			return n;
+		for (skip = 0; skip < n && !buf[skip]; ++skip)
+			;
+		if (skip < n)
+			break;
+		off += n;
+	}
+	*head = off + skip;
+	return pread(audit.spool, buf, size, *head);
+}
+
+/*
+ * Zero the len bytes forwarded from head, or empty the spool if nothing
+ * has been added after them.
+ */
+static int
+remove_front(off_t head, size_t len)
+{
+	static const char zeros[4096];
+	struct stat statbuf;
+	size_t done = 0;
+	ssize_t n;
+	int ret = 0;
+
+	if (flock(audit.spool, LOCK_EX))
+		return -1;
+	if (!fstat(audit.spool, &statbuf)
+			&& head + (off_t) len >= statbuf.st_size) {
+		ret = ftruncate(audit.spool, 0);
+	} else if (fallocate(audit.spool,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				head, len)) {
+		while (done < len) {
+			n = pwrite(audit.spool, zeros, len - done < sizeof(zeros)
+					? len - done : sizeof(zeros), head + done);
+			if (n <= 0) {
+				ret = -1;
+				break;
+			}
+			done += n;
+		}
+	}
+	flock(audit.spool, LOCK_UN);
+	return ret;
+}
+
+/*
+ * Send records from the front of the spool, in order, until limit bytes
+ * have been sent (or all of them if limit is 0) or the system log does not
+ * take one.  If someone else is already forwarding we only wait for them
+ * when draining, with wait set.
+ */
+static long
+forward_spool(size_t limit, int flags, int wait)
+{
+	size_t size = 4096, sent = 0;
+	char* buf = NULL;
+	long forwarded = 0;
+	int ret = 0, saved_errno;
+
+	if (audit.spool < 0)
+		return 0;
+	if (lock_forwarding(F_WRLCK, wait))
+		return wait ? -1 : 0;
+
+	for (;;) {
+		size_t off = 0, want = limit ? limit - sent : size;
+		off_t head = 0;
+		ssize_t len;
+
+		if (want > size)
+			want = size;
+		buf = realloc(buf, size);
+		if (!buf)
+			err(EXIT_FAILURE, "out of memory");
+		if (flock(audit.spool, LOCK_EX)) {
+			ret = -1;
+			break;
+		}
+		len = read_front(buf, want, &head);
+		flock(audit.spool, LOCK_UN);
+		if (len < 0)
+			ret = -1;
+		if (len <= 0)
+			break;
+
+		while (off < (size_t) len) {
+			char* end = memchr(buf + off, '\0', len - off);
+
+			if (!end)
+				break;
+			/*
+			 * A record too big for the system log ever to take
+			 * would hold up all the others for good.
+			 */
+			if (send_record(buf + off, end - (buf + off), flags)
+					&& errno != EMSGSIZE) {
+				ret = -1;
+				break;
+			}
+			++forwarded;
+			off = end - buf + 1;
+		}
+
+		/*
+		 * A record too long for the buffer needs a bigger one, unless
+		 * we are only forwarding a little.
+		 */
+		if (!off && !ret && (size_t) len == want && !limit) {
+			size *= 2;
+			continue;
+		}
+		saved_errno = errno;
+		if (off && remove_front(head, off))
+			ret = -1;
+		else
+			errno = saved_errno;
+		sent += off;
+		if (ret || !off || (limit && sent >= limit))
+			break;
+	}
+
+	saved_errno = errno;
+	lock_forwarding(F_UNLCK, 0);
+	errno = saved_errno;
+	free(buf);
+	return ret ? -1 : forwarded;
+}
+
+void
+audit_open(const char* ident, const char* spool_path)
+{
+	audit.ident = ident;
+	tzset();
+	connect_log();
+
+	if (spool_path) {
+		audit.spool = open(spool_path, O_RDWR | O_CREAT | O_NOFOLLOW
+				| O_CLOEXEC, 0600);
+		forward_spool(FORWARD_LIMIT, MSG_DONTWAIT, 0);
+	}
+}
+
+void
+audit_close(void)
+{
+	if (audit.sock >= 0)
+		close(audit.sock);
+	if (audit.spool >= 0)
+		close(audit.spool);
+	audit.sock = audit.spool = -1;
+}
+
+int
+audit_log(int priority, const char* fmt, ...)
+{
+	struct stat statbuf;
+	char* record;
+	size_t len;
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	record = vformat_record(priority, &len, fmt, ap);
+	va_end(ap);
+
+	/*
+	 * Records still waiting in the spool go first, so while there are
+	 * any this one joins them.
+	 */
+	if (audit.spool >= 0 && !fstat(audit.spool, &statbuf)
+			&& statbuf.st_size)
+		ret = -1;
+	else
+		ret = send_record(record, len,
+				audit.spool < 0 ? 0 : MSG_DONTWAIT);
+	if (ret && audit.spool >= 0)
+		ret = spool_records(record, len + 1);
+
+	free(record);
+	return ret;
+}
+
+/*
+ * Rather than waiting forever for a system log that has stopped reading,
+ * we give up after a while and leave the rest in the spool.
+ */
+#define DRAIN_TIMEOUT	10
+
+long
+audit_drain(void)
+{
+	struct timeval timeout = { DRAIN_TIMEOUT, 0 };
+
+	if (audit.sock < 0)
+		connect_log();
+	if (audit.sock >= 0)
+		setsockopt(audit.sock, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+				sizeof(timeout));
+	return forward_spool(0, 0, 1);
+}
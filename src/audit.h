@@ -0,0 +1,46 @@
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include <syslog.h>
+
+/*
+ * The audit log goes to the system log, but a system log that is backed up
+ * must never hold up the command we are about to run.  Records are sent
+ * without waiting, and any the system log will not take straight away are
+ * appended to a spool file to be forwarded later.
+ */
+
+/*
+ * Connect to the system log and open the spool at spool_path, which must be
+ * done while we are still root and on the host's filesystem.  A few of the
+ * records left in the spool are forwarded, oldest first, if the system log
+ * takes them without waiting; the rest are left for audit_drain().  Without
+ * a spool (spool_path is NULL) we wait for the system log as syslog(3)
+ * would.
+ */
+void
+audit_open(const char* ident, const char* spool_path);
+
+void
+audit_close(void);
+
+/*
+ * Send a record to the system log with the LOG_AUTHPRIV facility, or spool
+ * it, as it always is while older records are waiting in the spool.
+ * Returns -1 with errno set if it could be neither sent nor spooled, which
+ * is ENOSPC if the spool is full and the record was only counted.
+ */
+int
+audit_log(int priority, const char* fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * Forward every record in the spool, waiting for the system log as long as
+ * it takes.  Returns the number of records forwarded, or -1 with errno set
+ * if the system log failed, in which case the records not yet forwarded
+ * stay in the spool.
+ */
+long
+audit_drain(void);
+
+#endif // AUDIT_H
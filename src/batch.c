@@ -0,0 +1,150 @@
+#include "batch.h"
+#include "util.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct job {
+	pid_t pid;
+	unsigned long index;
+	char* line;
+	struct timespec start;
+};
+
+static void
+write_result(FILE* out, const struct job* job, int status,
+		const struct timespec* end, const struct rusage* ru)
+{
+	struct timespec wall;
+
+	wall.tv_sec = end->tv_sec - job->start.tv_sec;
+	wall.tv_nsec = end->tv_nsec - job->start.tv_nsec;
+	if (wall.tv_nsec < 0) {
+		--wall.tv_sec;
+		wall.tv_nsec += 1000000000;
+	}
+
+	fprintf(out, "{\"index\":%lu,\"command\":", job->index);
+	write_json_string(out, job->line);
+	if (WIFEXITED(status))
+		fprintf(out, ",\"exit\":%d,\"signal\":null", WEXITSTATUS(status));
+	else
+		fprintf(out, ",\"exit\":null,\"signal\":%d", WTERMSIG(status));
+	fprintf(out, ",\"wall\":%ld.%06ld,\"user\":%ld.%06ld,\"sys\":%ld.%06ld"
+		",\"maxrss\":%ld}\n",
+		(long) wall.tv_sec, wall.tv_nsec / 1000,
+		(long) ru->ru_utime.tv_sec, (long) ru->ru_utime.tv_usec,
+		(long) ru->ru_stime.tv_sec, (long) ru->ru_stime.tv_usec,
+		ru->ru_maxrss);
+	fflush(out);
+}
+
+static void
+start_job(struct job* job, const struct batch* batch,
+		const struct passwd* pw, char** envp, const char* root,
+		const struct copy_stats* stats)
+{
+	struct command cmd;
+
+	shell_command(&cmd, pw, job->line);
+	log_session(pw, &cmd, root, stats, batch->audit);
+
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	job->pid = fork();
+	if (job->pid < 0)
+		err(EXIT_FAILURE, "fork");
+	if (!job->pid) {
+		if (batch->stdin_fd >= 0 && dup2(batch->stdin_fd, 0) < 0)
+			_exit(127);
+		execve(cmd.path, cmd.args, envp);
+		warn("failed to execute command");
+		_exit(127);
+	}
+
+	free(cmd.args[0]);
+	free(cmd.args);
+}
+
+/*
+ * Read the next non-empty command line, returning NULL at the end of the
+ * input.
+ */
+static char*
+next_line(FILE* input)
+{
+	char* line = NULL;
+	size_t size = 0;
+
+	while (getdelim(&line, &size, '\0', input) >= 0) {
+		if (*line)
+			return line;
+	}
+	if (ferror(input))
+		err(EXIT_FAILURE, "read batch");
+	free(line);
+	return NULL;
+}
+
+unsigned int
+run_batch(const struct batch* batch, const struct passwd* pw, char** envp,
+		const char* root, const struct copy_stats* stats)
+{
+	struct job* jobs = xmalloc(sizeof(struct job) * batch->jobs);
+	unsigned int running = 0, failed = 0, i;
+	unsigned long index = 0;
+	int eof = 0;
+
+	for (;;) {
+		struct timespec end;
+		struct rusage ru;
+		int status;
+		pid_t pid;
+
+		while (!eof && running < batch->jobs) {
+			char* line = next_line(batch->input);
+			if (!line) {
+				eof = 1;
+				break;
+			}
+			jobs[running].index = index++;
+			jobs[running].line = line;
+			start_job(&jobs[running], batch, pw, envp, root, stats);
+			++running;
+		}
+		if (!running)
+			break;
+
+		pid = wait4(-1, &status, 0, &ru);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "wait");
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		for (i = 0; i < running && jobs[i].pid != pid; ++i)
+			;
+		if (i == running)
+			continue;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			++failed;
+		if (batch->results)
+			write_result(batch->results, &jobs[i], status, &end, &ru);
+
+		free(jobs[i].line);
+		jobs[i] = jobs[--running];
+	}
+
+	free(jobs);
+	return failed;
+}
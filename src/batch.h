@@ -0,0 +1,29 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <pwd.h>
+#include <stdio.h>
+
+#include "session.h"
+
+struct batch {
+	FILE* input;		/* NUL-separated command lines */
+	FILE* results;		/* where to record each command, or NULL */
+	unsigned int jobs;	/* how many commands may run at once */
+	int stdin_fd;		/* standard input for commands, or -1 */
+	const char* audit;	/* extra fields for the audit log, or NULL */
+};
+
+/*
+ * Run each command line read from batch->input with the user's shell, as
+ * login_command() would for a single command.  The caller must already be
+ * in the new root and running as the user.  For each command that finishes
+ * a line of JSON giving its exit status, wall clock time and resource usage
+ * is written to batch->results.  Returns the number of commands that did
+ * not exit successfully.
+ */
+unsigned int
+run_batch(const struct batch* batch, const struct passwd* pw, char** envp,
+		const char* root, const struct copy_stats* stats);
+
+#endif // BATCH_H
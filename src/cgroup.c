@@ -0,0 +1,192 @@
+#include "cgroup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+const char* const CGROUP_LIMITS[CGROUP_N_LIMITS] = {
+	"cpu.weight",
+	"cpu.max",
+	"memory.max",
+	"memory.high",
+	"io.weight",
+	"pids.max"
+};
+
+static int
+write_string(const char* path, const char* str)
+{
+	size_t len = strlen(str);
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	int saved_errno;
+	ssize_t n;
+
+	if (fd < 0)
+		return -1;
+	n = write(fd, str, len);
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return n == (ssize_t) len ? 0 : -1;
+}
+
+static int
+join_path(char* buf, const char* dir, const char* name)
+{
+	if (snprintf(buf, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+usable_name(const char* name)
+{
+	if (!*name || *name == '.' || strchr(name, '/')) {
+		errno = EINVAL;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * The limits as they are remembered in the stamp, one "file=value" line
+ * for each that is set.  Returns the length, or -1 if they do not fit.
+ */
+static int
+format_limits(char* buf, size_t size, const char* const* limits)
+{
+	size_t len = 0;
+	int i, n;
+
+	buf[0] = '\0';
+	for (i = 0; i < CGROUP_N_LIMITS; ++i) {
+		if (!limits[i])
+			continue;
+		n = snprintf(buf + len, size - len, "%s=%s\n",
+				CGROUP_LIMITS[i], limits[i]);
+		if (n < 0 || (size_t) n >= size - len)
+			return -1;
+		len += n;
+	}
+	return len;
+}
+
+static int
+stamp_matches(const char* stamp, const char* expected, int len)
+{
+	char buf[1024];
+	ssize_t n;
+	int fd;
+
+	if (!stamp || len < 0 || len >= (int) sizeof(buf))
+		return 0;
+	fd = open(stamp, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf));
+	close(fd);
+	return n == len && !memcmp(buf, expected, len);
+}
+
+static void
+write_stamp(const char* stamp, const char* limits, int len)
+{
+	int fd;
+
+	if (!stamp || len < 0)
+		return;
+	fd = open(stamp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+			0644);
+	if (fd < 0)
+		return;
+	if (write(fd, limits, len) != len)
+		ftruncate(fd, 0);
+	close(fd);
+}
+
+/*
+ * Make the controllers that the limits need available in the cgroups below
+ * dir.  Each one is enabled separately so that any that are already
+ * enabled do not matter.
+ */
+static int
+enable_controllers(const char* dir, const char* const* limits)
+{
+	char path[PATH_MAX];
+	char enable[32];
+	int i, j;
+
+	if (join_path(path, dir, "cgroup.subtree_control"))
+		return -1;
+	for (i = 0; i < CGROUP_N_LIMITS; ++i) {
+		const char* dot = strchr(CGROUP_LIMITS[i], '.');
+		int done = 0;
+
+		if (!limits[i])
+			continue;
+		/*
+		 * Several limits belong to the same controller.
+		 */
+		for (j = 0; j < i; ++j)
+			if (limits[j] && !strncmp(CGROUP_LIMITS[j],
+						CGROUP_LIMITS[i],
+						dot - CGROUP_LIMITS[i] + 1))
+				done = 1;
+		if (done)
+			continue;
+
+		snprintf(enable, sizeof(enable), "+%.*s",
+			(int) (dot - CGROUP_LIMITS[i]), CGROUP_LIMITS[i]);
+		if (write_string(path, enable))
+			return -1;
+	}
+	return 0;
+}
+
+int
+cgroup_enter(const char* root, const char* config, const char* user,
+		const char* const* limits, const char* stamp)
+{
+	char config_dir[PATH_MAX];
+	char user_dir[PATH_MAX];
+	char procs[PATH_MAX];
+	char file[PATH_MAX];
+	char wanted[1024];
+	int len, i;
+
+	if (!usable_name(config) || !usable_name(user))
+		return -1;
+	if (join_path(config_dir, root, config)
+			|| join_path(user_dir, config_dir, user)
+			|| join_path(procs, user_dir, "cgroup.procs"))
+		return -1;
+
+	len = format_limits(wanted, sizeof(wanted), limits);
+	if (stamp_matches(stamp, wanted, len) && !write_string(procs, "0"))
+		return 0;
+
+	if (mkdir(config_dir, 0755) && errno != EEXIST)
+		return -1;
+	if (enable_controllers(root, limits))
+		return -1;
+	for (i = 0; i < CGROUP_N_LIMITS; ++i) {
+		if (!limits[i])
+			continue;
+		if (join_path(file, config_dir, CGROUP_LIMITS[i])
+				|| write_string(file, limits[i]))
+			return -1;
+	}
+	write_stamp(stamp, wanted, len);
+
+	if (mkdir(user_dir, 0755) && errno != EEXIST)
+		return -1;
+	return write_string(procs, "0");
+}
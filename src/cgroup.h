@@ -0,0 +1,27 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+/*
+ * The cgroup v2 interface files that can be set for a configuration.  Each
+ * configuration keeps its values in this order.
+ */
+#define CGROUP_N_LIMITS	6
+
+extern const char* const CGROUP_LIMITS[CGROUP_N_LIMITS];
+
+/*
+ * Move the calling process into the cgroup for user inside the one for
+ * config, both created on demand beneath root, which must be a cgroup v2
+ * directory delegated to us.  limits[i] is written to CGROUP_LIMITS[i] in
+ * the configuration's cgroup, so that the limits cover all of its users
+ * together, or left alone if it is NULL.
+ *
+ * The limits last written are remembered in the file at stamp, if it is not
+ * NULL, so that as long as they have not changed and the user's cgroup
+ * exists entering it is a single write.
+ */
+int
+cgroup_enter(const char* root, const char* config, const char* user,
+		const char* const* limits, const char* stamp);
+
+#endif // CGROUP_H
@@ -4,255 +4,1319 @@
 #define _GNU_SOURCE
 
 #include <err.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <limits.h>
 #include <grp.h>
 #include <libgen.h>
 #include <linux/personality.h>
 #include <pwd.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
-#include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "audit.h"
+#include "batch.h"
+#include "cgroup.h"
+#include "cmdindex.h"
+#include "configcache.h"
 #include "configfile.h"
 #include "copyfile.h"
+#include "fanout.h"
+#include "namespace.h"
+#include "prewarm.h"
+#include "query.h"
+#include "server.h"
+#include "session.h"
+#include "supervise.h"
+#include "trace.h"
+#include "util.h"
 
 #define set_pers(pers) ((long) syscall(SYS_personality, pers))
 
-#ifndef SHELL_PATH
-#	define SHELL_PATH	"/bin/sh"
-#endif
 #ifndef CONFIG_PATH
 #	define CONFIG_PATH	"/etc/chpersroot.conf"
 #endif
-#ifndef ENV_PATH
-#	define ENV_PATH		"/bin:/usr/bin"
+#ifndef CONFIG_DIR
+#	define CONFIG_DIR	"/etc/chpersroot.d"
 #endif
-#ifndef ENV_SUPATH
-#	define ENV_SUPATH	"/sbin:/bin:/usr/sbin:/usr/bin";
+#ifndef RUN_DIR
+#	define RUN_DIR		"/run/chpersroot"
 #endif
 
 
-#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+#define CONFIG_CACHE_PATH	RUN_DIR "/config.cache"
+#define CONFIG_DIR_CACHE	RUN_DIR "/config.d"
+#define CONFIG_INDEX_PATH	CONFIG_DIR_CACHE "/index"
+#define NAMESPACE_DIR		RUN_DIR "/ns"
+#define NAMESPACE_LOCK		RUN_DIR "/ns.lock"
+#define SERVER_DIR		RUN_DIR "/server"
+#define AUDIT_SPOOL_PATH	RUN_DIR "/audit.spool"
+#define CGROUP_STAMP_DIR	RUN_DIR "/cgroup"
+#define COMMANDS_DIR		RUN_DIR "/commands"
+#define COPY_LOCK_DIR		RUN_DIR "/copy"
 
+#ifndef COPY_LOCK_TIMEOUT
+#	define COPY_LOCK_TIMEOUT	10	/* seconds */
+#endif
 
-static const char *const ENV_TO_KEEP[] = {
-	"TERM",
-	"COLORTERM",
-	"DISPLAY",
-	"XAUTHORITY",
-	NULL
-};
 
-struct pw_env {
-	const char name[8];
-	const size_t offset;
-};
-static const struct pw_env ENV_FROM_PASSWD[] = {
-	{ "HOME", offsetof(struct passwd, pw_dir) },
-	{ "SHELL", offsetof(struct passwd, pw_shell) },
-	{ "USER", offsetof(struct passwd, pw_name) },
-	{ "LOGNAME", offsetof(struct passwd, pw_name) },
-	{ "", -1 }
-};
+/*
+ * Make sure dir exists and can be trusted.
+ */
+static int
+trusted_dir(const char* dir)
+{
+	struct stat statbuf;
 
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return 0;
+	if (lstat(dir, &statbuf))
+		return 0;
+	return S_ISDIR(statbuf.st_mode) && 0 == statbuf.st_uid
+		&& !((S_IWGRP | S_IWOTH) & statbuf.st_mode);
+}
 
-static inline void*
-xmalloc(size_t size)
+/*
+ * If RUN_DIR cannot be trusted we simply parse the configuration file every
+ * time, but pinned namespaces are unavailable.
+ */
+static int
+run_dir_usable(void)
 {
-	void* result = malloc(size);
-	if (!result)
-		err(EXIT_FAILURE, "out of memory");
+	return trusted_dir(RUN_DIR);
+}
 
-	return result;
+/*
+ * Find the file for the named configuration in one of the directories under
+ * RUN_DIR, or a drop-in file in CONFIG_DIR.
+ */
+static char*
+run_path(const char* dir, const char* name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char* path;
+
+	if (!*name || *name == '.' || strchr(name, '/'))
+		errx(EXIT_FAILURE, "unusable configuration name: %s", name);
+
+	path = xmalloc(len);
+	snprintf(path, len, "%s/%s", dir, name);
+	return path;
 }
 
-static void
-switch_root(const char* root, const char* dir)
+/*
+ * Open a configuration file, or return -1 if it does not exist.  Only root
+ * may be able to write it.
+ */
+static int
+open_config(const char* path, struct stat* statbuf)
 {
-	if (chroot(root))
-		err(EXIT_FAILURE, "chroot");
-	if (chdir("/"))
-		err(EXIT_FAILURE, "chdir to /");
-	if (chdir(dir))
-		err(EXIT_FAILURE, "chdir to home (%s)", dir);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return -1;
+		err(EXIT_FAILURE, "read_configuration");
+	}
+
+	if (fstat(fd, statbuf))
+		err(EXIT_FAILURE, "stat");
+
+	if (0 != statbuf->st_uid || 0 != statbuf->st_gid)
+		errx(EXIT_FAILURE, "%s must be owned by root", path);
+
+	if (S_IWGRP & statbuf->st_mode || S_IWOTH & statbuf->st_mode)
+		errx(EXIT_FAILURE, "%s must not be world writable", path);
+
+	return fd;
 }
 
+/*
+ * Find the section called name in the configuration file open on fd, which
+ * is closed.  The compiled copy at cachepath is used, or refreshed, unless
+ * cachepath is NULL.
+ */
+static struct config_entry*
+lookup_in_file(int fd, const struct stat* statbuf, const char* cachepath,
+		const char* name)
+{
+	struct config_entry* entry;
+	struct config* config;
+	struct config* whole;
+	configcache* cache;
+
+	if (cachepath) {
+		cache = configcache_open(cachepath, statbuf);
+		if (cache) {
+			close(fd);
+			/*
+			 * The entry refers into the mapping, which we keep
+			 * for the lifetime of the process.
+			 */
+			entry = configcache_lookup(cache, name);
+			if (!entry)
+				configcache_close(cache);
+			return entry;
+		}
+	}
+
+	/*
+	 * Only the section we want is read for the lookup, so that errors in
+	 * the others, which nothing has asked for, are not ours to report.
+	 * The whole file is only parsed to fill the cache, and if any of it
+	 * is broken there is no cache to fill.
+	 */
+	if (parse_configsection(fd, name, &config))
+		errx(EXIT_FAILURE, "failed to parse config file");
+
+	if (cachepath && !lseek(fd, 0, SEEK_SET)
+			&& !parse_configfile_quiet(fd, &whole)) {
+		/*
+		 * Failing to update the cache only costs us a parse next
+		 * time.
+		 */
+		configcache_write(cachepath, statbuf, whole);
+		free_config(whole);
+	}
+	close(fd);
+
+	entry = config_find(config, name);
+	if (!entry)
+		free_config(config);
+	return entry;
+}
+
+static struct config_entry*
+read_dropin(const char* file, const char* name, int use_cache)
+{
+	struct config_entry* entry = NULL;
+	struct stat statbuf;
+	char* path = run_path(CONFIG_DIR, file);
+	char* cachepath = use_cache ? run_path(CONFIG_DIR_CACHE, file) : NULL;
+	int fd = open_config(path, &statbuf);
+
+	if (fd >= 0)
+		entry = lookup_in_file(fd, &statbuf, cachepath, name);
+	free(path);
+	free(cachepath);
+	return entry;
+}
+
+/*
+ * Read a drop-in file through its compiled copy, adding its sections to the
+ * index being built, and look up name in it unless that is NULL.
+ */
+static struct config_entry*
+index_dropin(const char* file, const char* name,
+		struct configcache_index_builder* builder, int* index_ok)
+{
+	struct config_entry* entry = NULL;
+	struct config* config = NULL;
+	configcache* cache = NULL;
+	struct stat statbuf;
+	const char** sections;
+	char* path = run_path(CONFIG_DIR, file);
+	char* cachepath = run_path(CONFIG_DIR_CACHE, file);
+	int fd = open_config(path, &statbuf);
+	size_t i, n;
+
+	if (fd < 0)
+		goto out;
+
+	cache = configcache_open(cachepath, &statbuf);
+	if (!cache) {
+		/*
+		 * As in lookup_in_file(), only the section we want is ours to
+		 * report errors in, and a broken file is left out of the
+		 * index so that it is read again next time.
+		 */
+		if (name) {
+			if (parse_configsection(fd, name, &config))
+				errx(EXIT_FAILURE, "failed to parse %s", path);
+			entry = config_find(config, name);
+			if (!entry)
+				free_config(config);
+			config = NULL;
+		}
+		if ((name && lseek(fd, 0, SEEK_SET))
+				|| parse_configfile_quiet(fd, &config)) {
+			*index_ok = 0;
+			close(fd);
+			goto out;
+		}
+		configcache_write(cachepath, &statbuf, config);
+	}
+	close(fd);
+
+	if (cache) {
+		for (n = 0; configcache_name(cache, n); ++n)
+			;
+		sections = xmalloc(sizeof(char*) * (n + 1));
+		for (i = 0; i < n; ++i)
+			sections[i] = configcache_name(cache, i);
+	} else {
+		n = config ? config->n_entries : 0;
+		sections = xmalloc(sizeof(char*) * (n + 1));
+		for (i = 0; i < n; ++i)
+			sections[i] = config->entries[i].name;
+	}
+	if (configcache_index_add(builder, file, &statbuf, sections, n))
+		*index_ok = 0;
+	free(sections);
+
+	if (cache) {
+		if (name)
+			entry = configcache_lookup(cache, name);
+		if (!entry)
+			configcache_close(cache);
+	} else {
+		free_config(config);
+	}
+
+out:
+	free(path);
+	free(cachepath);
+	return entry;
+}
+
+/*
+ * Check that CONFIG_DIR can be trusted like CONFIG_PATH, returning -1 if it
+ * does not exist.
+ */
+static int
+stat_config_dir(struct stat* statbuf)
+{
+	if (stat(CONFIG_DIR, statbuf)) {
+		if (errno == ENOENT)
+			return -1;
+		err(EXIT_FAILURE, "%s", CONFIG_DIR);
+	}
+	if (!S_ISDIR(statbuf->st_mode))
+		errx(EXIT_FAILURE, "%s is not a directory", CONFIG_DIR);
+	if (0 != statbuf->st_uid || 0 != statbuf->st_gid)
+		errx(EXIT_FAILURE, "%s must be owned by root", CONFIG_DIR);
+	if (S_IWGRP & statbuf->st_mode || S_IWOTH & statbuf->st_mode)
+		errx(EXIT_FAILURE, "%s must not be world writable", CONFIG_DIR);
+	return 0;
+}
+
+static int
+is_dropin(const struct dirent* d)
+{
+	size_t len = strlen(d->d_name);
+	return d->d_name[0] != '.' && len > 5
+		&& !strcmp(d->d_name + len - 5, ".conf");
+}
+
+/*
+ * Remove the compiled copies of drop-in files that no longer exist.
+ */
 static void
-set_user(struct passwd* pw, gid_t* groups, int n_groups)
+prune_dropin_caches(struct dirent** files, int n_files)
 {
-	if (setgroups(n_groups, groups))
-		err(EXIT_FAILURE, "setgroups");
-	if (setuid(pw->pw_uid))
-		err(EXIT_FAILURE, "setuid to user");
-	if (setgid(pw->pw_gid))
-		err(EXIT_FAILURE, "setgid");
+	struct dirent** caches;
+	int n, i, j;
+
+	n = scandir(CONFIG_DIR_CACHE, &caches, is_dropin, alphasort);
+	if (n < 0)
+		return;
+	for (i = j = 0; i < n; ++i) {
+		while (j < n_files
+				&& strcmp(files[j]->d_name, caches[i]->d_name) < 0)
+			++j;
+		if (j >= n_files || strcmp(files[j]->d_name, caches[i]->d_name)) {
+			char* path = run_path(CONFIG_DIR_CACHE, caches[i]->d_name);
+			unlink(path);
+			free(path);
+		}
+		free(caches[i]);
+	}
+	free(caches);
 }
 
-static inline int
-need_sh_quote(char c)
+/*
+ * Find the section called name in the drop-in files in CONFIG_DIR, which are
+ * read in order of their names.  When we can keep files in RUN_DIR each one
+ * has its own compiled copy, so changing one does not mean parsing the
+ * others again, and an index from section name to file means that normally
+ * only one file is opened.
+ */
+static struct config_entry*
+read_config_dir(const char* name, int use_cache)
 {
-	return (c == '\'' || c == '!');
+	struct configcache_index_builder builder = { NULL, 0, 0 };
+	struct config_entry* entry = NULL;
+	configcache_index* index;
+	struct dirent** files;
+	struct stat statbuf;
+	int n_files, i, index_ok = 1;
+
+	if (stat_config_dir(&statbuf))
+		return NULL;
+
+	use_cache = use_cache && trusted_dir(CONFIG_DIR_CACHE);
+
+	/*
+	 * Adding, removing or renaming a file makes the whole index stale,
+	 * and editing one in place makes it stale from that file on.  If the
+	 * index cannot tell us which file to read we read everything.
+	 */
+	if (use_cache) {
+		index = configcache_index_open(CONFIG_INDEX_PATH, &statbuf);
+		if (index) {
+			const char* file = configcache_index_lookup(index,
+					CONFIG_DIR, name);
+			if (file)
+				entry = read_dropin(file, name, 1);
+			configcache_index_close(index);
+			if (entry)
+				return entry;
+		}
+	}
+
+	n_files = scandir(CONFIG_DIR, &files, is_dropin, alphasort);
+	if (n_files < 0)
+		err(EXIT_FAILURE, "%s", CONFIG_DIR);
+
+	if (use_cache) {
+		for (i = 0; i < n_files; ++i) {
+			struct config_entry* found = index_dropin(
+					files[i]->d_name, entry ? NULL : name,
+					&builder, &index_ok);
+			if (!entry)
+				entry = found;
+		}
+		/*
+		 * As with the compiled copies, failing to write the index
+		 * only costs us reading the directory next time.
+		 */
+		if (index_ok)
+			configcache_index_write(CONFIG_INDEX_PATH, &statbuf,
+					&builder);
+		free(builder.buf);
+		prune_dropin_caches(files, n_files);
+	} else {
+		for (i = 0; i < n_files && !entry; ++i)
+			entry = read_dropin(files[i]->d_name, name, 0);
+	}
+
+	for (i = 0; i < n_files; ++i)
+		free(files[i]);
+	free(files);
+	return entry;
 }
 
-static inline void
-check_length(ptrdiff_t remaining, size_t needed)
+/*
+ * Sections in CONFIG_PATH take precedence over those in CONFIG_DIR.
+ */
+static struct config_entry*
+read_configuration(const char* name)
 {
-	if (remaining < needed)
-		errx(EXIT_FAILURE, "command line too long");
+	struct config_entry* entry = NULL;
+	struct stat statbuf;
+	int use_cache = run_dir_usable();
+	int fd = open_config(CONFIG_PATH, &statbuf);
+
+	if (fd >= 0)
+		entry = lookup_in_file(fd, &statbuf,
+				use_cache ? CONFIG_CACHE_PATH : NULL, name);
+	if (!entry)
+		entry = read_config_dir(name, use_cache);
+	return entry;
 }
 
-static char*
-cmd_string(int argc, char* argv[])
-{
-	const size_t maxlen = (size_t) sysconf(_SC_ARG_MAX);
-	char* cmd = xmalloc(maxlen);
-	char* end = cmd + maxlen;
-	char* p;
-
-	for (p = cmd; argc > 0; --argc) {
-		const char* src = *argv++;
-		check_length(end - p, 2);
-		if (p != cmd)
-			*p++ = ' ';
-		*p++ = '\'';
-		while (*src) {
-			size_t len = strcspn(src, "'!");
-			check_length(end - p, len);
-			strncpy(p, src, len);
-			src += len;
-			p += len;
-			while (need_sh_quote(*src)) {
-				check_length(end - p, 4);
-				*p++ = '\'';
-				*p++ = '\\';
-				*p++ = *src++;
-				*p++ = '\'';
+/*
+ * The names of the configurations to fan out to, and which patterns have
+ * matched any of them.
+ */
+struct name_list {
+	char** patterns;
+	int* matched;
+	size_t n_patterns;
+	char** names;
+	size_t n_names;
+	size_t alloc;
+};
+
+static void
+add_matching_names(int fd, struct name_list* list)
+{
+	struct config* config;
+	size_t i, j;
+
+	if (parse_configfile(fd, &config))
+		errx(EXIT_FAILURE, "failed to parse config file");
+	close(fd);
+
+	for (i = 0; config && i < config->n_entries; ++i) {
+		const char* name = config->entries[i].name;
+		int wanted = 0;
+
+		for (j = 0; j < list->n_patterns; ++j) {
+			if (!fnmatch(list->patterns[j], name, FNM_CASEFOLD)) {
+				list->matched[j] = 1;
+				wanted = 1;
 			}
 		}
-		check_length(end - p, 2);
-		*p++ = '\'';
+		for (j = 0; wanted && j < list->n_names; ++j)
+			wanted = strcasecmp(list->names[j], name) != 0;
+		if (!wanted)
+			continue;
+
+		if (list->n_names == list->alloc) {
+			list->alloc = list->alloc * 2 + 8;
+			list->names = realloc(list->names,
+					list->alloc * sizeof(char*));
+			if (!list->names)
+				err(EXIT_FAILURE, "out of memory");
+		}
+		list->names[list->n_names] = strdup(name);
+		if (!list->names[list->n_names++])
+			err(EXIT_FAILURE, "out of memory");
 	}
-	*p = '\0';
-	return cmd;
+	free_config(config);
 }
 
-static inline const char*
-xbasename(const char* path)
+/*
+ * Find every configuration whose name matches one of the comma-separated
+ * shell patterns, in the order they appear in CONFIG_PATH and then in the
+ * drop-in files.  Every pattern must match something.  This reads every
+ * file in full, which is nothing next to setting up several roots.
+ */
+static void
+match_configurations(const char* patterns, struct name_list* list)
 {
-	const char* ret = strrchr(path, '/');
-	if (!ret)
-		ret = path;
-	else
-		++ret;
-	return ret;
+	char* copy = strdup(patterns);
+	struct dirent** files;
+	struct stat statbuf;
+	char* pattern;
+	char* save;
+	int fd, n_files, i;
+	size_t j;
+
+	if (!copy)
+		err(EXIT_FAILURE, "out of memory");
+	memset(list, 0, sizeof(*list));
+	list->patterns = xmalloc(sizeof(char*) * (strlen(patterns) / 2 + 1));
+	for (pattern = strtok_r(copy, ",", &save); pattern;
+			pattern = strtok_r(NULL, ",", &save))
+		list->patterns[list->n_patterns++] = pattern;
+	list->matched = calloc(list->n_patterns + 1, sizeof(int));
+	if (!list->matched)
+		err(EXIT_FAILURE, "out of memory");
+
+	fd = open_config(CONFIG_PATH, &statbuf);
+	if (fd >= 0)
+		add_matching_names(fd, list);
+
+	if (!stat_config_dir(&statbuf)) {
+		n_files = scandir(CONFIG_DIR, &files, is_dropin, alphasort);
+		if (n_files < 0)
+			err(EXIT_FAILURE, "%s", CONFIG_DIR);
+		for (i = 0; i < n_files; ++i) {
+			char* path = run_path(CONFIG_DIR, files[i]->d_name);
+			fd = open_config(path, &statbuf);
+			if (fd >= 0)
+				add_matching_names(fd, list);
+			free(path);
+			free(files[i]);
+		}
+		free(files);
+	}
+
+	for (j = 0; j < list->n_patterns; ++j)
+		if (!list->matched[j])
+			errx(EXIT_FAILURE, "no configuration matches: %s",
+				list->patterns[j]);
+	if (!list->n_patterns)
+		errx(EXIT_FAILURE, "no configurations given to fan out to");
 }
 
-static char*
-login_arg0(const char* arg0)
+static int
+copy_in_file(const char* rootdir, const char* file, int flags)
 {
-	const char* base = xbasename(arg0);
-	const size_t len = strlen(base);
-	char* ret = xmalloc(len + 2);
-	ret[0] = '-';
-	strncpy(ret + 1, base, len + 1);
+	size_t len = strlen(file) + strlen(rootdir) + 1;
+	char* dstpath = xmalloc(len);
+	int ret;
+
+	snprintf(dstpath, len, "%s%s", rootdir, file);
+	ret = copyfile(file, dstpath, flags);
+	if (ret < 0)
+		err(EXIT_FAILURE, "copyfile");
+	free(dstpath);
 	return ret;
 }
 
-static inline char*
-make_env_var(const char* name, const char* value)
+/*
+ * The lock file holds a count of the copies finished under it.
+ */
+static uint64_t
+read_generation(int fd)
 {
-	size_t len = strlen(name) + strlen(value) + 2;
-	char *ret = xmalloc(len);
-	if (len != 1 + snprintf(ret, len, "%s=%s", name, value))
-		errx(EXIT_FAILURE, "failed to copy environment");
-	return ret;
+	uint64_t generation;
+
+	if (pread(fd, &generation, sizeof(generation), 0)
+			!= sizeof(generation))
+		return 0;
+	return generation;
 }
 
-static inline const char*
-pw_at_offset(const struct passwd* pw, size_t offset)
+static void
+write_generation(int fd, uint64_t generation)
 {
-	return *(const char**) ((const char*) pw + offset);
+	if (pwrite(fd, &generation, sizeof(generation), 0)
+			!= sizeof(generation))
+		ftruncate(fd, 0);
 }
 
-static char**
-make_env(const struct passwd* pw)
+/*
+ * Take the copy lock for a configuration, noting the generation when we
+ * arrived.  The lock goes when its holder dies, but one that is stuck is
+ * only waited for so long; then we go ahead without it, which is safe
+ * because each copy is renamed into place.  Returns -1 if there is no lock.
+ */
+static int
+lock_copy(const char* name, uint64_t* arrived)
 {
+	struct timespec deadline, now, delay = { 0, 1000000 };
+	char* path;
+	int fd, locked;
+
+	if (!run_dir_usable() || !trusted_dir(COPY_LOCK_DIR))
+		return -1;
+	path = run_path(COPY_LOCK_DIR, name);
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	free(path);
+	if (fd < 0)
+		return -1;
+	*arrived = read_generation(fd);
+
 	/*
-	 * Add one to size of ENV_TO_KEEP and ENV_FROM_PASSWD to include
-	 * $PATH (note that ENV_TO_KEEP includes a null terminator).
+	 * Poll rather than interrupting a blocking flock(2) with an alarm,
+	 * which the user lookup thread could take instead of us.
 	 */
-	char** envp = xmalloc(sizeof(char*) * (ARRAY_SIZE(ENV_TO_KEEP)
-					+ ARRAY_SIZE(ENV_FROM_PASSWD) + 1));
-	char** next_slot = envp;
-	const char *const * to_keep;
-	const struct pw_env* from_pw;
-
-	*next_slot++ = make_env_var("PATH",
-			pw->pw_uid ? ENV_PATH : ENV_SUPATH);
-
-	for (from_pw = ENV_FROM_PASSWD; *from_pw->name; ++from_pw)
-		*next_slot++ = make_env_var(from_pw->name,
-				pw_at_offset(pw, from_pw->offset));
-
-	for (to_keep = ENV_TO_KEEP; *to_keep; ++to_keep) {
-		const char* value = getenv(*to_keep);
-		if (!value)
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += COPY_LOCK_TIMEOUT;
+	while (!(locked = !flock(fd, LOCK_EX | LOCK_NB))
+			&& (errno == EWOULDBLOCK || errno == EINTR)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > deadline.tv_sec
+				|| (now.tv_sec == deadline.tv_sec
+					&& now.tv_nsec >= deadline.tv_nsec))
+			break;
+		nanosleep(&delay, NULL);
+		if (delay.tv_nsec < 64000000)
+			delay.tv_nsec *= 2;
+	}
+	if (!locked) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * When many invocations start at once with the files out of date, only one
+ * of them copies each file while the rest wait for it.  Anyone who finds a
+ * copy was both started and finished while they waited knows that the files
+ * are current without looking again.
+ */
+static void
+copy_in_files(struct config_entry* config, struct copy_stats* stats)
+{
+	uint64_t arrived = 0, generation;
+	size_t i;
+	int lockfd = -1;
+
+	for (i = 0; i < config->n_files; ++i)
+		if (copy_in_file(config->rootdir, config->files[i],
+					config->copy_flags | COPYFILE_CHECK)
+				== COPYFILE_STALE)
+			break;
+	if (i == config->n_files) {
+		stats->unchanged += config->n_files;
+		return;
+	}
+
+	/*
+	 * Layers without an upper directory are given a fresh one each time,
+	 * so nobody else can be copying into it.
+	 */
+	if (!config->lowerdir || config->upperdir)
+		lockfd = lock_copy(config->name, &arrived);
+	generation = lockfd >= 0 ? read_generation(lockfd) : 0;
+	if (lockfd >= 0 && generation - arrived >= 2) {
+		stats->unchanged += config->n_files;
+		close(lockfd);
+		return;
+	}
+
+	for (i = 0; i < config->n_files; ++i) {
+		if (copy_in_file(config->rootdir, config->files[i],
+					config->copy_flags) == COPYFILE_COPIED)
+			++stats->copied;
+		else
+			++stats->unchanged;
+	}
+
+	if (lockfd >= 0) {
+		write_generation(lockfd, generation + 1);
+		close(lockfd);
+	}
+}
+
+/*
+ * Compose the new root from its layers if it has them, in the private mount
+ * namespace we must already be in.
+ */
+static void
+mount_layers(struct config_entry* config)
+{
+	if (!config->lowerdir)
+		return;
+	if (config->upperdir && !config->workdir)
+		errx(EXIT_FAILURE, "upperdir needs a workdir: %s", config->name);
+	/*
+	 * Separate overlays must not share an upper directory, so only the
+	 * one in the pinned namespace may use it.
+	 */
+	if (config->upperdir && config->namespace != NAMESPACE_PINNED)
+		errx(EXIT_FAILURE, "upperdir needs namespace = pinned: %s",
+			config->name);
+	if (mount_overlay(config->rootdir, config->lowerdir, config->upperdir,
+				config->workdir))
+		err(EXIT_FAILURE, "mount overlay on %s", config->rootdir);
+}
+
+static void
+populate_root(struct config_entry* config, struct copy_stats* stats)
+{
+	mount_layers(config);
+	if (config->copy_mode == COPYMODE_BIND) {
+		if (bind_files(config->rootdir, config->files,
+					config->n_files))
+			err(EXIT_FAILURE, "bind mount");
+	} else
+		copy_in_files(config, stats);
+}
+
+/*
+ * Put ourselves, and so the command, into the configuration's cgroup if it
+ * has one.  What we last set up for each configuration is remembered in
+ * RUN_DIR so that we do not have to do it all again every time.
+ */
+static void
+enter_cgroup(struct config_entry* config, const struct passwd* pw)
+{
+	char* stamp = NULL;
+
+	if (!config->cgroup)
+		return;
+	if (run_dir_usable() && trusted_dir(CGROUP_STAMP_DIR))
+		stamp = run_path(CGROUP_STAMP_DIR, config->name);
+	if (cgroup_enter(config->cgroup, config->name, pw->pw_name,
+				config->cgroup_limits, stamp))
+		err(EXIT_FAILURE, "cgroup %s/%s/%s", config->cgroup,
+			config->name, pw->pw_name);
+	free(stamp);
+}
+
+/*
+ * Serialise everyone who creates or removes pinned namespaces.  The lock is
+ * released when the descriptor is closed, or if we die holding it.
+ */
+static int
+lock_namespaces(void)
+{
+	int fd;
+
+	if (!run_dir_usable())
+		errx(EXIT_FAILURE, "cannot use %s for pinned namespaces", RUN_DIR);
+	if (private_mount_dir(NAMESPACE_DIR))
+		err(EXIT_FAILURE, "private mount %s", NAMESPACE_DIR);
+
+	fd = open(NAMESPACE_LOCK, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s", NAMESPACE_LOCK);
+	if (flock(fd, LOCK_EX))
+		err(EXIT_FAILURE, "lock %s", NAMESPACE_LOCK);
+	return fd;
+}
+
+static void
+teardown_namespace(struct config_entry* config)
+{
+	char* path = run_path(NAMESPACE_DIR, config->name);
+	int lockfd = lock_namespaces();
+
+	if (unpin_mount_namespace(path))
+		err(EXIT_FAILURE, "unpin %s", path);
+
+	close(lockfd);
+	free(path);
+}
+
+/*
+ * Enter the pinned namespace for a configuration, setting it up first if it
+ * does not exist yet or if we have been asked to refresh it.
+ */
+static void
+enter_pinned_root(struct config_entry* config, int refresh,
+		struct copy_stats* stats)
+{
+	char* path = run_path(NAMESPACE_DIR, config->name);
+	int lockfd, hostns;
+
+	if (!refresh && !enter_mount_namespace(path))
+		goto out;
+
+	lockfd = lock_namespaces();
+	if (refresh) {
+		if (unpin_mount_namespace(path))
+			err(EXIT_FAILURE, "unpin %s", path);
+	} else if (!enter_mount_namespace(path)) {
+		/*
+		 * Someone else set it up while we waited for the lock.
+		 */
+		close(lockfd);
+		goto out;
+	}
+
+	hostns = current_mount_namespace();
+	if (hostns < 0)
+		err(EXIT_FAILURE, "open mount namespace");
+	if (private_mount_namespace())
+		err(EXIT_FAILURE, "private mount namespace");
+
+	populate_root(config, stats);
+
+	if (pin_mount_namespace(path, hostns))
+		err(EXIT_FAILURE, "pin %s", path);
+
+	close(hostns);
+	close(lockfd);
+out:
+	free(path);
+}
+
+/*
+ * Get the new root ready for the command: mount its layers and copy or bind
+ * mount files into it, in a pinned namespace if the configuration asks for
+ * one.
+ */
+static void
+prepare_root(struct config_entry* config, int refresh, struct copy_stats* stats)
+{
+	if (config->namespace == NAMESPACE_PINNED)
+		enter_pinned_root(config, refresh, stats);
+	else {
+		if ((config->copy_mode == COPYMODE_BIND || config->lowerdir)
+				&& private_mount_namespace())
+			err(EXIT_FAILURE, "private mount namespace");
+		populate_root(config, stats);
+	}
+}
+
+/*
+ * See the new root as commands do, for looking around in it.  Pinned
+ * layers are only ever mounted once, so we join them rather than mounting
+ * them again.
+ */
+static void
+enter_layers(struct config_entry* config)
+{
+	struct copy_stats stats = { 0, 0 };
+
+	if (!config->lowerdir)
+		return;
+	if (config->namespace == NAMESPACE_PINNED) {
+		enter_pinned_root(config, 0, &stats);
+		return;
+	}
+	if (private_mount_namespace())
+		err(EXIT_FAILURE, "private mount namespace");
+	mount_layers(config);
+}
+
+/*
+ * Open the audit log, which is spooled in RUN_DIR when the system log is
+ * too busy, if we can trust it.
+ */
+static void
+open_audit(const char* arg0)
+{
+	audit_open(arg0, run_dir_usable() ? AUDIT_SPOOL_PATH : NULL);
+}
+
+/*
+ * Forward the audit records spooled while the system log was busy.
+ */
+static int
+drain_audit(const char* arg0)
+{
+	if (getuid())
+		errx(EXIT_FAILURE, "only root can drain the audit spool");
+	if (!run_dir_usable())
+		errx(EXIT_FAILURE, "cannot use %s for the audit spool", RUN_DIR);
+	open_audit(arg0);
+	if (audit_drain() < 0)
+		err(EXIT_FAILURE, "forward audit records");
+	audit_close();
+	return EXIT_SUCCESS;
+}
+
+/*
+ * The shells listed in the current root's /etc/shells that are there, or
+ * just /bin/sh.
+ */
+static int
+root_shells(char*** shells)
+{
+	char* line = NULL;
+	size_t len = 0, alloc = 0;
+	int n = 0;
+	FILE* fp;
+
+	*shells = NULL;
+	fp = fopen("/etc/shells", "re");
+	while (fp && getline(&line, &len, fp) > 0) {
+		line[strcspn(line, " \t\r\n#")] = '\0';
+		if (*line != '/' || access(line, R_OK))
 			continue;
-		*next_slot++ = make_env_var(*to_keep, value);
+		if ((size_t) n == alloc) {
+			alloc = alloc * 2 + 8;
+			*shells = realloc(*shells, alloc * sizeof(char*));
+			if (!*shells)
+				err(EXIT_FAILURE, "out of memory");
+		}
+		(*shells)[n] = strdup(line);
+		if (!(*shells)[n++])
+			err(EXIT_FAILURE, "out of memory");
 	}
+	if (fp)
+		fclose(fp);
+	free(line);
 
-	*next_slot = NULL;
-	return envp;
+	if (!n) {
+		*shells = xmalloc(sizeof(char*));
+		(*shells)[n++] = "/bin/sh";
+	}
+	return n;
 }
 
-static struct config_entry*
-read_configuration(void)
+/*
+ * Read the programs, or the new root's shells if none are given, and the
+ * libraries they need into the page cache, so that the first commands after
+ * booting do not wait for the disk.
+ */
+static int
+prewarm_root(struct config_entry* config, int argc, char* argv[])
 {
-	struct stat statbuf;
-	struct config_entry* entry;
-	int fd = open(CONFIG_PATH, O_RDONLY);
-	if (fd < 0) {
-		if (errno == ENOENT)
-			return NULL;
-		err(EXIT_FAILURE, "read_configuration");
+	struct prewarm_stats stats;
+	struct timespec start, end;
+	long ms;
+	int i;
+
+	if (getuid())
+		errx(EXIT_FAILURE, "only root can prewarm a root");
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	enter_layers(config);
+	if (chroot(config->rootdir) || chdir("/"))
+		err(EXIT_FAILURE, "chroot %s", config->rootdir);
+	if (!argc)
+		argc = root_shells(&argv);
+	for (i = 0; i < argc; ++i) {
+		if (argv[i][0] != '/')
+			errx(EXIT_FAILURE, "not an absolute path: %s", argv[i]);
+		if (access(argv[i], R_OK))
+			err(EXIT_FAILURE, "%s", argv[i]);
 	}
+	if (prewarm(argv, argc, &stats))
+		err(EXIT_FAILURE, "prewarm");
 
-	if (fstat(fd, &statbuf))
-		err(EXIT_FAILURE, "stat");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = (end.tv_sec - start.tv_sec) * 1000
+		+ (end.tv_nsec - start.tv_nsec) / 1000000;
+	printf("prewarmed %u files (%llu bytes) in %ld.%03lds\n",
+		stats.files, stats.bytes, ms / 1000, ms % 1000);
+	return EXIT_SUCCESS;
+}
 
-	if (0 != statbuf.st_uid || 0 != statbuf.st_gid)
-		errx(EXIT_FAILURE, "config file must be owned by root");
+/*
+ * Describe the configuration for tools such as the completion script, which
+ * would otherwise have to parse the configuration themselves.
+ */
+static int
+query_config(struct config_entry* config, uid_t uid, int format)
+{
+	struct query query;
+	struct passwd* pw;
+	char* home;
 
-	if (S_IWGRP & statbuf.st_mode || S_IWOTH & statbuf.st_mode)
-		errx(EXIT_FAILURE, "config file must not be world writable");
+	pw = getpwuid(uid);
+	if (!pw)
+		err(EXIT_FAILURE, "getpwuid");
+	home = strdup(pw->pw_dir);
+	if (!home)
+		err(EXIT_FAILURE, "out of memory");
 
-	if (parse_configfile(fd, &entry))
-		errx(EXIT_FAILURE, "failed to parse config file");
+	query.config = config;
+	query.home = home;
+	query.path = command_path(uid);
+	pw = getpwuid(0);
+	query.root_home = pw ? pw->pw_dir : NULL;
+	query.root_path = command_path(0);
 
-	close(fd);
-	return entry;
+	if (write_query(stdout, &query, format))
+		err(EXIT_FAILURE, "write");
+	free(home);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * List the commands starting with prefix on the PATH that commands run as
+ * uid get in the new root, for the completion script.  Both PATHs are
+ * indexed together in COMMANDS_DIR so that the directories are only read
+ * again when they change.
+ */
+static int
+complete_in_root(struct config_entry* config, uid_t uid, const char* prefix)
+{
+	char* index_path = run_path(COMMANDS_DIR, config->name);
+	size_t len = strlen(command_path(0)) + strlen(command_path(uid)) + 2;
+	char* dirs = xmalloc(len);
+	int dirfd = -1;
+
+	snprintf(dirs, len, "%s:%s", command_path(0), command_path(uid));
+	if (run_dir_usable() && trusted_dir(COMMANDS_DIR))
+		dirfd = open(COMMANDS_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	enter_layers(config);
+	if (chroot(config->rootdir) || chdir("/"))
+		err(EXIT_FAILURE, "chroot %s", config->rootdir);
+
+	if (complete_command(dirfd, xbasename(index_path), dirs,
+				command_path(uid), prefix, stdout))
+		err(EXIT_FAILURE, "list commands");
+	free(dirs);
+	free(index_path);
+	return EXIT_SUCCESS;
+}
+
+static void
+run_server(const char* arg0, struct config_entry* config, int refresh)
+{
+	struct copy_stats copy_stats = { 0, 0 };
+	struct served_cgroup cgroup = { config->cgroup, config->name,
+		config->cgroup_limits, NULL };
+	char* sockpath;
+
+	if (getuid())
+		errx(EXIT_FAILURE, "only root can run a server");
+	if (!run_dir_usable())
+		errx(EXIT_FAILURE, "cannot use %s for the server socket", RUN_DIR);
+	if (mkdir(SERVER_DIR, 0755) && errno != EEXIST)
+		err(EXIT_FAILURE, "mkdir %s", SERVER_DIR);
+	sockpath = run_path(SERVER_DIR, config->name);
+
+	if (-1 != config->personality && set_pers(config->personality))
+		err(EXIT_FAILURE, "set_pers");
+
+	prepare_root(config, refresh, &copy_stats);
+
+	/*
+	 * Each command is put in its user's cgroup as it is started, just as
+	 * it would be without the server.
+	 */
+	if (config->cgroup && run_dir_usable() && trusted_dir(CGROUP_STAMP_DIR))
+		cgroup.stamp = run_path(CGROUP_STAMP_DIR, config->name);
+
+	open_audit(arg0);
+	serve(sockpath, config->rootdir, &copy_stats, &cgroup);
 }
 
+/*
+ * What each child needs to run the command in its own root when fanning out
+ * to several configurations.
+ */
+struct fanout_setup {
+	struct config_entry** configs;
+	const struct passwd* pw;
+	const char* arg0;
+	int refresh;
+	int direct;
+	int supervised;
+	int argc;
+	char** argv;
+};
+
+/*
+ * Set up the root for configuration i and run the command in it just as a
+ * single invocation would.  This runs in the child and does not return.
+ */
 static void
-copy_in_files(const char* rootdir, struct file_list* files)
+enter_fanout_root(size_t i, void* data)
+{
+	const struct fanout_setup* setup = data;
+	struct config_entry* config = setup->configs[i];
+	struct copy_stats copy_stats = { 0, 0 };
+	struct command cmd;
+	char** envp;
+
+	if (setup->direct || config->exec_mode == EXEC_DIRECT)
+		direct_command(&cmd, setup->argc, setup->argv);
+	else
+		login_command(&cmd, setup->pw, setup->argc, setup->argv);
+
+	if (-1 != config->personality && set_pers(config->personality))
+		err(EXIT_FAILURE, "set_pers");
+
+	prepare_root(config, setup->refresh, &copy_stats);
+	open_audit(setup->arg0);
+	if (setup->supervised || config->supervise)
+		supervise(setup->pw, cmd.description, config->rootdir);
+	enter_cgroup(config, setup->pw);
+	switch_root(config->rootdir, setup->pw->pw_dir);
+	set_user(setup->pw, NULL, 0);
+	envp = make_env(setup->pw, kept_env(environ));
+
+	log_session(setup->pw, &cmd, config->rootdir, &copy_stats, NULL);
+	audit_close();
+
+	exec_command(&cmd, envp);
+	err(1, "failed to execute command");
+}
+
+/*
+ * Open a file named by the user with their permissions rather than ours.
+ */
+static FILE*
+open_as_user(uid_t uid, const char* path, const char* mode)
+{
+	FILE* f;
+	int saved_errno;
+
+	if (seteuid(uid))
+		err(EXIT_FAILURE, "seteuid to user");
+	f = fopen(path, mode);
+	saved_errno = errno;
+	if (seteuid(0))
+		err(EXIT_FAILURE, "seteuid to root");
+	if (!f)
+		err(EXIT_FAILURE, "%s", path);
+	errno = saved_errno;
+	return f;
+}
+
+/*
+ * Run the command in every configuration matching patterns, each in its own
+ * child.  Servers are not used, since each child sets up its root itself.
+ */
+static int
+fan_out(const char* arg0, const char* patterns, const char* output_dir,
+		unsigned int jobs, int refresh, int direct, int supervised,
+		struct user_lookup* lookup, int argc, char* argv[])
 {
-	size_t rootlen = strlen(rootdir);
-	struct file_list* entry;
-	for (entry = files; entry; entry = entry->next) {
-		size_t len = strlen(entry->file) + rootlen + 1;
-		char *dstpath = xmalloc(len);
-		snprintf(dstpath, len, "%s%s", rootdir, entry->file);
-		if (copyfile(entry->file, dstpath))
-			err(EXIT_FAILURE, "copyfile");
-		free(dstpath);
+	uid_t uid = getuid();
+	struct fanout_setup setup;
+	struct fanout fanout;
+	struct name_list list;
+	int* output_fds = NULL;
+	unsigned int failed;
+	size_t i;
+
+	match_configurations(patterns, &list);
+
+	setup.configs = xmalloc(sizeof(struct config_entry*) * list.n_names);
+	for (i = 0; i < list.n_names; ++i) {
+		struct config_entry* config = read_configuration(list.names[i]);
+		if (!config)
+			errx(EXIT_FAILURE, "no such configuration: %s",
+				list.names[i]);
+		if (!config->rootdir)
+			errx(EXIT_FAILURE,
+				"no root directory for configuration: %s",
+				list.names[i]);
+		if (refresh && config->namespace != NAMESPACE_PINNED)
+			errx(EXIT_FAILURE,
+				"configuration does not pin a namespace: %s",
+				list.names[i]);
+		setup.configs[i] = config;
+	}
+
+	setup.pw = finish_user_lookup(lookup);
+	if (!setup.pw)
+		err(EXIT_FAILURE, "getpwuid");
+	setup.arg0 = arg0;
+	setup.refresh = refresh;
+	setup.direct = direct;
+	setup.supervised = supervised;
+	setup.argc = argc;
+	setup.argv = argv;
+
+	/*
+	 * As for --results, the output files are named by the user so we
+	 * create them with their permissions.
+	 */
+	if (output_dir) {
+		output_fds = xmalloc(sizeof(int) * list.n_names);
+		for (i = 0; i < list.n_names; ++i) {
+			size_t len = strlen(output_dir)
+				+ strlen(list.names[i]) + 6;
+			char* path = xmalloc(len);
+
+			snprintf(path, len, "%s/%s.log", output_dir,
+				list.names[i]);
+			output_fds[i] = fileno(open_as_user(uid, path, "we"));
+			free(path);
+		}
 	}
+
+	fanout.names = (const char* const*) list.names;
+	fanout.n_children = list.n_names;
+	fanout.jobs = jobs && jobs < list.n_names ? jobs : list.n_names;
+	fanout.stdin_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (fanout.stdin_fd < 0)
+		err(EXIT_FAILURE, "open /dev/null");
+	fanout.output_fds = output_fds;
+	fanout.summary = stderr;
+
+	if (setuid(0))
+		err(EXIT_FAILURE, "setuid to root");
+
+	failed = run_fanout(&fanout, enter_fanout_root, &setup);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static unsigned int
+parse_jobs(const char* arg)
+{
+	char* end;
+	unsigned long jobs;
+
+	errno = 0;
+	jobs = strtoul(arg, &end, 10);
+	if (errno || end == arg || *end || !jobs || jobs > 1024)
+		errx(EXIT_FAILURE, "invalid number of jobs: %s", arg);
+	return jobs;
+}
+
+static int
+parse_query_format(const char* arg)
+{
+	if (!arg || !strcmp(arg, "nul"))
+		return QUERY_NUL;
+	if (!strcmp(arg, "json"))
+		return QUERY_JSON;
+	errx(EXIT_FAILURE, "unknown query format: %s", arg);
+}
+
+static int
+parse_fd(const char* arg)
+{
+	char* end;
+	long fd;
+
+	errno = 0;
+	fd = strtol(arg, &end, 10);
+	if (errno || end == arg || *end || fd < 0 || fd > INT_MAX)
+		errx(EXIT_FAILURE, "invalid file descriptor: %s", arg);
+	if (fcntl(fd, F_GETFD) < 0)
+		err(EXIT_FAILURE, "file descriptor %ld", fd);
+	return fd;
+}
+
+enum {
+	OPT_REFRESH = 256,
+	OPT_TEARDOWN,
+	OPT_SERVE,
+	OPT_BATCH,
+	OPT_JOBS,
+	OPT_RESULTS,
+	OPT_EXEC,
+	OPT_TRACE_FD,
+	OPT_FAN_OUT,
+	OPT_OUTPUT_DIR,
+	OPT_DRAIN_AUDIT,
+	OPT_SUPERVISE,
+	OPT_PREWARM,
+	OPT_QUERY,
+	OPT_COMPLETE_COMMAND,
+	OPT_COMPLETE_ROOT_COMMAND
+};
+
+static const struct option OPTIONS[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "refresh", no_argument, NULL, OPT_REFRESH },
+	{ "teardown", no_argument, NULL, OPT_TEARDOWN },
+	{ "serve", no_argument, NULL, OPT_SERVE },
+	{ "batch", optional_argument, NULL, OPT_BATCH },
+	{ "jobs", required_argument, NULL, OPT_JOBS },
+	{ "results", required_argument, NULL, OPT_RESULTS },
+	{ "exec", no_argument, NULL, OPT_EXEC },
+	{ "trace-fd", required_argument, NULL, OPT_TRACE_FD },
+	{ "fan-out", required_argument, NULL, OPT_FAN_OUT },
+	{ "output-dir", required_argument, NULL, OPT_OUTPUT_DIR },
+	{ "drain-audit", no_argument, NULL, OPT_DRAIN_AUDIT },
+	{ "supervise", no_argument, NULL, OPT_SUPERVISE },
+	{ "prewarm", no_argument, NULL, OPT_PREWARM },
+	{ "query", optional_argument, NULL, OPT_QUERY },
+	{ "complete-command", required_argument, NULL, OPT_COMPLETE_COMMAND },
+	{ "complete-root-command", required_argument, NULL,
+		OPT_COMPLETE_ROOT_COMMAND },
+	{ NULL, 0, NULL, 0 }
+};
+
+static void
+usage(FILE* out, const char* arg0, int status)
+{
+	fprintf(out,
+		"usage: %s [options] [command [args...]]\n"
+		"\n"
+		"  -h, --help    show this help\n"
+		"  --exec        execute the command directly, not with the shell\n"
+		"  --refresh     set up the pinned namespace again before running\n"
+		"  --teardown    remove the pinned namespace and exit\n"
+		"  --serve       run commands for clients of this configuration\n"
+		"  --drain-audit forward audit records spooled while the system\n"
+		"                log was busy\n"
+		"  --supervise   wait for the command and log what it used\n"
+		"  --prewarm     read the shells (or the programs given) and\n"
+		"                their libraries into memory and exit\n"
+		"  --query[=FORMAT]\n"
+		"                describe the configuration as NUL-terminated\n"
+		"                fields, or as JSON with FORMAT=json, and exit\n"
+		"  --complete-command=PREFIX\n"
+		"                list the commands on your PATH in the new root\n"
+		"                that start with PREFIX and exit\n"
+		"  --complete-root-command=PREFIX\n"
+		"                the same for root's PATH\n"
+		"  --trace-fd=FD write how long each stage of setup took to FD\n"
+		"  --batch[=FILE]\n"
+		"                run each NUL-terminated command line from FILE\n"
+		"                (or standard input)\n"
+		"  --jobs=N      run up to N batch commands or roots at once\n"
+		"  --results=FILE\n"
+		"                write the result of each batch command to FILE\n"
+		"  --fan-out=PATTERNS\n"
+		"                run the command in every configuration matching\n"
+		"                one of the comma-separated PATTERNS\n"
+		"  --output-dir=DIR\n"
+		"                write the output from each root to DIR/NAME.log\n",
+		xbasename(arg0));
+	exit(status);
 }
 
 int
@@ -260,81 +1324,293 @@ main(int argc, char* argv[])
 {
 	uid_t uid = getuid();
 	struct passwd* pw;
+	const char* arg0 = argv[0];
 	const char* target_config;
-	char* cmd;
-	char* args[4];
-	gid_t* groups;
-	int n_groups;
+	struct command cmd;
 	char** envp;
 	struct config_entry* config;
+	struct copy_stats copy_stats = { 0, 0 };
+	int opt, refresh = 0, teardown = 0, server = 0;
+	int batch_mode = 0, direct = 0, supervised = 0, prewarming = 0;
+	int query_format = -1;
+	const char* complete_prefix = NULL;
+	uid_t complete_uid = uid;
+	const char* batch_path = NULL;
+	const char* results_path = NULL;
+	const char* fanout_patterns = NULL;
+	const char* output_dir = NULL;
+	unsigned int jobs = 0;
+	struct batch batch = { NULL, NULL, 1, -1, NULL };
+	struct user_lookup lookup;
+	struct trace trace;
+	int trace_fd = -1;
+	char* trace_audit = NULL;
 
-	pw = getpwuid(uid);
-	if (!pw)
-		err(EXIT_FAILURE, "getpwuid");
-	n_groups = getgroups(0, NULL);
-	groups = xmalloc(sizeof(gid_t) * n_groups);
-	if (!getgroups(n_groups, groups))
-		err(EXIT_FAILURE, "getgroups");
-
-	cmd = pw->pw_shell;
-	if (!cmd)
-		cmd = SHELL_PATH;
-
-	args[0] = login_arg0(cmd);
-	if (argc > 1) {
-		args[1] = "-c";
-		args[2] = cmd_string(argc - 1, argv + 1);
-		args[3] = NULL;
-	} else {
-		args[1] = NULL;
-		/*
-		 * Store the command (shell) in args[2] so that we can log
-		 * this value regardless of which path is used to set up the
-		 * argument array.
-		 */
-		args[2] = cmd;
+	trace_start(&trace);
+
+	/*
+	 * Stop at the first non-option so that options to the command are
+	 * left alone.
+	 */
+	while ((opt = getopt_long(argc, argv, "+h", OPTIONS, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(stdout, arg0, EXIT_SUCCESS);
+		case OPT_REFRESH:
+			refresh = 1;
+			break;
+		case OPT_TEARDOWN:
+			teardown = 1;
+			break;
+		case OPT_SERVE:
+			server = 1;
+			break;
+		case OPT_BATCH:
+			batch_mode = 1;
+			batch_path = optarg;
+			break;
+		case OPT_JOBS:
+			jobs = parse_jobs(optarg);
+			break;
+		case OPT_RESULTS:
+			results_path = optarg;
+			break;
+		case OPT_EXEC:
+			direct = 1;
+			break;
+		case OPT_TRACE_FD:
+			trace_fd = parse_fd(optarg);
+			trace.enabled = 1;
+			break;
+		case OPT_FAN_OUT:
+			fanout_patterns = optarg;
+			break;
+		case OPT_OUTPUT_DIR:
+			output_dir = optarg;
+			break;
+		case OPT_DRAIN_AUDIT:
+			return drain_audit(arg0);
+		case OPT_SUPERVISE:
+			supervised = 1;
+			break;
+		case OPT_PREWARM:
+			prewarming = 1;
+			break;
+		case OPT_QUERY:
+			query_format = parse_query_format(optarg);
+			break;
+		case OPT_COMPLETE_COMMAND:
+			complete_prefix = optarg;
+			break;
+		case OPT_COMPLETE_ROOT_COMMAND:
+			complete_prefix = optarg;
+			complete_uid = 0;
+			break;
+		default:
+			usage(stderr, arg0, EXIT_FAILURE);
+		}
 	}
+	argc -= optind;
+	argv += optind;
 
-	target_config = xbasename(argv[0]);
+	if (batch_mode && argc > 0)
+		errx(EXIT_FAILURE, "--batch does not take a command");
+	if (!batch_mode && results_path)
+		errx(EXIT_FAILURE, "--results needs --batch");
+	if (!batch_mode && !fanout_patterns && jobs)
+		errx(EXIT_FAILURE, "--jobs needs --batch or --fan-out");
+	if (!fanout_patterns && output_dir)
+		errx(EXIT_FAILURE, "--output-dir needs --fan-out");
+	/*
+	 * A pinned namespace is shared by everyone using the configuration,
+	 * so only root may pull it out from under them.
+	 */
+	if ((refresh || teardown) && uid)
+		errx(EXIT_FAILURE, "only root can %s a pinned namespace",
+			teardown ? "tear down" : "refresh");
+	if (jobs)
+		batch.jobs = jobs;
 
-	config = read_configuration();
-	while (config) {
-		if (!strcasecmp(target_config, config->name))
-			break;
-		config = config->next;
+	/*
+	 * Look up the user while we read the configuration and prepare the
+	 * new root.  Tearing down, serving, prewarming and queries need
+	 * neither the user nor anything but a single thread.
+	 */
+	if (!teardown && !server && !prewarming && query_format < 0
+			&& !complete_prefix)
+		start_user_lookup(&lookup, uid);
+
+	if (fanout_patterns) {
+		if (batch_mode || server || teardown || prewarming
+				|| query_format >= 0 || complete_prefix
+				|| trace_fd >= 0)
+			errx(EXIT_FAILURE, "--fan-out can only be used to run "
+				"a command");
+		if (argc == 0)
+			errx(EXIT_FAILURE, "--fan-out needs a command");
+		return fan_out(arg0, fanout_patterns, output_dir, jobs,
+				refresh, direct, supervised, &lookup, argc, argv);
 	}
 
+	target_config = xbasename(arg0);
+
+	config = read_configuration(target_config);
 	if (!config)
 		errx(EXIT_FAILURE, "no such configuration: %s", target_config);
 	if (!config->rootdir)
 		errx(EXIT_FAILURE, "no root directory for configuration: %s",
 			target_config);
+	if ((refresh || teardown) && config->namespace != NAMESPACE_PINNED)
+		errx(EXIT_FAILURE, "configuration does not pin a namespace: %s",
+			target_config);
+	if (config->trace == TRACE_SYSLOG)
+		trace.enabled = 1;
+	if (config->supervise)
+		supervised = 1;
+	trace_mark(&trace, "config");
+
+	/*
+	 * Without a command there is nothing to execute directly, so we
+	 * start a login shell as usual.
+	 */
+	if (config->exec_mode == EXEC_DIRECT)
+		direct = 1;
+	if (argc == 0)
+		direct = 0;
+
+	if (teardown) {
+		teardown_namespace(config);
+		return EXIT_SUCCESS;
+	}
+	if (prewarming)
+		return prewarm_root(config, argc, argv);
+	if (query_format >= 0)
+		return query_config(config, uid, query_format);
+	if (complete_prefix)
+		return complete_in_root(config, complete_uid, complete_prefix);
+	if (server)
+		run_server(arg0, config, refresh);
+
+	/*
+	 * Hand over to the server if there is one running, which does not
+	 * return.  Otherwise we do everything ourselves.  Tracing is about
+	 * the stages we go through, and supervising needs the command to be
+	 * our child, so either of them bypasses the server.
+	 */
+	if (config->use_server && !refresh && !batch_mode && trace_fd < 0
+			&& !supervised) {
+		char* sockpath = run_path(SERVER_DIR, config->name);
+		run_on_server(sockpath, direct, argc, argv);
+		free(sockpath);
+	}
+
+	/*
+	 * The lookup can only carry on while we prepare the root if that
+	 * does not involve a mount namespace, since unshare(2) and setns(2)
+	 * refuse a process with more than one thread.  Opening files as the
+	 * user changes the effective user of every thread, so the lookup
+	 * must be done before that as well.
+	 */
+	pw = NULL;
+	if (batch_mode || config->namespace == NAMESPACE_PINNED
+			|| config->copy_mode == COPYMODE_BIND || config->lowerdir) {
+		pw = finish_user_lookup(&lookup);
+		if (!pw)
+			err(EXIT_FAILURE, "getpwuid");
+		trace_mark(&trace, "passwd");
+	}
+
+	if (batch_mode) {
+		/*
+		 * The batch and results files are named by the user so we
+		 * open them with their permissions, and before leaving the
+		 * host's filesystem.
+		 */
+		if (batch_path && strcmp(batch_path, "-")) {
+			batch.input = open_as_user(uid, batch_path, "re");
+		} else {
+			batch.input = stdin;
+			batch.stdin_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+			if (batch.stdin_fd < 0)
+				err(EXIT_FAILURE, "open /dev/null");
+		}
+		if (results_path)
+			batch.results = open_as_user(uid, results_path, "we");
+	}
 
 	if (-1 != config->personality && set_pers(config->personality))
 		err(EXIT_FAILURE, "set_pers");
 	if (setuid(0))
 		err(EXIT_FAILURE, "setuid to root");
 
-	copy_in_files(config->rootdir, config->files_to_copy);
+	prepare_root(config, refresh, &copy_stats);
+	trace_mark(&trace, "prepare");
 
 	/*
 	 * Open the system log before we switch into the new root so that we
 	 * are writing to the host's log.
 	 */
-	openlog(argv[0], LOG_NDELAY, LOG_AUTHPRIV);
+	open_audit(arg0);
+	trace_mark(&trace, "openlog");
+
+	if (!pw) {
+		pw = finish_user_lookup(&lookup);
+		if (!pw)
+			err(EXIT_FAILURE, "getpwuid");
+		trace_mark(&trace, "passwd");
+	}
+	if (!batch_mode) {
+		if (direct)
+			direct_command(&cmd, argc, argv);
+		else
+			login_command(&cmd, pw, argc, argv);
+	}
+
+	/*
+	 * The supervisor is left behind here, still root and on the host,
+	 * while the rest happens in its child.
+	 */
+	if (supervised)
+		supervise(pw, batch_mode ? "batch" : cmd.description,
+				config->rootdir);
+	enter_cgroup(config, pw);
 
 	switch_root(config->rootdir, pw->pw_dir);
-	set_user(pw, groups, n_groups);
+	/*
+	 * Running a setuid program leaves the supplementary groups alone, so
+	 * they are still the user's own.
+	 */
+	set_user(pw, NULL, 0);
+	trace_mark(&trace, "chroot");
 
 	/* Setup restricted environment. */
-	envp = make_env(pw);
+	envp = make_env(pw, kept_env(environ));
+	trace_mark(&trace, "env");
+
+	/*
+	 * We cannot time execve(2) itself, so the trace stops here with
+	 * the command ready to run.
+	 */
+	if (config->trace == TRACE_SYSLOG)
+		trace_audit = trace_fields(&trace);
+	if (trace_fd >= 0 && trace_write_json(&trace, trace_fd, config->name))
+		warn("write trace");
+
+	if (batch_mode) {
+		unsigned int failed;
+
+		batch.audit = trace_audit;
+		failed = run_batch(&batch, pw, envp,
+				config->rootdir, &copy_stats);
+		if (batch.results && fclose(batch.results))
+			err(EXIT_FAILURE, "write results");
+		return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
 
-	syslog(LOG_NOTICE,
-		"[chpersroot user=\"%s\" command=\"%s\" root=\"%s\"]",
-		pw->pw_name, args[2], config->rootdir);
-	closelog();
+	log_session(pw, &cmd, config->rootdir, &copy_stats, trace_audit);
+	audit_close();
 
-	execve(cmd, args, envp);
+	exec_command(&cmd, envp);
 
 	/*
 	 * We only get here if exec fails.
@@ -0,0 +1,347 @@
+#include "cmdindex.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * The index is a sequence of NUL-terminated records, starting with
+ * INDEX_MAGIC.  Each directory has a record giving its device, inode and
+ * modification time followed by its path, and then one record for each
+ * executable in it.  Names cannot contain a slash, so any record that does
+ * is a directory.
+ */
+#define INDEX_MAGIC	"chpersroot-commands 1"
+
+struct indexed_dir {
+	char* path;
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int valid;		/* the names match the stamp */
+	char** names;
+	size_t n_names;
+	size_t alloc;
+};
+
+struct command_index {
+	struct indexed_dir* dirs;
+	size_t n_dirs;
+	int changed;
+};
+
+static void
+add_name(struct indexed_dir* dir, const char* name)
+{
+	if (dir->n_names == dir->alloc) {
+		dir->alloc = dir->alloc * 2 + 64;
+		dir->names = realloc(dir->names, dir->alloc * sizeof(char*));
+		if (!dir->names)
+			err(EXIT_FAILURE, "out of memory");
+	}
+	dir->names[dir->n_names] = strdup(name);
+	if (!dir->names[dir->n_names++])
+		err(EXIT_FAILURE, "out of memory");
+}
+
+static void
+clear_names(struct indexed_dir* dir)
+{
+	size_t i;
+
+	for (i = 0; i < dir->n_names; ++i)
+		free(dir->names[i]);
+	dir->n_names = 0;
+}
+
+static struct indexed_dir*
+find_dir(struct command_index* index, const char* path, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < index->n_dirs; ++i)
+		if (strlen(index->dirs[i].path) == len
+				&& !memcmp(index->dirs[i].path, path, len))
+			return &index->dirs[i];
+	return NULL;
+}
+
+/*
+ * An entry for each distinct absolute directory in the colon-separated
+ * list, in order.
+ */
+static void
+init_index(struct command_index* index, const char* dirs)
+{
+	size_t n = 1;
+	const char* p;
+
+	for (p = dirs; *p; ++p)
+		n += *p == ':';
+	index->dirs = calloc(n, sizeof(*index->dirs));
+	if (!index->dirs)
+		err(EXIT_FAILURE, "out of memory");
+	index->n_dirs = 0;
+	index->changed = 0;
+
+	while (*dirs) {
+		size_t len = strcspn(dirs, ":");
+
+		if (*dirs == '/' && !find_dir(index, dirs, len)) {
+			struct indexed_dir* dir = &index->dirs[index->n_dirs++];
+			dir->path = strndup(dirs, len);
+			if (!dir->path)
+				err(EXIT_FAILURE, "out of memory");
+		}
+		dirs += len;
+		if (*dirs == ':')
+			++dirs;
+	}
+}
+
+static void
+free_index(struct command_index* index)
+{
+	size_t i;
+
+	for (i = 0; i < index->n_dirs; ++i) {
+		clear_names(&index->dirs[i]);
+		free(index->dirs[i].names);
+		free(index->dirs[i].path);
+	}
+	free(index->dirs);
+}
+
+/*
+ * Fill in what the saved index knows about the directories we are
+ * interested in.  Anything wrong with it just means reading the
+ * directories again.
+ */
+static void
+load_index(struct command_index* index, int dirfd, const char* file)
+{
+	struct indexed_dir* dir = NULL;
+	struct stat statbuf;
+	char* buf;
+	char* p;
+	char* end;
+	ssize_t n;
+	size_t len = 0;
+	int fd;
+
+	fd = openat(dirfd, file, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &statbuf) || !S_ISREG(statbuf.st_mode)) {
+		close(fd);
+		return;
+	}
+	buf = xmalloc(statbuf.st_size + 1);
+	while (len < (size_t) statbuf.st_size) {
+		n = read(fd, buf + len, statbuf.st_size - len);
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	close(fd);
+	buf[len] = '\0';
+	end = buf + len;
+
+	p = buf;
+	if (len < sizeof(INDEX_MAGIC) || strcmp(p, INDEX_MAGIC))
+		goto out;
+	for (p += sizeof(INDEX_MAGIC); p < end; p += strlen(p) + 1) {
+		char* path = strchr(p, '/');
+		uint64_t dev, ino;
+		int64_t sec, nsec;
+
+		if (!path) {
+			if (dir)
+				add_name(dir, p);
+			continue;
+		}
+		if (sscanf(p, "%" SCNu64 " %" SCNu64 " %" SCNd64 " %" SCNd64 " ",
+					&dev, &ino, &sec, &nsec) != 4)
+			goto out;
+		dir = find_dir(index, path, strlen(path));
+		if (dir && dir->valid)
+			dir = NULL;
+		if (dir) {
+			dir->dev = dev;
+			dir->ino = ino;
+			dir->mtime_sec = sec;
+			dir->mtime_nsec = nsec;
+			dir->valid = 1;
+		}
+	}
+out:
+	free(buf);
+}
+
+static int
+compare_names(const void* a, const void* b)
+{
+	return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+/*
+ * Read dir again if it has changed since it was indexed.  Its stamp is
+ * taken before it is read, so that a change made while we read it is
+ * noticed next time.
+ */
+static void
+update_dir(struct command_index* index, struct indexed_dir* dir)
+{
+	struct stat statbuf;
+	struct dirent* ent;
+	DIR* d;
+
+	if (stat(dir->path, &statbuf) || !S_ISDIR(statbuf.st_mode)) {
+		if (!dir->valid || dir->n_names || dir->dev || dir->ino)
+			index->changed = 1;
+		clear_names(dir);
+		dir->dev = dir->ino = 0;
+		dir->mtime_sec = dir->mtime_nsec = 0;
+		dir->valid = 1;
+		return;
+	}
+	if (dir->valid && dir->dev == (uint64_t) statbuf.st_dev
+			&& dir->ino == (uint64_t) statbuf.st_ino
+			&& dir->mtime_sec == statbuf.st_mtim.tv_sec
+			&& dir->mtime_nsec == statbuf.st_mtim.tv_nsec)
+		return;
+
+	index->changed = 1;
+	clear_names(dir);
+	dir->dev = statbuf.st_dev;
+	dir->ino = statbuf.st_ino;
+	dir->mtime_sec = statbuf.st_mtim.tv_sec;
+	dir->mtime_nsec = statbuf.st_mtim.tv_nsec;
+	dir->valid = 1;
+
+	d = opendir(dir->path);
+	if (!d)
+		return;
+	while ((ent = readdir(d))) {
+		struct stat st;
+
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		if (fstatat(dirfd(d), ent->d_name, &st, 0)
+				|| !S_ISREG(st.st_mode)
+				|| !(st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
+			continue;
+		add_name(dir, ent->d_name);
+	}
+	closedir(d);
+	qsort(dir->names, dir->n_names, sizeof(char*), compare_names);
+}
+
+/*
+ * Replace the index with a new file, so that anyone reading it at the same
+ * time sees either the old one or the new one.
+ */
+static void
+save_index(const struct command_index* index, int dirfd, const char* file)
+{
+	char tmp[NAME_MAX + 1];
+	FILE* fp;
+	size_t i, j;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), ".%s.%d", file, (int) getpid())
+			>= (int) sizeof(tmp))
+		return;
+	fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW
+			| O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		unlinkat(dirfd, tmp, 0);
+		return;
+	}
+
+	fprintf(fp, "%s%c", INDEX_MAGIC, '\0');
+	for (i = 0; i < index->n_dirs; ++i) {
+		const struct indexed_dir* dir = &index->dirs[i];
+
+		fprintf(fp, "%" PRIu64 " %" PRIu64 " %" PRId64 " %" PRId64
+				" %s%c", dir->dev, dir->ino, dir->mtime_sec,
+				dir->mtime_nsec, dir->path, '\0');
+		for (j = 0; j < dir->n_names; ++j)
+			fprintf(fp, "%s%c", dir->names[j], '\0');
+	}
+
+	if (fclose(fp) || renameat(dirfd, tmp, dirfd, file))
+		unlinkat(dirfd, tmp, 0);
+}
+
+int
+complete_command(int dirfd, const char* file, const char* dirs,
+		const char* path, const char* prefix, FILE* out)
+{
+	struct command_index index;
+	const char** matches = NULL;
+	size_t n_matches = 0, alloc = 0;
+	size_t prefix_len = strlen(prefix);
+	size_t i, j;
+	int ret;
+
+	init_index(&index, dirs);
+	if (dirfd >= 0)
+		load_index(&index, dirfd, file);
+	for (i = 0; i < index.n_dirs; ++i)
+		update_dir(&index, &index.dirs[i]);
+	if (dirfd >= 0 && index.changed)
+		save_index(&index, dirfd, file);
+
+	while (*path) {
+		size_t len = strcspn(path, ":");
+		struct indexed_dir* dir = find_dir(&index, path, len);
+
+		/*
+		 * The index is of everything root can see, but the names in
+		 * a directory are only listed if the user we are running for
+		 * could have read it for themselves.
+		 */
+		if (dir && access(dir->path, R_OK | X_OK))
+			dir = NULL;
+		for (j = 0; dir && j < dir->n_names; ++j) {
+			if (strncmp(dir->names[j], prefix, prefix_len))
+				continue;
+			if (n_matches == alloc) {
+				alloc = alloc * 2 + 64;
+				matches = realloc(matches,
+						alloc * sizeof(char*));
+				if (!matches)
+					err(EXIT_FAILURE, "out of memory");
+			}
+			matches[n_matches++] = dir->names[j];
+		}
+		path += len;
+		if (*path == ':')
+			++path;
+	}
+
+	qsort(matches, n_matches, sizeof(char*), compare_names);
+	for (i = 0; i < n_matches; ++i)
+		if (!i || strcmp(matches[i - 1], matches[i]))
+			fprintf(out, "%s%c", matches[i], '\0');
+
+	ret = fflush(out) || ferror(out) ? -1 : 0;
+	free(matches);
+	free_index(&index);
+	return ret;
+}
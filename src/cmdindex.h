@@ -0,0 +1,29 @@
+#ifndef CMDINDEX_H
+#define CMDINDEX_H
+
+#include <stdio.h>
+
+/*
+ * Completing a command in the new root would mean reading every directory
+ * on its PATH each time, which is slow when there are thousands of
+ * programs or the root is on slow storage.  Instead the executables in each
+ * directory are kept in an index, which is only read again for directories
+ * whose modification time has changed.
+ */
+
+/*
+ * Bring the index in file, relative to the directory dirfd, up to date with
+ * dirs, a colon-separated list of directories in the current root, and then
+ * write the executables starting with prefix found in the directories of
+ * path (which should all be in dirs) to out.  Each name is written once,
+ * in sorted order and terminated by a NUL.  Directories that the real user
+ * and group cannot read and search are left out, although the index, which
+ * only root can read, has them all.  If dirfd is -1 nothing is kept
+ * and every directory is read.  Failing to save the index is not an error.
+ * Returns 0, or -1 with errno set.
+ */
+int
+complete_command(int dirfd, const char* file, const char* dirs,
+		const char* path, const char* prefix, FILE* out);
+
+#endif // CMDINDEX_H
@@ -0,0 +1,629 @@
+#include "configcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * The compiled configuration is a flat file with the same layout as a struct
+ * config: a header, an array of entries, an array of copyfile paths and the
+ * string pool, which is written out unchanged.  Everything refers to
+ * everything else by offset so the file can be mapped at any address.
+ */
+#define CACHE_MAGIC	"CPRCACHE"
+#define CACHE_VERSION	11
+#define CACHE_NONE	UINT32_MAX
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_entries;
+	uint64_t size;
+	uint64_t src_dev;
+	uint64_t src_ino;
+	uint64_t src_size;
+	int64_t src_mtime_sec;
+	int64_t src_mtime_nsec;
+	uint32_t n_paths;
+	uint32_t strings_len;
+};
+
+struct cache_entry {
+	uint32_t name;
+	uint32_t rootdir;
+	int32_t personality;
+	int32_t copy_mode;
+	int32_t copy_flags;
+	int32_t namespace;
+	int32_t use_server;
+	int32_t exec_mode;
+	int32_t trace;
+	int32_t supervise;
+	uint32_t cgroup;
+	uint32_t cgroup_limits[CGROUP_N_LIMITS];
+	uint32_t lowerdir;
+	uint32_t upperdir;
+	uint32_t workdir;
+	uint32_t first_path;
+	uint32_t n_paths;
+};
+
+struct configcache {
+	void* map;
+	size_t size;
+	const struct cache_header* header;
+	const struct cache_entry* entries;
+	const uint32_t* paths;
+	const char* strings;
+};
+
+static inline size_t
+cache_size(uint32_t n_entries, uint32_t n_paths, uint32_t strings_len)
+{
+	return sizeof(struct cache_header)
+		+ n_entries * sizeof(struct cache_entry)
+		+ n_paths * sizeof(uint32_t)
+		+ strings_len;
+}
+
+static int
+cache_matches(const struct cache_header* header, const struct stat* src)
+{
+	return header->src_dev == (uint64_t) src->st_dev
+		&& header->src_ino == (uint64_t) src->st_ino
+		&& header->src_size == (uint64_t) src->st_size
+		&& header->src_mtime_sec == (int64_t) src->st_mtim.tv_sec
+		&& header->src_mtime_nsec == (int64_t) src->st_mtim.tv_nsec;
+}
+
+static int
+valid_string(const configcache* cache, uint32_t offset)
+{
+	return offset == CACHE_NONE || offset < cache->header->strings_len;
+}
+
+static int
+cache_validate(const configcache* cache)
+{
+	const struct cache_header* header = cache->header;
+	uint32_t i, j;
+
+	/*
+	 * The string pool must end with a NUL so that any offset inside it
+	 * refers to a terminated string.
+	 */
+	if (!header->strings_len || cache->strings[header->strings_len - 1])
+		return -1;
+
+	for (i = 0; i < header->n_entries; ++i) {
+		const struct cache_entry* entry = &cache->entries[i];
+		if (entry->name == CACHE_NONE || !valid_string(cache, entry->name)
+				|| !valid_string(cache, entry->rootdir)
+				|| !valid_string(cache, entry->cgroup)
+				|| !valid_string(cache, entry->lowerdir)
+				|| !valid_string(cache, entry->upperdir)
+				|| !valid_string(cache, entry->workdir))
+			return -1;
+		for (j = 0; j < CGROUP_N_LIMITS; ++j)
+			if (!valid_string(cache, entry->cgroup_limits[j]))
+				return -1;
+		if (entry->first_path > header->n_paths
+				|| entry->n_paths > header->n_paths - entry->first_path)
+			return -1;
+		for (j = 0; j < entry->n_paths; ++j)
+			if (cache->paths[entry->first_path + j] == CACHE_NONE
+					|| !valid_string(cache,
+						cache->paths[entry->first_path + j]))
+				return -1;
+	}
+	return 0;
+}
+
+/*
+ * Map the file at path if it is at least min_size bytes and only root can
+ * have written it.
+ */
+static void*
+map_trusted(const char* path, size_t min_size, size_t* size)
+{
+	struct stat statbuf;
+	void* map;
+	int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &statbuf) || !S_ISREG(statbuf.st_mode)
+			|| 0 != statbuf.st_uid
+			|| (S_IWGRP | S_IWOTH) & statbuf.st_mode
+			|| statbuf.st_size < min_size) {
+		close(fd);
+		return NULL;
+	}
+
+	*size = statbuf.st_size;
+	map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+configcache*
+configcache_open(const char* cachepath, const struct stat* src)
+{
+	configcache* cache;
+	const struct cache_header* header;
+
+	cache = calloc(1, sizeof(configcache));
+	if (!cache)
+		return NULL;
+
+	cache->map = map_trusted(cachepath, sizeof(struct cache_header),
+			&cache->size);
+	if (!cache->map) {
+		free(cache);
+		return NULL;
+	}
+
+	header = cache->header = cache->map;
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic))
+			|| header->version != CACHE_VERSION
+			|| header->size != cache->size
+			|| !cache_matches(header, src)
+			|| header->n_entries > cache->size
+			|| header->n_paths > cache->size
+			|| header->strings_len > cache->size
+			|| cache_size(header->n_entries, header->n_paths,
+				header->strings_len) != cache->size)
+		goto stale;
+
+	cache->entries = (const struct cache_entry*) (header + 1);
+	cache->paths = (const uint32_t*) (cache->entries + header->n_entries);
+	cache->strings = (const char*) (cache->paths + header->n_paths);
+
+	if (cache_validate(cache))
+		goto stale;
+
+	return cache;
+
+stale:
+	configcache_close(cache);
+	return NULL;
+}
+
+void
+configcache_close(configcache* cache)
+{
+	if (!cache)
+		return;
+
+	munmap(cache->map, cache->size);
+	free(cache);
+}
+
+static inline const char*
+cache_string(const configcache* cache, uint32_t offset)
+{
+	if (offset == CACHE_NONE)
+		return NULL;
+	return cache->strings + offset;
+}
+
+struct config_entry*
+configcache_lookup(configcache* cache, const char* name)
+{
+	const struct cache_entry* found = NULL;
+	struct config_entry* entry;
+	uint32_t i;
+
+	for (i = 0; i < cache->header->n_entries; ++i) {
+		if (!strcasecmp(name, cache_string(cache, cache->entries[i].name))) {
+			found = &cache->entries[i];
+			break;
+		}
+	}
+	if (!found)
+		return NULL;
+
+	entry = calloc(1, sizeof(struct config_entry)
+			+ found->n_paths * sizeof(const char*));
+	if (!entry)
+		return NULL;
+
+	entry->name = cache_string(cache, found->name);
+	entry->rootdir = cache_string(cache, found->rootdir);
+	entry->personality = found->personality;
+	entry->copy_mode = found->copy_mode;
+	entry->copy_flags = found->copy_flags;
+	entry->namespace = found->namespace;
+	entry->use_server = found->use_server;
+	entry->exec_mode = found->exec_mode;
+	entry->trace = found->trace;
+	entry->supervise = found->supervise;
+	entry->cgroup = cache_string(cache, found->cgroup);
+	for (i = 0; i < CGROUP_N_LIMITS; ++i)
+		entry->cgroup_limits[i] = cache_string(cache,
+				found->cgroup_limits[i]);
+	entry->lowerdir = cache_string(cache, found->lowerdir);
+	entry->upperdir = cache_string(cache, found->upperdir);
+	entry->workdir = cache_string(cache, found->workdir);
+
+	entry->files = (const char**) (entry + 1);
+	entry->n_files = found->n_paths;
+	for (i = 0; i < found->n_paths; ++i)
+		entry->files[i] = cache_string(cache,
+				cache->paths[found->first_path + i]);
+	return entry;
+}
+
+/*
+ * Atomically replace the file at path with size bytes from buf.
+ */
+static int
+replace_file(const char* path, const void* buf, size_t size)
+{
+	size_t pathlen = strlen(path);
+	char* tmppath;
+	int fd, retval = -1;
+
+	tmppath = malloc(pathlen + 8);
+	if (!tmppath) {
+		errno = ENOMEM;
+		return -1;
+	}
+	snprintf(tmppath, pathlen + 8, "%s.XXXXXX", path);
+
+	fd = mkstemp(tmppath);
+	if (fd < 0)
+		goto err_open;
+
+	if (fchmod(fd, 0644))
+		goto err;
+	if (size != write(fd, buf, size))
+		goto err;
+	if (close(fd)) {
+		fd = -1;
+		goto err;
+	}
+	fd = -1;
+
+	if (rename(tmppath, path))
+		goto err;
+
+	retval = 0;
+
+err:
+	if (fd >= 0)
+		close(fd);
+	if (retval)
+		unlink(tmppath);
+err_open:
+	free(tmppath);
+	return retval;
+}
+
+/*
+ * Every string in a struct config is in its pool.
+ */
+static inline uint32_t
+pool_offset(const struct config* config, const char* str)
+{
+	if (!str)
+		return CACHE_NONE;
+	return str - config->strings;
+}
+
+int
+configcache_write(const char* cachepath, const struct stat* src,
+		const struct config* config)
+{
+	static const struct config empty = { 0, NULL, 0, NULL, 1, "" };
+	struct cache_header* header;
+	struct cache_entry* cache_entries;
+	uint32_t* paths;
+	size_t size, i, j;
+	char* buf;
+	int retval;
+
+	/*
+	 * The pool is never empty, so that it always ends with a NUL.
+	 */
+	if (!config || !config->strings_len)
+		config = &empty;
+	if (config->strings_len >= CACHE_NONE
+			|| config->n_files >= CACHE_NONE
+			|| config->n_entries >= CACHE_NONE) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	size = cache_size(config->n_entries, config->n_files,
+			config->strings_len);
+	buf = calloc(1, size);
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	header = (struct cache_header*) buf;
+	cache_entries = (struct cache_entry*) (header + 1);
+	paths = (uint32_t*) (cache_entries + config->n_entries);
+
+	memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+	header->version = CACHE_VERSION;
+	header->n_entries = config->n_entries;
+	header->size = size;
+	header->src_dev = src->st_dev;
+	header->src_ino = src->st_ino;
+	header->src_size = src->st_size;
+	header->src_mtime_sec = src->st_mtim.tv_sec;
+	header->src_mtime_nsec = src->st_mtim.tv_nsec;
+	header->n_paths = config->n_files;
+	header->strings_len = config->strings_len;
+
+	for (i = 0; i < config->n_entries; ++i) {
+		const struct config_entry* entry = &config->entries[i];
+		struct cache_entry* cache_entry = &cache_entries[i];
+
+		cache_entry->name = pool_offset(config, entry->name);
+		cache_entry->rootdir = pool_offset(config, entry->rootdir);
+		cache_entry->personality = entry->personality;
+		cache_entry->copy_mode = entry->copy_mode;
+		cache_entry->copy_flags = entry->copy_flags;
+		cache_entry->namespace = entry->namespace;
+		cache_entry->use_server = entry->use_server;
+		cache_entry->exec_mode = entry->exec_mode;
+		cache_entry->trace = entry->trace;
+		cache_entry->supervise = entry->supervise;
+		cache_entry->cgroup = pool_offset(config, entry->cgroup);
+		for (j = 0; j < CGROUP_N_LIMITS; ++j)
+			cache_entry->cgroup_limits[j] = pool_offset(config,
+					entry->cgroup_limits[j]);
+		cache_entry->lowerdir = pool_offset(config, entry->lowerdir);
+		cache_entry->upperdir = pool_offset(config, entry->upperdir);
+		cache_entry->workdir = pool_offset(config, entry->workdir);
+		cache_entry->first_path = entry->files - config->files;
+		cache_entry->n_paths = entry->n_files;
+	}
+	for (j = 0; j < config->n_files; ++j)
+		paths[j] = pool_offset(config, config->files[j]);
+	memcpy(paths + config->n_files, config->strings, config->strings_len);
+
+	retval = replace_file(cachepath, buf, size);
+	free(buf);
+	return retval;
+}
+
+const char*
+configcache_name(const configcache* cache, size_t i)
+{
+	if (i >= cache->header->n_entries)
+		return NULL;
+	return cache_string(cache, cache->entries[i].name);
+}
+
+/*
+ * The index of a drop-in directory is a header followed by a record for
+ * each file, in the order the files are read: its name, then its device,
+ * inode, size, modification time and number of sections as
+ * "dev ino size sec nsec count", then the names of its sections, each
+ * terminated by a NUL.
+ */
+#define INDEX_MAGIC	"CPRINDEX"
+#define INDEX_VERSION	2
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t size;
+	uint64_t dir_dev;
+	uint64_t dir_ino;
+	int64_t dir_mtime_sec;
+	int64_t dir_mtime_nsec;
+};
+
+struct configcache_index {
+	void* map;
+	size_t size;
+	const char* pairs;
+	const char* end;
+};
+
+configcache_index*
+configcache_index_open(const char* indexpath, const struct stat* dir)
+{
+	configcache_index* index = calloc(1, sizeof(configcache_index));
+	const struct index_header* header;
+
+	if (!index)
+		return NULL;
+
+	index->map = map_trusted(indexpath, sizeof(struct index_header),
+			&index->size);
+	if (!index->map) {
+		free(index);
+		return NULL;
+	}
+
+	header = index->map;
+	index->pairs = (const char*) (header + 1);
+	index->end = (const char*) index->map + index->size;
+
+	/*
+	 * Adding, removing or renaming a file changes the directory's
+	 * modification time.  The pairs must end with a NUL so that every
+	 * string in them is terminated.
+	 */
+	if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic))
+			|| header->version != INDEX_VERSION
+			|| header->size != index->size
+			|| header->dir_dev != (uint64_t) dir->st_dev
+			|| header->dir_ino != (uint64_t) dir->st_ino
+			|| header->dir_mtime_sec != (int64_t) dir->st_mtim.tv_sec
+			|| header->dir_mtime_nsec != (int64_t) dir->st_mtim.tv_nsec
+			|| (index->end > index->pairs && index->end[-1])) {
+		configcache_index_close(index);
+		return NULL;
+	}
+
+	return index;
+}
+
+void
+configcache_index_close(configcache_index* index)
+{
+	if (!index)
+		return;
+
+	munmap(index->map, index->size);
+	free(index);
+}
+
+/*
+ * Whether the file at dir/file still has the stamp it had when the index
+ * was written.
+ */
+static int
+index_file_current(const char* dir, const char* file, const char* stamp)
+{
+	char path[PATH_MAX];
+	struct stat statbuf;
+	uint64_t dev, ino, size;
+	int64_t sec, nsec;
+
+	if (sscanf(stamp, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNd64
+				" %" SCNd64, &dev, &ino, &size, &sec, &nsec) != 5)
+		return 0;
+	if (snprintf(path, sizeof(path), "%s/%s", dir, file)
+			>= (int) sizeof(path) || stat(path, &statbuf))
+		return 0;
+	return dev == (uint64_t) statbuf.st_dev
+		&& ino == (uint64_t) statbuf.st_ino
+		&& size == (uint64_t) statbuf.st_size
+		&& sec == (int64_t) statbuf.st_mtim.tv_sec
+		&& nsec == (int64_t) statbuf.st_mtim.tv_nsec;
+}
+
+const char*
+configcache_index_lookup(const configcache_index* index, const char* dir,
+		const char* name)
+{
+	const char* p = index->pairs;
+
+	while (p < index->end) {
+		const char* file = p;
+		const char* stamp = file + strlen(file) + 1;
+		const char* count;
+		unsigned long n, i;
+		int found = 0;
+
+		if (stamp >= index->end)
+			break;
+		count = strrchr(stamp, ' ');
+		if (!count || !index_file_current(dir, file, stamp))
+			return NULL;
+		n = strtoul(count + 1, NULL, 10);
+		p = stamp + strlen(stamp) + 1;
+		for (i = 0; i < n && p < index->end; ++i) {
+			if (!strcasecmp(name, p))
+				found = 1;
+			p += strlen(p) + 1;
+		}
+		if (found)
+			return file;
+	}
+	return NULL;
+}
+
+/*
+ * Leave room for the header, which is filled in when the index is written.
+ */
+static int
+index_start(struct configcache_index_builder* builder)
+{
+	if (builder->buf)
+		return 0;
+
+	builder->alloc = 4096;
+	builder->buf = calloc(1, builder->alloc);
+	if (!builder->buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+	builder->len = sizeof(struct index_header);
+	return 0;
+}
+
+static int
+index_append(struct configcache_index_builder* builder, const char* str)
+{
+	size_t len = strlen(str) + 1;
+
+	while (builder->len + len > builder->alloc) {
+		char* bigger = realloc(builder->buf, builder->alloc * 2);
+		if (!bigger) {
+			errno = ENOMEM;
+			return -1;
+		}
+		builder->buf = bigger;
+		builder->alloc *= 2;
+	}
+
+	memcpy(builder->buf + builder->len, str, len);
+	builder->len += len;
+	return 0;
+}
+
+int
+configcache_index_add(struct configcache_index_builder* builder,
+		const char* file, const struct stat* statbuf,
+		const char* const* names, size_t n_names)
+{
+	char stamp[128];
+	size_t i;
+
+	if (index_start(builder))
+		return -1;
+	snprintf(stamp, sizeof(stamp), "%" PRIu64 " %" PRIu64 " %" PRIu64
+			" %" PRId64 " %" PRId64 " %zu",
+			(uint64_t) statbuf->st_dev, (uint64_t) statbuf->st_ino,
+			(uint64_t) statbuf->st_size,
+			(int64_t) statbuf->st_mtim.tv_sec,
+			(int64_t) statbuf->st_mtim.tv_nsec, n_names);
+	if (index_append(builder, file) || index_append(builder, stamp))
+		return -1;
+	for (i = 0; i < n_names; ++i)
+		if (index_append(builder, names[i]))
+			return -1;
+	return 0;
+}
+
+int
+configcache_index_write(const char* indexpath, const struct stat* dir,
+		struct configcache_index_builder* builder)
+{
+	struct index_header* header;
+
+	if (index_start(builder))
+		return -1;
+
+	header = (struct index_header*) builder->buf;
+	memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+	header->version = INDEX_VERSION;
+	header->size = builder->len;
+	header->dir_dev = dir->st_dev;
+	header->dir_ino = dir->st_ino;
+	header->dir_mtime_sec = dir->st_mtim.tv_sec;
+	header->dir_mtime_nsec = dir->st_mtim.tv_nsec;
+
+	return replace_file(indexpath, builder->buf, builder->len);
+}
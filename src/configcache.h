@@ -0,0 +1,90 @@
+#ifndef CONFIGCACHE_H
+#define CONFIGCACHE_H
+
+#include <sys/stat.h>
+
+#include "configfile.h"
+
+typedef struct configcache configcache;
+
+/*
+ * Map the compiled configuration at cachepath.  The cache is only used if it
+ * is owned by root, not writable by anyone else and was generated from the
+ * file described by src (same device, inode, size and modification time).
+ * Returns NULL if the cache is missing, stale or malformed.
+ */
+configcache*
+configcache_open(const char* cachepath, const struct stat* src);
+
+void
+configcache_close(configcache* cache);
+
+/*
+ * Find the first section called name (compared case insensitively).  The
+ * returned entry and its array of files are a single allocation whose strings
+ * point into the mapping, so the cache must stay open while it is in use
+ * and the entry is released with free(3).
+ */
+struct config_entry*
+configcache_lookup(configcache* cache, const char* name);
+
+/*
+ * Atomically replace the compiled configuration at cachepath with config,
+ * which was parsed from the file described by src.
+ */
+int
+configcache_write(const char* cachepath, const struct stat* src,
+		const struct config* config);
+
+/*
+ * The name of entry i in the cache, or NULL if there are not that many.
+ */
+const char*
+configcache_name(const configcache* cache, size_t i);
+
+/*
+ * An index from section name to the file in a drop-in directory that
+ * defines it.  Like the cache, it is only used if it is owned by root and
+ * not writable by anyone else, and only while the directory described by
+ * dir has not been modified since the index was written.
+ */
+typedef struct configcache_index configcache_index;
+
+configcache_index*
+configcache_index_open(const char* indexpath, const struct stat* dir);
+
+void
+configcache_index_close(configcache_index* index);
+
+/*
+ * Return the name of the first file in dir that defines the section name
+ * (compared case insensitively), which is valid until the index is closed.
+ * Editing a file in place leaves the directory alone, so every file up to
+ * that one must also be unchanged since the index was written, or NULL is
+ * returned as it is when no file defines the section.
+ */
+const char*
+configcache_index_lookup(const configcache_index* index, const char* dir,
+		const char* name);
+
+/*
+ * A new index is built by adding each file, described by statbuf, with the
+ * names of its sections as it is read, and is then written out.  The
+ * builder should start zeroed and buf be freed afterwards.
+ */
+struct configcache_index_builder {
+	char* buf;
+	size_t len;
+	size_t alloc;
+};
+
+int
+configcache_index_add(struct configcache_index_builder* builder,
+		const char* file, const struct stat* statbuf,
+		const char* const* names, size_t n_names);
+
+int
+configcache_index_write(const char* indexpath, const struct stat* dir,
+		struct configcache_index_builder* builder);
+
+#endif // CONFIGCACHE_H
@@ -1,14 +1,17 @@
 #include "configfile.h"
+#include "copyfile.h"
 #include "iniparser.h"
 
-#include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/personality.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -46,152 +49,540 @@ static struct personality PERSONALITIES[] = {
 };
 
 
-#define BUFFER_SIZE	4096 - 2 * sizeof(struct config_entry*) \
-				- 3 * sizeof(int) - sizeof(FILE*)
+/*
+ * Configuration files are small, so one that fits is read onto the stack
+ * rather than mapped.
+ */
+#define INPUT_SIZE	4096
 
-struct parse_state {
-	struct config_entry* first_entry;
-	struct config_entry* current_entry;
+struct input {
+	const char* buf;
+	size_t len;
+	void* map;
+	size_t map_len;
+	char* heap;
+};
+
+/*
+ * Small configurations intern their strings with a table on the stack.
+ */
+#define STACK_TABLE_SIZE	256
+
+/*
+ * The configuration is built in a single block holding the struct config,
+ * its entries, the copyfile paths and the string pool.  The same files tend
+ * to be copied into every root, and the same cgroup settings and overlay
+ * layers used for many of them, so while it is built table is an
+ * open-addressed hash of those strings in the pool, letting each distinct
+ * one be stored once.  Its slots hold offsets plus one, and zero when
+ * empty.  Names and root and upper directories are rarely repeated, so they
+ * are simply copied.
+ */
+struct builder {
+	struct config* config;
+	char* strings;
+	uint32_t* table;
+	size_t table_mask;
+	uint32_t* stack_table;
+	const char* input_end;
+	int single;
+	int quiet;		/* say nothing about what is wrong */
+	int lineno;
+	int failed;
 };
 
 void
-free_file_list(struct file_list* list) {
-	while (list) {
-		struct file_list* next = list->next;
-		free(list->file);
-		list = next;
-		free(list);
-	}
+free_config(struct config* config)
+{
+	free(config);
 }
 
-void
-free_config_entry(struct config_entry* entry) {
-	if (!entry)
-		return;
+struct config_entry*
+config_find(const struct config* config, const char* name)
+{
+	size_t i;
 
-	free(entry->name);
-	free(entry->rootdir);
-	free_file_list(entry->files_to_copy);
-	free(entry);
+	if (!config)
+		return NULL;
+	for (i = 0; i < config->n_entries; ++i)
+		if (!strcasecmp(name, config->entries[i].name))
+			return &config->entries[i];
+	return NULL;
 }
 
-void
-free_config_entries(struct config_entry* entries) {
-	while (entries) {
-		struct config_entry* next = entries->next;
-		free_config_entry(entries);
-		entries = next;
-	}
+static int
+view_is(iniparser_view view, const char* str)
+{
+	size_t len = strlen(str);
+	return view.len == len && !strncasecmp(view.str, str, len);
 }
 
-static int
-config_begin_section(void* data, const char* section_name)
+static uint32_t
+hash_view(iniparser_view view)
 {
-	struct parse_state* state = data;
-	struct config_entry* entry = calloc(1, sizeof(struct config_entry));
-	if (!entry) {
-		errno = ENOMEM;
-		return -1;
-	}
+	uint32_t hash = 2166136261u;
+	size_t i;
 
-	entry->name = strdup(section_name);
-	entry->personality = -1;
-	if (!entry->name) {
-		free(entry);
-		return -1;
+	for (i = 0; i < view.len; ++i)
+		hash = (hash ^ (unsigned char) view.str[i]) * 16777619u;
+	return hash;
+}
+
+static const char*
+copy_view(struct builder* b, iniparser_view view)
+{
+	struct config* config = b->config;
+	char* str = b->strings + config->strings_len;
+
+	memcpy(str, view.str, view.len);
+	str[view.len] = '\0';
+	config->strings_len += view.len + 1;
+	return str;
+}
+
+static const char*
+intern_view(struct builder* b, iniparser_view view)
+{
+	size_t slot = hash_view(view) & b->table_mask;
+	const char* str;
+
+	for (; b->table[slot]; slot = (slot + 1) & b->table_mask) {
+		str = b->strings + b->table[slot] - 1;
+		if (!strncmp(str, view.str, view.len) && !str[view.len])
+			return str;
 	}
 
-	if (state->current_entry)
-		state->current_entry->next = entry;
-	else
-		state->first_entry = entry;
+	b->table[slot] = b->config->strings_len + 1;
+	return copy_view(b, view);
+}
+
+/*
+ * Note that the value on the current line is wrong, returning a placeholder
+ * for it.  Parsing stops after the line and fails.
+ */
+static int
+value_error(struct builder* b, const char* fmt, ...)
+{
+	va_list ap;
 
-	state->current_entry = entry;
+	if (!b->quiet) {
+		fprintf(stderr, "configuration file error on line %d: ",
+			b->lineno);
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		fputc('\n', stderr);
+	}
+	b->failed = 1;
 	return 0;
 }
 
 static int
-parse_personality(const char* value)
+parse_personality(struct builder* b, iniparser_view value)
 {
 	struct personality* pers;
 	for (pers = PERSONALITIES; pers->name; ++pers)
-		if (!strcasecmp(pers->name, value))
+		if (view_is(value, pers->name))
 			return pers->value;
 
-	errx(EXIT_FAILURE, "unknown personality: %s", value);
+	return value_error(b, "unknown personality: %.*s",
+		(int) value.len, value.str);
+}
+
+const char*
+personality_name(unsigned int personality)
+{
+	struct personality* pers;
+	for (pers = PERSONALITIES; pers->name; ++pers)
+		if ((unsigned int) pers->value == personality)
+			return pers->name;
+	return NULL;
 }
 
 static int
-config_value_pair(void* data, const char* key, const char* value)
+parse_copymode(struct builder* b, iniparser_view value)
 {
-	struct parse_state* state = data;
-	struct config_entry* entry = state->current_entry;
+	if (view_is(value, "copy"))
+		return COPYMODE_COPY;
+	if (view_is(value, "bind"))
+		return COPYMODE_BIND;
 
-	if (!entry)
+	return value_error(b, "unknown copymode: %.*s",
+		(int) value.len, value.str);
+}
+
+static int
+parse_bool(struct builder* b, iniparser_view key, iniparser_view value)
+{
+	if (view_is(value, "yes") || view_is(value, "true")
+			|| view_is(value, "1"))
+		return 1;
+	if (view_is(value, "no") || view_is(value, "false")
+			|| view_is(value, "0"))
 		return 0;
 
-	if (!strcasecmp(key, "rootdir")) {
-		entry->rootdir = strdup(value);
-		if (!entry->rootdir)
-			return -1;
-	} else if (!strcasecmp(key, "personality")) {
-		entry->personality = parse_personality(value);
-		if (-1 == entry->personality)
-			return -1;
-	} else if (!strcasecmp(key, "copyfile")) {
-		struct file_list* fl = calloc(1, sizeof(struct file_list));
-		if (!fl) {
+	return value_error(b, "%.*s must be yes or no: %.*s",
+		(int) key.len, key.str, (int) value.len, value.str);
+}
+
+static int
+parse_namespace(struct builder* b, iniparser_view value)
+{
+	if (view_is(value, "none"))
+		return NAMESPACE_NONE;
+	if (view_is(value, "pinned"))
+		return NAMESPACE_PINNED;
+
+	return value_error(b, "unknown namespace: %.*s",
+		(int) value.len, value.str);
+}
+
+static int
+parse_exec(struct builder* b, iniparser_view value)
+{
+	if (view_is(value, "shell"))
+		return EXEC_SHELL;
+	if (view_is(value, "direct"))
+		return EXEC_DIRECT;
+
+	return value_error(b, "unknown exec: %.*s",
+		(int) value.len, value.str);
+}
+
+static int
+parse_trace(struct builder* b, iniparser_view value)
+{
+	if (view_is(value, "none"))
+		return TRACE_NONE;
+	if (view_is(value, "syslog"))
+		return TRACE_SYSLOG;
+
+	return value_error(b, "unknown trace: %.*s",
+		(int) value.len, value.str);
+}
+
+static int
+parse_copycheck(struct builder* b, iniparser_view value)
+{
+	if (view_is(value, "metadata"))
+		return 0;
+	if (view_is(value, "content"))
+		return COPYFILE_CONTENT;
+	if (view_is(value, "none"))
+		return COPYFILE_ALWAYS;
+
+	return value_error(b, "unknown copycheck: %.*s",
+		(int) value.len, value.str);
+}
+
+static int
+find_cgroup_limit(iniparser_view key)
+{
+	int i;
+	for (i = 0; i < CGROUP_N_LIMITS; ++i)
+		if (view_is(key, CGROUP_LIMITS[i]))
+			return i;
+	return -1;
+}
+
+static void
+config_begin_section(struct builder* b, iniparser_view name)
+{
+	struct config* config = b->config;
+	struct config_entry* entry = &config->entries[config->n_entries++];
+
+	memset(entry, 0, sizeof(*entry));
+	entry->name = copy_view(b, name);
+	entry->personality = -1;
+	entry->files = &config->files[config->n_files];
+}
+
+static void
+config_value_pair(struct builder* b, iniparser_view key, iniparser_view value)
+{
+	struct config* config = b->config;
+	struct config_entry* entry;
+	int limit;
+
+	if (!config || !config->n_entries)
+		return;
+
+	entry = &config->entries[config->n_entries - 1];
+	if (view_is(key, "rootdir")) {
+		entry->rootdir = copy_view(b, value);
+	} else if (view_is(key, "personality")) {
+		entry->personality = parse_personality(b, value);
+	} else if (view_is(key, "copymode")) {
+		entry->copy_mode = parse_copymode(b, value);
+	} else if (view_is(key, "copycheck")) {
+		entry->copy_flags = parse_copycheck(b, value);
+	} else if (view_is(key, "namespace")) {
+		entry->namespace = parse_namespace(b, value);
+	} else if (view_is(key, "server")) {
+		entry->use_server = parse_bool(b, key, value);
+	} else if (view_is(key, "exec")) {
+		entry->exec_mode = parse_exec(b, value);
+	} else if (view_is(key, "trace")) {
+		entry->trace = parse_trace(b, value);
+	} else if (view_is(key, "supervise")) {
+		entry->supervise = parse_bool(b, key, value);
+	} else if (view_is(key, "cgroup")) {
+		entry->cgroup = intern_view(b, value);
+	} else if ((limit = find_cgroup_limit(key)) >= 0) {
+		entry->cgroup_limits[limit] = intern_view(b, value);
+	} else if (view_is(key, "lowerdir")) {
+		entry->lowerdir = intern_view(b, value);
+	} else if (view_is(key, "upperdir")) {
+		entry->upperdir = copy_view(b, value);
+	} else if (view_is(key, "workdir")) {
+		entry->workdir = copy_view(b, value);
+	} else if (view_is(key, "copyfile")) {
+		config->files[config->n_files++] = intern_view(b, value);
+		++entry->n_files;
+	} else if (!b->quiet)
+		fprintf(stderr, "warning: unknown configuration key: %.*s\n",
+			(int) key.len, key.str);
+}
+
+/*
+ * A NUL ends a name or value, as it would in a C string.
+ */
+static inline iniparser_view
+trim_nul(iniparser_view view)
+{
+	view.len = strnlen(view.str, view.len);
+	return view;
+}
+
+static size_t
+count_bytes(const char* p, const char* end, int c)
+{
+	size_t n = 0;
+	while ((p = memchr(p, c, end - p))) {
+		++n;
+		++p;
+	}
+	return n;
+}
+
+/*
+ * Allocate the block when the first section is found, at name in the input
+ * (or anywhere before it).  What is left of the input bounds what the parse
+ * can produce: every section starts with a '[', every file or rootdir needs
+ * an '=', and every string is copied from a distinct part of the input
+ * followed by a delimiter that is not copied.
+ */
+static int
+reserve_config(struct builder* b, const char* name)
+{
+	size_t max_entries = b->single ? 1 : 1 + count_bytes(name,
+			b->input_end, '[');
+	size_t max_values = count_bytes(name, b->input_end, '=');
+	size_t table_size = STACK_TABLE_SIZE;
+	struct config* config;
+
+	while (table_size < 2 * max_values)
+		table_size *= 2;
+	if (table_size == STACK_TABLE_SIZE) {
+		b->table = b->stack_table;
+		memset(b->table, 0, table_size * sizeof(uint32_t));
+	} else {
+		b->table = calloc(table_size, sizeof(uint32_t));
+		if (!b->table) {
 			errno = ENOMEM;
 			return -1;
 		}
-		fl->file = strdup(value);
-		if (!fl->file) {
-			free(fl);
-			return -1;
+	}
+	b->table_mask = table_size - 1;
+
+	config = malloc(sizeof(struct config)
+			+ max_entries * sizeof(struct config_entry)
+			+ max_values * sizeof(const char*)
+			+ (b->input_end - name));
+	if (!config) {
+		errno = ENOMEM;
+		return -1;
+	}
+	config->n_entries = 0;
+	config->entries = (struct config_entry*) (config + 1);
+	config->n_files = 0;
+	config->files = (const char**) (config->entries + max_entries);
+	config->strings_len = 0;
+	config->strings = (const char*) (config->files + max_values);
+	b->strings = (char*) config->strings;
+	b->config = config;
+	return 0;
+}
+
+static int
+build_config(iniparser* parser, const struct input* in, const char* name,
+		struct builder* b)
+{
+	iniparser_event event;
+	int result = 0;
+
+	iniparser_begin(parser, in->buf, in->len, name);
+	while (iniparser_next(parser, &event) != INIPARSER_END) {
+		if (event.type == INIPARSER_SECTION) {
+			/*
+			 * A heading split by an escaped line break is
+			 * copied, so bound the block by the whole input.
+			 */
+			const char* start = event.section.str;
+			if (start < in->buf || start > in->buf + in->len)
+				start = in->buf;
+			if (!b->config && reserve_config(b, start)) {
+				result = -1;
+				break;
+			}
+			config_begin_section(b, trim_nul(event.section));
+		} else if (event.type == INIPARSER_VALUE) {
+			b->lineno = event.lineno;
+			config_value_pair(b, trim_nul(event.key),
+					trim_nul(event.value));
+			if (b->failed) {
+				errno = EINVAL;
+				result = -1;
+				break;
+			}
+		} else {
+			if (!b->quiet)
+				fprintf(stderr, "configuration file error "
+					"on line %d: %s\n",
+					event.lineno, event.error);
+			errno = EINVAL;
+			result = -1;
+			break;
 		}
-		fl->next = entry->files_to_copy;
-		entry->files_to_copy = fl;
-	} else
-		fprintf(stderr, "warning: unknown configuration key: %s\n", key);
+	}
+	iniparser_end(parser);
+	return result;
+}
 
+/*
+ * Read the rest of the file open on fd into buf, which holds size bytes,
+ * moving to the heap if it does not fit.
+ */
+static int
+read_input(int fd, char* buf, size_t size, struct input* in)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	for (;;) {
+		if (len == size) {
+			char* bigger = realloc(in->heap, size * 2);
+			if (!bigger) {
+				errno = ENOMEM;
+				return -1;
+			}
+			if (!in->heap)
+				memcpy(bigger, buf, len);
+			in->heap = buf = bigger;
+			size *= 2;
+		}
+		n = read(fd, buf + len, size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		len += n;
+	}
+	in->buf = buf;
+	in->len = len;
 	return 0;
 }
 
-static void
-config_fatal_error(void* data, int lineno, const char* msg)
+static int
+load_input(int fd, char* buf, size_t size, struct input* in)
 {
-	fprintf(stderr, "configuration file error on line %d: %s\n",
-		lineno, msg);
+	struct stat statbuf;
+
+	in->map = NULL;
+	in->map_len = 0;
+	in->heap = NULL;
+
+	if (!fstat(fd, &statbuf) && S_ISREG(statbuf.st_mode)
+			&& statbuf.st_size > (off_t) size
+			&& statbuf.st_size <= SIZE_MAX) {
+		off_t offset = lseek(fd, 0, SEEK_CUR);
+		if (offset >= 0 && offset <= statbuf.st_size) {
+			void* map = mmap(NULL, statbuf.st_size, PROT_READ,
+					MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED) {
+				in->map = map;
+				in->map_len = statbuf.st_size;
+				in->buf = (const char*) map + offset;
+				in->len = statbuf.st_size - offset;
+				return 0;
+			}
+		}
+	}
+	return read_input(fd, buf, size, in);
 }
 
-static iniparser_callbacks config_callbacks = {
-	config_begin_section,
-	config_value_pair,
-	config_fatal_error
-};
+static void
+release_input(struct input* in)
+{
+	if (in->map)
+		munmap(in->map, in->map_len);
+	free(in->heap);
+}
 
-int
-parse_configfile(int fd, struct config_entry** entries)
+/*
+ * Parse only the section called name, or the whole file if that is NULL.
+ */
+static int
+parse_config(int fd, const char* name, int quiet, struct config** config)
 {
+	char stackbuf[INPUT_SIZE];
+	uint32_t stack_table[STACK_TABLE_SIZE];
+	struct builder b = { NULL, NULL, NULL, 0, stack_table, NULL, 0,
+		quiet, 0, 0 };
+	struct input in;
+	iniparser* parser;
 	int retval = -1;
-	struct parse_state* state = calloc(1, sizeof(struct parse_state));
-	iniparser* parser = iniparser_alloc(&config_callbacks, state);
-	if (!state || !parser) {
-		errno = ENOMEM;
-		goto err;
-	}
 
-	if (iniparser_parsefd(parser, fd))
-		goto err;
+	if (load_input(fd, stackbuf, sizeof(stackbuf), &in)) {
+		release_input(&in);
+		return -1;
+	}
+	b.input_end = in.buf + in.len;
+	b.single = name != NULL;
 
-	*entries = state->first_entry;
-	state->first_entry = NULL;
-	retval = 0;
+	parser = iniparser_alloc(NULL, NULL);
+	if (!parser) {
+		errno = ENOMEM;
+	} else if (!build_config(parser, &in, name, &b)) {
+		*config = b.config;
+		b.config = NULL;
+		retval = 0;
+	}
 
-err:
+	free_config(b.config);
+	if (b.table != stack_table)
+		free(b.table);
 	iniparser_free(parser);
-	if (state)
-		free_config_entries(state->first_entry);
-	free(state);
+	release_input(&in);
 	return retval;
 }
+
+int
+parse_configfile(int fd, struct config** config)
+{
+	return parse_config(fd, NULL, 0, config);
+}
+
+int
+parse_configfile_quiet(int fd, struct config** config)
+{
+	return parse_config(fd, NULL, 1, config);
+}
+
+int
+parse_configsection(int fd, const char* name, struct config** config)
+{
+	return parse_config(fd, name, 0, config);
+}
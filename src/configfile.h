@@ -1,29 +1,106 @@
 #ifndef CONFIGFILE_H
 #define CONFIGFILE_H
 
-struct file_list {
-	char* file;
-	struct file_list* next;
-};
+#include <stddef.h>
+
+#include "cgroup.h"
+
+/*
+ * How copyfile entries are brought into the new root.
+ */
+#define COPYMODE_COPY	0	/* copy the files in place */
+#define COPYMODE_BIND	1	/* bind mount them in a private namespace */
+
+/*
+ * Whether the mount namespace for a configuration is kept between runs.
+ */
+#define NAMESPACE_NONE		0	/* set up the new root on every run */
+#define NAMESPACE_PINNED	1	/* set it up once and pin it in RUN_DIR */
+
+/*
+ * How the command is started in the new root.
+ */
+#define EXEC_SHELL	0	/* run it with the user's login shell */
+#define EXEC_DIRECT	1	/* execute it directly, searching PATH */
+
+/*
+ * Where to report how long each stage of setting up the new root took.
+ */
+#define TRACE_NONE	0	/* only when asked to with --trace-fd */
+#define TRACE_SYSLOG	1	/* in the audit log entry as well */
 
 struct config_entry {
-	char* name;
-	char* rootdir;
+	const char* name;
+	const char* rootdir;
 	unsigned int personality;
-	struct file_list* files_to_copy;
-	struct config_entry* next;
+	int copy_mode;
+	int copy_flags;
+	int namespace;
+	int use_server;
+	int exec_mode;
+	int trace;
+	int supervise;
+	const char* cgroup;	/* delegated cgroup v2 directory, or NULL */
+	const char* cgroup_limits[CGROUP_N_LIMITS];
+	const char* lowerdir;	/* overlay layers below rootdir, or NULL */
+	const char* upperdir;
+	const char* workdir;
+	const char** files;	/* copyfile paths, in the order given */
+	size_t n_files;
 };
 
-void
-free_file_list(struct file_list* list);
+/*
+ * A parsed configuration file.  The entries, the copyfile paths they each
+ * have a slice of and the strings everything points to (with each distinct
+ * string stored once, in the pool at strings) are a single allocation.
+ */
+struct config {
+	size_t n_entries;
+	struct config_entry* entries;
+	size_t n_files;
+	const char** files;
+	size_t strings_len;
+	const char* strings;
+};
 
 void
-free_config_entry(struct config_entry* entry);
+free_config(struct config* config);
 
-void
-free_config_entries(struct config_entry* entries);
+/*
+ * The name used for personality in configuration files, or NULL if it has
+ * none.
+ */
+const char*
+personality_name(unsigned int personality);
+
+/*
+ * Find the first entry called name (compared case insensitively) in config,
+ * which may be NULL.
+ */
+struct config_entry*
+config_find(const struct config* config, const char* name);
+
+/*
+ * Parse the file open on fd.  *config is left NULL if the file has no
+ * sections.
+ */
+int
+parse_configfile(int fd, struct config** config);
+
+/*
+ * Parse the file as parse_configfile() does without printing any errors or
+ * warnings, for a compiled copy whose sections are reported on as they are
+ * looked up with parse_configsection().
+ */
+int
+parse_configfile_quiet(int fd, struct config** config);
 
+/*
+ * Parse only the section called name, leaving *config NULL if the file does
+ * not contain it.  Only the first section with that name is read, which is
+ * the one config_find() on the result of parse_configfile() would find.
+ */
 int
-parse_configfile(int fd, struct config_entry** entries);
+parse_configsection(int fd, const char* name, struct config** config);
 
 #endif // CONFIGFILE_H
@@ -1,15 +1,42 @@
+/*
+ * Define _GNU_SOURCE so we get copy_file_range(2) and SEEK_DATA/SEEK_HOLE.
+ */
+#define _GNU_SOURCE
+
 #include "copyfile.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-const size_t BUFFER_SIZE = 1024;
+const size_t BUFFER_SIZE = 128 * 1024;
+
+/*
+ * The ways of moving data between two files, from cheapest to most
+ * expensive.  Once one of them turns out not to be supported for a pair of
+ * files we drop down to the next for the rest of the copy.
+ */
+enum copy_method {
+	COPY_RANGE,
+	COPY_SENDFILE,
+	COPY_READWRITE
+};
+
+struct copy_state {
+	int srcfd;
+	int dstfd;
+	enum copy_method method;
+	char* buf;
+};
 
 static int
 tmpdst(const char* dstpath, char** tmppath)
@@ -21,51 +48,263 @@ tmpdst(const char* dstpath, char** tmppath)
 	return mkstemp(*tmppath);
 }
 
+static int
+read_full(int fd, char* buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = read(fd, buf + done, len - done);
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+static int
+same_content(int srcfd, int dstfd)
+{
+	char* srcbuf = malloc(2 * BUFFER_SIZE);
+	char* dstbuf = srcbuf + BUFFER_SIZE;
+	int same = 0;
+
+	if (!srcbuf)
+		return 0;
+
+	for (;;) {
+		int s = read_full(srcfd, srcbuf, BUFFER_SIZE);
+		int d = read_full(dstfd, dstbuf, BUFFER_SIZE);
+		if (s < 0 || s != d || memcmp(srcbuf, dstbuf, s))
+			break;
+		if (s == 0) {
+			same = 1;
+			break;
+		}
+	}
+
+	free(srcbuf);
+	if (lseek(srcfd, 0, SEEK_SET))
+		return -1;
+	return same;
+}
+
+/*
+ * Decide whether dstpath already holds an up to date copy of the source.
+ * Only a regular file can be current, so a symlink or device planted inside
+ * the new root is always replaced rather than followed or opened.
+ */
+static int
+is_current(int srcfd, const struct stat* src, const char* dstpath, int flags)
+{
+	struct stat dst, opened;
+	int dstfd, same;
+
+	if (flags & COPYFILE_ALWAYS)
+		return 0;
+
+	if (lstat(dstpath, &dst)
+			|| !S_ISREG(dst.st_mode)
+			|| src->st_size != dst.st_size
+			|| src->st_mtim.tv_sec != dst.st_mtim.tv_sec
+			|| src->st_mtim.tv_nsec != dst.st_mtim.tv_nsec
+			|| src->st_mode != dst.st_mode
+			|| src->st_uid != dst.st_uid
+			|| src->st_gid != dst.st_gid)
+		return 0;
+
+	if (!(flags & COPYFILE_CONTENT))
+		return 1;
+
+	dstfd = open(dstpath, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (dstfd < 0)
+		return 0;
+
+	/*
+	 * Make sure we are comparing against the file we just checked.
+	 */
+	same = 0;
+	if (!fstat(dstfd, &opened) && opened.st_dev == dst.st_dev
+			&& opened.st_ino == dst.st_ino)
+		same = same_content(srcfd, dstfd);
+
+	close(dstfd);
+	return same;
+}
+
+static inline int
+unsupported(int e)
+{
+	return e == EINVAL || e == EXDEV || e == ENOSYS || e == EOPNOTSUPP
+		|| e == ENOTSUP || e == EBADF;
+}
+
+static ssize_t
+copy_chunk(struct copy_state* cs, off_t offset, size_t len)
+{
+	ssize_t n, w, done;
+	loff_t in, out;
+
+	switch (cs->method) {
+	case COPY_RANGE:
+		in = out = offset;
+		n = copy_file_range(cs->srcfd, &in, cs->dstfd, &out, len, 0);
+		if (n >= 0 || !unsupported(errno))
+			return n;
+		cs->method = COPY_SENDFILE;
+		/* fallthrough */
+	case COPY_SENDFILE:
+		in = offset;
+		if (lseek(cs->dstfd, offset, SEEK_SET) < 0)
+			return -1;
+		n = sendfile(cs->dstfd, cs->srcfd, &in, len);
+		if (n >= 0 || !unsupported(errno))
+			return n;
+		cs->method = COPY_READWRITE;
+		/* fallthrough */
+	case COPY_READWRITE:
+		if (!cs->buf) {
+			cs->buf = malloc(BUFFER_SIZE);
+			if (!cs->buf) {
+				errno = ENOMEM;
+				return -1;
+			}
+		}
+		if (len > BUFFER_SIZE)
+			len = BUFFER_SIZE;
+		n = pread(cs->srcfd, cs->buf, len, offset);
+		for (done = 0; done < n; done += w) {
+			w = pwrite(cs->dstfd, cs->buf + done, n - done,
+					offset + done);
+			if (w < 0)
+				return -1;
+		}
+		return n;
+	}
+	return -1;
+}
+
+/*
+ * Copy the bytes from start up to end, or to the end of the file if that
+ * comes first.
+ */
+static int
+copy_extent(struct copy_state* cs, off_t start, off_t end)
+{
+	while (start < end) {
+		ssize_t n = copy_chunk(cs, start, end - start);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		start += n;
+	}
+	return 0;
+}
+
+/*
+ * Copy the contents of srcfd into the empty file dstfd.  A reflink is tried
+ * first since it shares the data blocks outright; otherwise the data is
+ * copied in the kernel where possible.  Holes in sparse files are skipped
+ * over and recreated by extending the file at the end.
+ */
+static int
+copy_data(int srcfd, int dstfd, const struct stat* statbuf)
+{
+	struct copy_state cs = { srcfd, dstfd, COPY_RANGE, NULL };
+	off_t data, hole;
+	int retval = -1;
+
+	if (!ioctl(dstfd, FICLONE, srcfd))
+		return 0;
+
+	/*
+	 * Files that do not report a size (such as those in /proc) can only
+	 * be copied by reading until we hit the end.
+	 */
+	if (!S_ISREG(statbuf->st_mode) || !statbuf->st_size) {
+		cs.method = COPY_READWRITE;
+		retval = copy_extent(&cs, 0, INT64_MAX);
+		goto out;
+	}
+
+	if ((off_t) statbuf->st_blocks * 512 >= statbuf->st_size) {
+		retval = copy_extent(&cs, 0, INT64_MAX);
+		goto out;
+	}
+
+	for (data = 0; data < statbuf->st_size; data = hole) {
+		data = lseek(srcfd, data, SEEK_DATA);
+		if (data < 0) {
+			/*
+			 * ENXIO means there is no more data, only a hole
+			 * running to the end of the file.
+			 */
+			if (errno != ENXIO)
+				goto out;
+			break;
+		}
+		hole = lseek(srcfd, data, SEEK_HOLE);
+		if (hole < 0 || copy_extent(&cs, data, hole))
+			goto out;
+	}
+	retval = ftruncate(dstfd, statbuf->st_size);
+
+out:
+	free(cs.buf);
+	return retval;
+}
+
 int
-copyfile(const char* srcpath, const char* dstpath)
+copyfile(const char* srcpath, const char* dstpath, int flags)
 {
 	int srcfd, dstfd;
 	struct stat statbuf;
+	struct timespec times[2];
 	char* tmppath = NULL;
-	char* buf = NULL;
 	int retval = -1;
 
 	srcfd = open(srcpath, O_RDONLY);
 	if (srcfd < 0)
 		goto err_src;
 
-	dstfd = tmpdst(dstpath, &tmppath);
-	if (dstfd < 0)
+	if (fstat(srcfd, &statbuf))
 		goto err_dst;
 
-	buf = malloc(BUFFER_SIZE);
-	if (!buf) {
-		errno = ENOMEM;
-		goto err;
+	switch (is_current(srcfd, &statbuf, dstpath, flags)) {
+	case 1:
+		retval = COPYFILE_UNCHANGED;
+		goto err_dst;
+	case -1:
+		goto err_dst;
 	}
-
-	for (;;) {
-		ssize_t w = 0, buf_start;
-		ssize_t count = read(srcfd, buf, BUFFER_SIZE);
-		if (count < 0)
-			goto err;
-		if (count == 0)
-			break;
-
-		for (buf_start = 0; buf_start < count; buf_start += w) {
-			w = write(dstfd, buf + buf_start, count - buf_start);
-			if (w < 0)
-				goto err;
-		}
+	if (flags & COPYFILE_CHECK) {
+		retval = COPYFILE_STALE;
+		goto err_dst;
 	}
 
-	if (fstat(srcfd, &statbuf))
+	dstfd = tmpdst(dstpath, &tmppath);
+	if (dstfd < 0)
+		goto err_dst;
+
+	if (copy_data(srcfd, dstfd, &statbuf))
 		goto err;
+
 	if (fchown(dstfd, statbuf.st_uid, statbuf.st_gid))
 		goto err;
 	if (fchmod(dstfd, statbuf.st_mode))
 		goto err;
 
+	/*
+	 * Carry the modification time across so that the next call can tell
+	 * that the copy is current.
+	 */
+	times[0] = statbuf.st_atim;
+	times[1] = statbuf.st_mtim;
+	if (futimens(dstfd, times))
+		goto err;
+
 	if (close(dstfd))
 		goto err;
 	dstfd = -1;
@@ -75,10 +314,9 @@ copyfile(const char* srcpath, const char* dstpath)
 		goto err;
 	}
 
-	retval = 0;
+	retval = COPYFILE_COPIED;
 
 err:
-	free(buf);
 	if (dstfd >= 0) {
 		close(dstfd);
 		unlink(tmppath);
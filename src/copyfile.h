@@ -1,7 +1,25 @@
 #ifndef COPYFILE_H
 #define COPYFILE_H
 
+/*
+ * Flags for copyfile().  By default the copy is skipped if the destination
+ * is a regular file with the same size, modification time, mode and owner
+ * as the source.
+ */
+#define COPYFILE_CONTENT	0x1	/* also require identical contents */
+#define COPYFILE_ALWAYS		0x2	/* copy even if the file looks current */
+#define COPYFILE_CHECK		0x4	/* only check whether it is current */
+
+#define COPYFILE_COPIED		0
+#define COPYFILE_UNCHANGED	1
+#define COPYFILE_STALE		2	/* needs copying, with COPYFILE_CHECK */
+
+/*
+ * Returns COPYFILE_COPIED or COPYFILE_UNCHANGED on success, or with
+ * COPYFILE_CHECK either COPYFILE_UNCHANGED or COPYFILE_STALE, and -1 on
+ * error.
+ */
 int
-copyfile(const char* srcpath, const char* dstpath);
+copyfile(const char* srcpath, const char* dstpath, int flags);
 
 #endif // COPYFILE_H
@@ -0,0 +1,297 @@
+/*
+ * Define _GNU_SOURCE so we get ppoll(2) and pipe2(2).
+ */
+#define _GNU_SOURCE
+
+#include "fanout.h"
+#include "util.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Output from a child that has not yet made up a whole line.
+ */
+struct line_buffer {
+	char* buf;
+	size_t len;
+	size_t alloc;
+};
+
+struct child {
+	size_t index;
+	pid_t pid;		/* 0 once it has been reaped */
+	int fds[2];		/* our ends of its stdout and stderr, or -1 */
+	struct line_buffer lines[2];
+};
+
+struct result {
+	int status;
+	struct timespec start;
+	struct timespec end;
+};
+
+static void
+write_prefixed(FILE* out, const char* name, const char* line, size_t len)
+{
+	fprintf(out, "[%s] ", name);
+	fwrite(line, 1, len, out);
+	if (!len || line[len - 1] != '\n')
+		fputc('\n', out);
+}
+
+/*
+ * Copy whatever is waiting on the child's stream to out, returning 0 at the
+ * end of the stream.  A partial line is kept until the rest arrives, or
+ * written out on its own at the end.
+ */
+static int
+copy_lines(int fd, struct line_buffer* lines, const char* name, FILE* out)
+{
+	char* start;
+	char* nl;
+	ssize_t n;
+
+	if (lines->alloc - lines->len < BUFSIZ) {
+		lines->alloc = lines->alloc * 2 + BUFSIZ;
+		lines->buf = realloc(lines->buf, lines->alloc);
+		if (!lines->buf)
+			err(EXIT_FAILURE, "out of memory");
+	}
+
+	n = read(fd, lines->buf + lines->len, lines->alloc - lines->len);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 1;
+	if (n <= 0) {
+		if (lines->len)
+			write_prefixed(out, name, lines->buf, lines->len);
+		fflush(out);
+		lines->len = 0;
+		return 0;
+	}
+	lines->len += n;
+
+	start = lines->buf;
+	while ((nl = memchr(start, '\n', lines->buf + lines->len - start))) {
+		write_prefixed(out, name, start, nl - start + 1);
+		start = nl + 1;
+	}
+	lines->len -= start - lines->buf;
+	memmove(lines->buf, start, lines->len);
+	fflush(out);
+	return 1;
+}
+
+static void
+start_child(struct child* child, const struct fanout* fanout,
+		const sigset_t* mask, void (*start) (size_t i, void* data),
+		void* data)
+{
+	int pipes[2][2];
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		child->fds[i] = -1;
+		child->lines[i].len = 0;
+		if (fanout->output_fds)
+			continue;
+		if (pipe2(pipes[i], O_CLOEXEC))
+			err(EXIT_FAILURE, "pipe");
+		child->fds[i] = pipes[i][0];
+	}
+
+	child->pid = fork();
+	if (child->pid < 0)
+		err(EXIT_FAILURE, "fork");
+	if (!child->pid) {
+		int out = fanout->output_fds
+			? fanout->output_fds[child->index] : -1;
+
+		sigprocmask(SIG_SETMASK, mask, NULL);
+		signal(SIGCHLD, SIG_DFL);
+		if (dup2(fanout->stdin_fd, 0) < 0
+				|| dup2(out >= 0 ? out : pipes[0][1], 1) < 0
+				|| dup2(out >= 0 ? out : pipes[1][1], 2) < 0)
+			_exit(127);
+		start(child->index, data);
+		_exit(127);
+	}
+
+	if (!fanout->output_fds) {
+		close(pipes[0][1]);
+		close(pipes[1][1]);
+	}
+}
+
+static void
+write_summary(const struct fanout* fanout, const struct result* results)
+{
+	int width = 0;
+	size_t i;
+
+	for (i = 0; i < fanout->n_children; ++i) {
+		int len = strlen(fanout->names[i]);
+		if (len > width)
+			width = len;
+	}
+
+	for (i = 0; i < fanout->n_children; ++i) {
+		const struct result* r = &results[i];
+		long sec = r->end.tv_sec - r->start.tv_sec;
+		long nsec = r->end.tv_nsec - r->start.tv_nsec;
+		char status[32];
+
+		if (nsec < 0) {
+			--sec;
+			nsec += 1000000000;
+		}
+		if (WIFEXITED(r->status))
+			snprintf(status, sizeof(status), "exit %d",
+				WEXITSTATUS(r->status));
+		else
+			snprintf(status, sizeof(status), "signal %d",
+				WTERMSIG(r->status));
+		fprintf(fanout->summary, "%-*s  %-10s %ld.%03lds\n",
+			width, fanout->names[i], status, sec, nsec / 1000000);
+	}
+	fflush(fanout->summary);
+}
+
+static void
+note_child(int sig)
+{
+}
+
+unsigned int
+run_fanout(const struct fanout* fanout, void (*start) (size_t i, void* data),
+		void* data)
+{
+	struct child* children = xmalloc(sizeof(struct child) * fanout->jobs);
+	struct result* results = xmalloc(sizeof(struct result)
+			* fanout->n_children);
+	struct pollfd* pfds = xmalloc(sizeof(struct pollfd) * 2 * fanout->jobs);
+	FILE* outs[2] = { stdout, stderr };
+	struct sigaction sa, old_sa;
+	sigset_t chld, old_mask, wait_mask;
+	unsigned int running = 0, failed = 0, i;
+	size_t next = 0;
+
+	/*
+	 * SIGCHLD is only let through while we wait in ppoll(2), so that a
+	 * child exiting always wakes us up without a race.
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = note_child;
+	sa.sa_flags = SA_NOCLDSTOP;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &old_mask);
+	sigaction(SIGCHLD, &sa, &old_sa);
+	wait_mask = old_mask;
+	sigdelset(&wait_mask, SIGCHLD);
+
+	for (i = 0; i < fanout->jobs; ++i) {
+		children[i].lines[0].buf = children[i].lines[1].buf = NULL;
+		children[i].lines[0].alloc = children[i].lines[1].alloc = 0;
+	}
+
+	for (;;) {
+		unsigned int n_pfds = 0, j;
+		struct timespec now;
+		int status;
+		pid_t pid;
+
+		while (next < fanout->n_children && running < fanout->jobs) {
+			children[running].index = next;
+			clock_gettime(CLOCK_MONOTONIC, &results[next].start);
+			start_child(&children[running], fanout, &old_mask,
+					start, data);
+			++running;
+			++next;
+		}
+		if (!running)
+			break;
+
+		for (i = 0; i < running; ++i) {
+			for (j = 0; j < 2; ++j) {
+				if (children[i].fds[j] < 0)
+					continue;
+				pfds[n_pfds].fd = children[i].fds[j];
+				pfds[n_pfds].events = POLLIN;
+				++n_pfds;
+			}
+		}
+		if (ppoll(pfds, n_pfds, NULL, &wait_mask) < 0 && errno != EINTR)
+			err(EXIT_FAILURE, "poll");
+
+		n_pfds = 0;
+		for (i = 0; i < running; ++i) {
+			struct child* child = &children[i];
+			for (j = 0; j < 2; ++j) {
+				if (child->fds[j] < 0)
+					continue;
+				if (pfds[n_pfds++].revents && !copy_lines(
+						child->fds[j], &child->lines[j],
+						fanout->names[child->index],
+						outs[j])) {
+					close(child->fds[j]);
+					child->fds[j] = -1;
+				}
+			}
+		}
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			for (i = 0; i < running && children[i].pid != pid; ++i)
+				;
+			if (i == running)
+				continue;
+			results[children[i].index].status = status;
+			results[children[i].index].end = now;
+			if (!WIFEXITED(status) || WEXITSTATUS(status))
+				++failed;
+			children[i].pid = 0;
+		}
+
+		/*
+		 * A child is finished once it has exited and we have copied
+		 * all of its output.
+		 */
+		for (i = 0; i < running; ) {
+			struct child done = children[i];
+			if (done.pid || done.fds[0] >= 0 || done.fds[1] >= 0) {
+				++i;
+				continue;
+			}
+			/*
+			 * Keep its line buffers for the next child to use.
+			 */
+			children[i] = children[--running];
+			children[running] = done;
+		}
+	}
+
+	sigaction(SIGCHLD, &old_sa, NULL);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+	write_summary(fanout, results);
+
+	for (i = 0; i < fanout->jobs; ++i) {
+		free(children[i].lines[0].buf);
+		free(children[i].lines[1].buf);
+	}
+	free(children);
+	free(results);
+	free(pfds);
+	return failed;
+}
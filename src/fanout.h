@@ -0,0 +1,30 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+struct fanout {
+	const char* const* names; /* what to call each child */
+	size_t n_children;
+	unsigned int jobs;	/* how many children may run at once */
+	int stdin_fd;		/* standard input for children */
+	const int* output_fds;	/* where each child's output goes, or NULL */
+	FILE* summary;		/* where to write the summary */
+};
+
+/*
+ * Fork a child for each of fanout->names, running up to fanout->jobs at
+ * once, and call start(i, data) in child i.  start() must not return: it
+ * sets up the child and executes its command.  Without output_fds the
+ * standard output and error of each child are read by us and copied to
+ * ours a line at a time, each line starting with the child's name in
+ * brackets.  Once every child has finished a line giving its exit status
+ * and wall clock time is written to fanout->summary for each one, in order.
+ * Returns the number of children that did not exit successfully.
+ */
+unsigned int
+run_fanout(const struct fanout* fanout, void (*start) (size_t i, void* data),
+		void* data);
+
+#endif // FANOUT_H
@@ -4,26 +4,69 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 /*
- * Define the buffer so that it pads out the iniparser_state structure to
- * 4096 bytes.
+ * How much of a file descriptor is read at a time.
  */
-#define BUFFER_SIZE	4096 - 2 * sizeof(void*) - 5 * sizeof(int)
+#define BUFFER_SIZE	4096
 
 
+/*
+ * Where the parser is reading from.  A file descriptor is read through buf
+ * a block at a time, while input that is already in memory (including a
+ * mapped file) is scanned in place.
+ */
+enum {
+	SOURCE_NONE,
+	SOURCE_FD,
+	SOURCE_MEMORY
+};
+
+struct buffer {
+	size_t alloc;
+	size_t len;
+	char* str;
+};
+
+/*
+ * A section name, key or value being collected.  While its characters are
+ * next to each other in memory it is just a view of the input; once an
+ * escaped line break splits it, or if the input is read from a file
+ * descriptor, it is put together in copy instead.
+ */
+struct token {
+	const char* start;
+	size_t len;
+	int copied;
+	struct buffer copy;
+};
+
 struct iniparser_state {
 	iniparser_callbacks* callbacks;
 	void* cbdata;
+	const char* target;
+	const char* next;
+	const char* end;
+	const char* error;
+	int source;
 	int fd;
 	int lineno;
 	int pos;
 	int buflen;
 	int state;
+	int matched;
+	struct token section;
+	struct token key;
+	struct token value;
 
 	char buf[BUFFER_SIZE];
 };
@@ -40,19 +83,49 @@ enum {
 	STATE_EV, /* entry value */
 	STATE_SQ, /* single quoted value */
 	STATE_DQ, /* double quoted value */
-	STATE_EOF, /* end of file */
-	STATE_ERROR
+	STATE_SKIP, /* body of a section we are not interested in */
+	STATE_SKIP_LS, /* start of line in a skipped section */
+	STATE_ERROR,
+	STATE_DONE /* all events have been returned */
 };
 
+static inline void
+token_clear(iniparser* parser, struct token* t)
+{
+	t->start = NULL;
+	t->len = 0;
+	t->copy.len = 0;
+	/*
+	 * The block buffer is reused, so text read from a file descriptor
+	 * always has to be copied.
+	 */
+	t->copied = parser->source != SOURCE_MEMORY;
+}
+
+static void
+start_parse(iniparser* parser, const char* section_name)
+{
+	parser->target = section_name;
+	parser->error = NULL;
+	parser->lineno = 1;
+	parser->state = STATE_START;
+	parser->matched = 0;
+	token_clear(parser, &parser->section);
+	token_clear(parser, &parser->key);
+	token_clear(parser, &parser->value);
+}
+
 iniparser*
 iniparser_alloc(iniparser_callbacks* callbacks, void* cbdata)
 {
-	iniparser* parser = malloc(sizeof(iniparser));
+	iniparser* parser = calloc(1, sizeof(iniparser));
 	if (!parser)
 		return NULL;
 
 	parser->callbacks = callbacks;
 	parser->cbdata = cbdata;
+	parser->target = NULL;
+	parser->source = SOURCE_NONE;
 	parser->fd = -1;
 
 	return parser;
@@ -64,8 +137,13 @@ iniparser_free(iniparser* parser)
 	/*
 	 * We shouldn't be free'ing a parser if it is currently parsing.
 	 */
-	assert(parser ? parser->fd < 0 : true);
+	assert(parser ? parser->source == SOURCE_NONE : true);
 
+	if (parser) {
+		free(parser->section.copy.str);
+		free(parser->key.copy.str);
+		free(parser->value.copy.str);
+	}
 	free(parser);
 }
 
@@ -73,24 +151,44 @@ static inline int
 parse_error(iniparser* parser, const char* msg)
 {
 	parser->state = STATE_ERROR;
-	parser->callbacks->fatal_error(parser->cbdata, parser->lineno, msg);
-	return -1;
+	parser->error = msg;
+	return INIPARSER_ERROR;
 }
 
 static inline int
 nextchar_simple(iniparser* parser)
 {
+	if (parser->source == SOURCE_MEMORY) {
+		if (parser->next < parser->end)
+			return (unsigned char) *parser->next++;
+		return EOF;
+	}
 	if (parser->pos >= parser->buflen) {
 		parser->pos = 0;
 		parser->buflen = read(parser->fd, parser->buf, BUFFER_SIZE);
 		if (parser->buflen < 0) {
-			return parse_error(parser, "IO error");
+			parser->buflen = 0;
+			parse_error(parser, "IO error");
+			return EOF;
 		} else if (parser->buflen == 0) {
-			parser->state = STATE_EOF;
 			return EOF;
 		}
 	}
-	return parser->buf[parser->pos++];
+	return (unsigned char) parser->buf[parser->pos++];
+}
+
+/*
+ * Push back the character we just read.  Note that decrementing pos works
+ * even if nextchar_simple refilled the buffer because it means pos is zero
+ * next time.
+ */
+static inline void
+unget(iniparser* parser)
+{
+	if (parser->source == SOURCE_MEMORY)
+		--parser->next;
+	else
+		--parser->pos;
 }
 
 static inline int
@@ -108,21 +206,18 @@ nextchar(iniparser* parser)
 			if (n == '\r' || n == '\n') {
 				skip_lf = 1;
 				c = n;
-			} else
-				--parser->pos;
+			} else if (n >= 0)
+				unget(parser);
 		}
 		if (c == '\r') {
 			/*
-			 * Handle CRLF line breaks.  Note that decrementing
-			 * pos works even if we refill the buffer in this call
-			 * to nextchar_simple because it means pos is zero
-			 * next time.
+			 * Handle CRLF line breaks.
 			 */
 			int n = nextchar_simple(parser);
 			if (n == '\n' || n < 0)
 				c = n;
 			else
-				--parser->pos;
+				unget(parser);
 		}
 		if (c == '\n')
 			++parser->lineno;
@@ -130,12 +225,12 @@ nextchar(iniparser* parser)
 	return c;
 }
 
-struct buffer {
-	size_t alloc;
-	size_t len;
-	char* str;
-};
-#define BUFFER_INIT { 0, 0, NULL }
+static inline const char*
+find_byte(const char* p, const char* end, int c)
+{
+	const char* found = memchr(p, c, end - p);
+	return found ? found : end;
+}
 
 static inline int
 push_char(struct buffer* b, int c)
@@ -154,47 +249,194 @@ push_char(struct buffer* b, int c)
 	return 0;
 }
 
-static inline void
-clear(struct buffer* b)
+static inline int
+push_chars(struct buffer* b, const char* p, size_t n)
+{
+	if (b->len + n >= b->alloc) {
+		size_t newsize = b->alloc ? b->alloc : 32;
+		char* newptr;
+		while (b->len + n >= newsize)
+			newsize *= 2;
+		newptr = realloc(b->str, newsize);
+		if (!newptr) {
+			errno = ENOMEM;
+			return -1;
+		}
+		b->alloc = newsize;
+		b->str = newptr;
+	}
+	memcpy(b->str + b->len, p, n);
+	b->len += n;
+	return 0;
+}
+
+/*
+ * Add the n characters of input at p to the token, extending the view if
+ * they follow on from it.
+ */
+static int
+token_append(struct token* t, const char* p, size_t n)
 {
-	b->len = 0;
+	if (!n)
+		return 0;
+	if (!t->copied) {
+		if (!t->len)
+			t->start = p;
+		if (t->start + t->len == p) {
+			t->len += n;
+			return 0;
+		}
+		t->copied = 1;
+		if (push_chars(&t->copy, t->start, t->len))
+			return -1;
+	}
+	return push_chars(&t->copy, p, n);
+}
+
+static inline int
+token_push(iniparser* parser, struct token* t, int c)
+{
+	/*
+	 * Every character nextchar() returns from memory is the one just
+	 * before next, even after an escaped line break or a CRLF.
+	 */
+	if (parser->source == SOURCE_MEMORY)
+		return token_append(t, parser->next - 1, 1);
+	return push_char(&t->copy, c);
 }
 
 static inline void
-rstrip(struct buffer* b)
+token_rstrip(struct token* t)
 {
-	while (b->len > 0) {
-		if (isspace(b->str[b->len - 1]))
-			--b->len;
-		else
-			break;
+	const char* str = t->copied ? t->copy.str : t->start;
+	size_t* len = t->copied ? &t->copy.len : &t->len;
+
+	while (*len > 0 && isspace((unsigned char) str[*len - 1]))
+		--*len;
+}
+
+static inline iniparser_view
+token_view(struct token* t)
+{
+	iniparser_view view;
+
+	view.str = t->copied ? t->copy.str : t->start;
+	view.len = t->copied ? t->copy.len : t->len;
+	if (!view.str)
+		view.str = "";
+	return view;
+}
+
+/*
+ * Return the token as a NUL-terminated string, copying it if it is still a
+ * view of the input.
+ */
+static const char*
+token_str(struct token* t)
+{
+	if (!t->copied) {
+		t->copied = 1;
+		t->copy.len = 0;
+		if (t->len && push_chars(&t->copy, t->start, t->len))
+			return NULL;
 	}
+	if (push_char(&t->copy, '\0'))
+		return NULL;
+	--t->copy.len;
+	return t->copy.str;
 }
 
-static inline const char*
-buf_str(struct buffer* b)
+/*
+ * Whether the section heading just read is the one we are looking for.  As
+ * with a NUL-terminated name, a NUL in the heading ends it.
+ */
+static int
+is_target(iniparser* parser)
 {
-	b->str[b->len] = '\0';
-	return b->str;
+	iniparser_view name = token_view(&parser->section);
+	size_t len = strlen(parser->target);
+
+	return strnlen(name.str, name.len) == len
+		&& !strncasecmp(name.str, parser->target, len);
 }
 
-static inline void
-buf_free(struct buffer *b)
+/*
+ * When scanning memory, consume the run of characters that the current
+ * state would take one at a time without changing state: the rest of a
+ * comment or skipped line, or the text of a heading, key or value.  The run
+ * stops before any newline, carriage return or backslash so that those
+ * still go through nextchar() and are handled exactly as when reading a
+ * file descriptor.
+ */
+static int
+scan_run(iniparser* parser)
 {
-	free(b->str);
-	b->alloc = 0;
+	const char* p = parser->next;
+	const char* stop;
+	struct token* t = NULL;
+	int special = -1;
+
+	switch (parser->state) {
+	case STATE_START_CM:
+	case STATE_CM:
+	case STATE_SKIP:
+		break;
+	case STATE_SH:
+		t = &parser->section;
+		special = ']';
+		break;
+	case STATE_EK:
+		t = &parser->key;
+		special = '=';
+		break;
+	case STATE_EV:
+		t = &parser->value;
+		special = ';';
+		break;
+	case STATE_SQ:
+		t = &parser->value;
+		special = '\'';
+		break;
+	case STATE_DQ:
+		t = &parser->value;
+		special = '"';
+		break;
+	default:
+		return 0;
+	}
+
+	stop = find_byte(p, parser->end, '\n');
+	stop = find_byte(p, stop, '\\');
+	stop = find_byte(p, stop, '\r');
+	if (special >= 0)
+		stop = find_byte(p, stop, special);
+
+	parser->next = stop;
+	return t ? token_append(t, p, stop - p) : 0;
 }
 
+/*
+ * Run the state machine until it has something to report.  The state is
+ * always updated before returning, so that the next call carries on from
+ * the following character.
+ */
 static int
-iniparser_parse(iniparser* parser, struct buffer *section,
-		struct buffer *key, struct buffer *value)
+next_event(iniparser* parser)
 {
 	int c;
-	iniparser_callbacks* cb = parser->callbacks;
-	void* cbdata = parser->cbdata;
 
-	parser->state = STATE_START;
-	while ((c = nextchar(parser)) >= 0) {
+	if (parser->state == STATE_DONE)
+		return INIPARSER_END;
+	if (parser->state == STATE_ERROR)
+		return INIPARSER_ERROR;
+
+	for (;;) {
+		if (parser->source == SOURCE_MEMORY && scan_run(parser))
+			return parse_error(parser, "out of memory");
+		c = nextchar(parser);
+		if (c < 0)
+			break;
+
 		switch (parser->state) {
 		case STATE_START:
 			if (isblank(c) || c == '\n')
@@ -221,25 +463,35 @@ iniparser_parse(iniparser* parser, struct buffer *section,
 			else if (c == ';')
 				parser->state = STATE_CM;
 			else if (c == '[') {
-				clear(section);
+				/*
+				 * The section we were looking for has ended.
+				 */
+				if (parser->matched) {
+					parser->state = STATE_DONE;
+					return INIPARSER_END;
+				}
+				token_clear(parser, &parser->section);
 				parser->state = STATE_SH;
 			} else {
-				clear(key);
-				clear(value);
-				if (push_char(key, c))
+				token_clear(parser, &parser->key);
+				token_clear(parser, &parser->value);
+				if (token_push(parser, &parser->key, c))
 					return parse_error(parser, "out of memory");
 				parser->state = STATE_EK;
 			}
 			break;
 		case STATE_SH:
 			if (c == ']') {
-				c = cb->begin_section(cbdata, buf_str(section));
-				if (c)
-					return c;
+				if (parser->target && !is_target(parser)) {
+					parser->state = STATE_SKIP;
+					break;
+				}
+				parser->matched = parser->target != NULL;
 				parser->state = STATE_LE;
+				return INIPARSER_SECTION;
 			} else if (c == '\n')
 				return parse_error(parser, "expected ']'");
-			else if (push_char(section, c))
+			else if (token_push(parser, &parser->section, c))
 				return parse_error(parser, "out of memory");
 			break;
 		case STATE_LE:
@@ -254,11 +506,11 @@ iniparser_parse(iniparser* parser, struct buffer *section,
 			break;
 		case STATE_EK:
 			if (c == '=') {
-				rstrip(key);
+				token_rstrip(&parser->key);
 				parser->state = STATE_ES;
 			} else if (c == '\n')
 				return parse_error(parser, "expected value with key");
-			else if (push_char(key, c))
+			else if (token_push(parser, &parser->key, c))
 				return parse_error(parser, "out of memory");
 			break;
 		case STATE_ES:
@@ -269,7 +521,7 @@ iniparser_parse(iniparser* parser, struct buffer *section,
 			else if (c == '"')
 				parser->state = STATE_DQ;
 			else {
-				if (push_char(value, c))
+				if (token_push(parser, &parser->value, c))
 					return parse_error(parser, "out of memory");
 				parser->state = STATE_EV;
 			}
@@ -277,35 +529,42 @@ iniparser_parse(iniparser* parser, struct buffer *section,
 		case STATE_EV:
 			if (c == '\n' || c == ';') {
 				parser->state = c == ';' ? STATE_CM : STATE_LS;
-				rstrip(value);
-				c = cb->value_pair(cbdata, buf_str(key), buf_str(value));
-				if (c)
-					return c;
-			} else if (push_char(value, c))
+				token_rstrip(&parser->value);
+				return INIPARSER_VALUE;
+			} else if (token_push(parser, &parser->value, c))
 				return parse_error(parser, "out of memory");
 			break;
 		case STATE_SQ:
 			if (c == '\'') {
-				c = cb->value_pair(cbdata, buf_str(key), buf_str(value));
-				if (c)
-					return c;
 				parser->state = STATE_LS;
+				return INIPARSER_VALUE;
 			} else if (c == '\n')
 				return parse_error(parser, "expected single quote");
-			else if (push_char(value, c))
+			else if (token_push(parser, &parser->value, c))
 				return parse_error(parser, "out of memory");
 			break;
 		case STATE_DQ:
 			if (c == '"') {
-				c = cb->value_pair(cbdata, buf_str(key), buf_str(value));
-				if (c)
-					return c;
 				parser->state = STATE_LS;
+				return INIPARSER_VALUE;
 			} else if (c == '\n')
 				return parse_error(parser, "expected single quote");
-			else if (push_char(value, c))
+			else if (token_push(parser, &parser->value, c))
 				return parse_error(parser, "out of memory");
 			break;
+		case STATE_SKIP:
+			if (c == '\n')
+				parser->state = STATE_SKIP_LS;
+			break;
+		case STATE_SKIP_LS:
+			if (isblank(c) || c == '\n')
+				;
+			else if (c == '[') {
+				token_clear(parser, &parser->section);
+				parser->state = STATE_SH;
+			} else
+				parser->state = STATE_SKIP;
+			break;
 		default:
 			assert(false);
 			break;
@@ -314,16 +573,21 @@ iniparser_parse(iniparser* parser, struct buffer *section,
 
 	switch (parser->state) {
 	/*
-	 * These conditions can just exit or have already reported an error.
+	 * These conditions can just exit.
 	 */
 	case STATE_START:
 	case STATE_START_CM:
 	case STATE_CM:
 	case STATE_LS:
 	case STATE_LE:
-	case STATE_EOF:
-	case STATE_ERROR:
+	case STATE_SKIP:
+	case STATE_SKIP_LS:
 		break;
+	/*
+	 * Reading the input failed.
+	 */
+	case STATE_ERROR:
+		return INIPARSER_ERROR;
 	/*
 	 * These are errors.
 	 */
@@ -334,35 +598,187 @@ iniparser_parse(iniparser* parser, struct buffer *section,
 	case STATE_DQ:
 		return parse_error(parser, "unexpected end of file");
 	/*
-	 * We got to EOF while parsing a value, fire the callback.
+	 * We got to EOF while parsing a value, which is the last event.
 	 */
 	case STATE_EV:
-		c = cb->value_pair(cbdata, buf_str(key), buf_str(value));
-		if (c)
-			return c;
-		break;
+		token_rstrip(&parser->value);
+		parser->state = STATE_DONE;
+		return INIPARSER_VALUE;
 	}
-	return 0;
+	parser->state = STATE_DONE;
+	return INIPARSER_END;
+}
+
+/*
+ * Drive the state machine, passing each event to the callbacks.
+ */
+static int
+run_callbacks(iniparser* parser)
+{
+	iniparser_callbacks* cb = parser->callbacks;
+	void* cbdata = parser->cbdata;
+	const char *key, *value;
+	int result;
+
+	for (;;) {
+		switch (next_event(parser)) {
+		case INIPARSER_SECTION:
+			key = token_str(&parser->section);
+			if (!key)
+				break;
+			result = cb->begin_section(cbdata, key);
+			if (result)
+				return result;
+			continue;
+		case INIPARSER_VALUE:
+			key = token_str(&parser->key);
+			value = token_str(&parser->value);
+			if (!key || !value)
+				break;
+			result = cb->value_pair(cbdata, key, value);
+			if (result)
+				return result;
+			continue;
+		case INIPARSER_ERROR:
+			cb->fatal_error(cbdata, parser->lineno, parser->error);
+			return -1;
+		default:
+			return 0;
+		}
+		parse_error(parser, "out of memory");
+		cb->fatal_error(cbdata, parser->lineno, parser->error);
+		return -1;
+	}
+}
+
+static int
+parse_source(iniparser* parser, const char* section_name)
+{
+	int result;
+
+	start_parse(parser, section_name);
+	result = run_callbacks(parser);
+	parser->source = SOURCE_NONE;
+	parser->target = NULL;
+	return result;
 }
 
 int
 iniparser_parsefd(iniparser* parser, int fd)
 {
-	struct buffer section = BUFFER_INIT, key = BUFFER_INIT, value = BUFFER_INIT;
+	return iniparser_parsefd_section(parser, fd, NULL);
+}
+
+int
+iniparser_parsefd_section(iniparser* parser, int fd, const char* section_name)
+{
+	struct stat statbuf;
+	void* map;
 	int result;
 
 	assert(parser);
-	assert(parser->fd < 0);
+	assert(parser->source == SOURCE_NONE);
 
+	/*
+	 * Scan regular files in place; anything else, or a file that cannot
+	 * be mapped, is read a block at a time.  So are files that fit in a
+	 * single block, since a read is cheaper than setting up a mapping.
+	 */
+	if (!fstat(fd, &statbuf) && S_ISREG(statbuf.st_mode)
+			&& statbuf.st_size > BUFFER_SIZE
+			&& statbuf.st_size <= SIZE_MAX) {
+		off_t offset = lseek(fd, 0, SEEK_CUR);
+		if (offset >= 0 && offset <= statbuf.st_size) {
+			map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE,
+					fd, 0);
+			if (map != MAP_FAILED) {
+				result = iniparser_parsebuf_section(parser,
+						(const char*) map + offset,
+						statbuf.st_size - offset,
+						section_name);
+				munmap(map, statbuf.st_size);
+				return result;
+			}
+		}
+	}
+
+	parser->source = SOURCE_FD;
 	parser->fd = fd;
 	parser->pos = parser->buflen = 0;
-	parser->lineno = 1;
-
-	result = iniparser_parse(parser, &section, &key, &value);
+	result = parse_source(parser, section_name);
 	parser->fd = -1;
+	return result;
+}
 
-	buf_free(&section);
-	buf_free(&key);
-	buf_free(&value);
+int
+iniparser_parsebuf(iniparser* parser, const char* buf, size_t len)
+{
+	return iniparser_parsebuf_section(parser, buf, len, NULL);
+}
+
+int
+iniparser_parsebuf_section(iniparser* parser, const char* buf, size_t len,
+		const char* section_name)
+{
+	int result;
+
+	assert(parser);
+	assert(parser->source == SOURCE_NONE);
+
+	parser->source = SOURCE_MEMORY;
+	parser->next = buf;
+	parser->end = buf + len;
+	result = parse_source(parser, section_name);
+	parser->next = parser->end = NULL;
 	return result;
 }
+
+void
+iniparser_begin(iniparser* parser, const char* buf, size_t len,
+		const char* section_name)
+{
+	assert(parser);
+	assert(parser->source == SOURCE_NONE);
+
+	parser->source = SOURCE_MEMORY;
+	parser->next = buf;
+	parser->end = buf + len;
+	start_parse(parser, section_name);
+}
+
+int
+iniparser_next(iniparser* parser, iniparser_event* event)
+{
+	static const iniparser_view empty = { "", 0 };
+
+	assert(parser->source == SOURCE_MEMORY);
+
+	event->type = next_event(parser);
+	event->lineno = parser->lineno;
+	event->section = empty;
+	event->key = empty;
+	event->value = empty;
+	event->error = NULL;
+
+	switch (event->type) {
+	case INIPARSER_VALUE:
+		event->key = token_view(&parser->key);
+		event->value = token_view(&parser->value);
+		/* fall through */
+	case INIPARSER_SECTION:
+		event->section = token_view(&parser->section);
+		break;
+	case INIPARSER_ERROR:
+		event->error = parser->error;
+		break;
+	}
+	return event->type;
+}
+
+void
+iniparser_end(iniparser* parser)
+{
+	parser->source = SOURCE_NONE;
+	parser->target = NULL;
+	parser->next = parser->end = NULL;
+}
@@ -1,6 +1,8 @@
 #ifndef INIPARSER_H
 #define INIPARSER_H
 
+#include <stddef.h>
+
 typedef struct {
 	int (*begin_section) (void* cbdata, const char* section_name);
 	int (*value_pair) (void* cbdata, const char* key, const char* value);
@@ -15,7 +17,81 @@ iniparser_alloc(iniparser_callbacks* callbacks, void* cbdata);
 void
 iniparser_free(iniparser* parser);
 
+/*
+ * Parse the file open on fd from its current offset.  Regular files larger
+ * than a block are mapped and scanned in place; other files are read a
+ * block at a time.
+ * Either way the callbacks, line numbers and errors are the same.
+ */
 int
 iniparser_parsefd(iniparser* parser, int fd);
 
+/*
+ * Parse only the first section called section_name (compared case
+ * insensitively).  The bodies of other sections are skipped without being
+ * checked and parsing stops as soon as the wanted section ends, so callbacks
+ * only ever see that one section.
+ */
+int
+iniparser_parsefd_section(iniparser* parser, int fd, const char* section_name);
+
+/*
+ * Parse len bytes of input at buf, which need not be NUL-terminated.
+ */
+int
+iniparser_parsebuf(iniparser* parser, const char* buf, size_t len);
+
+int
+iniparser_parsebuf_section(iniparser* parser, const char* buf, size_t len,
+		const char* section_name);
+
+/*
+ * Part of the input, or of the parser's scratch space, which is not
+ * NUL-terminated.
+ */
+typedef struct {
+	const char* str;
+	size_t len;
+} iniparser_view;
+
+enum {
+	INIPARSER_END,
+	INIPARSER_SECTION,
+	INIPARSER_VALUE,
+	INIPARSER_ERROR
+};
+
+typedef struct {
+	int type;
+	int lineno;
+	iniparser_view section;	/* the heading, or the section of a value */
+	iniparser_view key;
+	iniparser_view value;
+	const char* error;	/* what is wrong for INIPARSER_ERROR */
+} iniparser_event;
+
+/*
+ * Instead of having callbacks called, pull events from the len bytes at
+ * buf, which must stay valid until iniparser_end().  The views in each
+ * event point into buf unless an escaped line break split the text, in
+ * which case it is copied into scratch space that the parser reuses, so a
+ * parser allocated with no callbacks can read a file without allocating
+ * anything more.  section_name selects a single section as for
+ * iniparser_parsefd_section().
+ */
+void
+iniparser_begin(iniparser* parser, const char* buf, size_t len,
+		const char* section_name);
+
+/*
+ * Fill in the next event and return its type.  Its views are only valid
+ * until the next call.  Once INIPARSER_END or INIPARSER_ERROR has been
+ * returned the same event is returned again.
+ */
+int
+iniparser_next(iniparser* parser, iniparser_event* event);
+
+void
+iniparser_end(iniparser* parser);
+
 #endif // INIPARSER_H
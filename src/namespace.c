@@ -0,0 +1,288 @@
+/*
+ * Define _GNU_SOURCE so we get unshare(2), setns(2) and syscall(2).
+ */
+#define _GNU_SOURCE
+
+#include "namespace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int
+private_mount_namespace(void)
+{
+	if (unshare(CLONE_NEWNS))
+		return -1;
+
+	/*
+	 * Slave rather than private propagation means filesystems mounted
+	 * on the host later still show up, while nothing we mount leaks out.
+	 */
+	return mount(NULL, "/", NULL, MS_REC | MS_SLAVE, NULL);
+}
+
+/*
+ * Open path beneath rootfd without letting symlinks escape it.  Kernels
+ * without openat2(2) only get the final component checked.
+ */
+static int
+open_beneath(int rootfd, const char* path, int flags, mode_t mode)
+{
+	struct open_how how;
+	int fd;
+
+	memset(&how, 0, sizeof(how));
+	how.flags = flags | O_NOFOLLOW | O_CLOEXEC;
+	how.mode = (flags & O_CREAT) ? mode : 0;
+	how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+
+	fd = syscall(SYS_openat2, rootfd, path, &how, sizeof(how));
+	if (fd >= 0 || errno != ENOSYS)
+		return fd;
+
+	while (*path == '/')
+		++path;
+	return openat(rootfd, path, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+}
+
+static int
+open_target(int rootfd, const char* path)
+{
+	struct stat statbuf;
+	int fd = open_beneath(rootfd, path, O_PATH, 0);
+	if (fd < 0 && errno == ENOENT)
+		fd = open_beneath(rootfd, path,
+				O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &statbuf))
+		goto err;
+	if (!S_ISREG(statbuf.st_mode)) {
+		errno = EINVAL;
+		goto err;
+	}
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+static inline void
+fd_path(char* buf, size_t len, int fd)
+{
+	snprintf(buf, len, "/proc/self/fd/%d", fd);
+}
+
+static int
+bind_file(int rootfd, const char* file)
+{
+	char target[32];
+	int fd = open_target(rootfd, file);
+	if (fd < 0)
+		return -1;
+
+	fd_path(target, sizeof(target), fd);
+	if (mount(file, target, NULL, MS_BIND, NULL))
+		goto err;
+	close(fd);
+
+	/*
+	 * The descriptor we mounted over still refers to the file underneath,
+	 * so open the path again to reach the new mount and make it read-only.
+	 */
+	fd = open_beneath(rootfd, file, O_PATH, 0);
+	if (fd < 0)
+		return -1;
+	fd_path(target, sizeof(target), fd);
+	if (mount(NULL, target, NULL, MS_BIND | MS_REMOUNT | MS_RDONLY, NULL))
+		goto err;
+
+	close(fd);
+	return 0;
+
+err:
+	close(fd);
+	return -1;
+}
+
+int
+bind_files(const char* rootdir, const char** files, size_t n_files)
+{
+	size_t i;
+	int rootfd = open(rootdir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (rootfd < 0)
+		return -1;
+
+	for (i = 0; i < n_files; ++i) {
+		if (bind_file(rootfd, files[i])) {
+			int saved = errno;
+			close(rootfd);
+			errno = saved;
+			return -1;
+		}
+	}
+
+	close(rootfd);
+	return 0;
+}
+
+int
+mount_overlay(const char* rootdir, const char* lowerdir,
+		const char* upperdir, const char* workdir)
+{
+	char upper[PATH_MAX], work[PATH_MAX];
+	char* options;
+	int len, ret, saved_errno;
+
+	/*
+	 * Commas separate the mount options and colons the layers, and we
+	 * do not try to escape them.
+	 */
+	if (strchr(lowerdir, ',') || (upperdir && strpbrk(upperdir, ",:"))
+			|| (workdir && strpbrk(workdir, ",:"))
+			|| (upperdir && !workdir)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/*
+	 * The tmpfs goes on rootdir itself and is then hidden by the overlay,
+	 * which has already found its directories by the time it covers them.
+	 */
+	if (!upperdir) {
+		if (snprintf(upper, sizeof(upper), "%s/upper", rootdir)
+					>= (int) sizeof(upper)
+				|| snprintf(work, sizeof(work), "%s/work", rootdir)
+					>= (int) sizeof(work)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		if (mount("tmpfs", rootdir, "tmpfs", MS_NOSUID | MS_NODEV,
+					"mode=0755"))
+			return -1;
+		if (mkdir(upper, 0755) || mkdir(work, 0700))
+			return -1;
+		upperdir = upper;
+		workdir = work;
+	}
+
+	len = snprintf(NULL, 0, "lowerdir=%s,upperdir=%s,workdir=%s",
+			lowerdir, upperdir, workdir);
+	options = malloc(len + 1);
+	if (!options)
+		return -1;
+	snprintf(options, len + 1, "lowerdir=%s,upperdir=%s,workdir=%s",
+		lowerdir, upperdir, workdir);
+
+	ret = mount("overlay", rootdir, "overlay", 0, options);
+	saved_errno = errno;
+	free(options);
+	errno = saved_errno;
+	return ret;
+}
+
+int
+current_mount_namespace(void)
+{
+	return open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+}
+
+int
+private_mount_dir(const char* dir)
+{
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return -1;
+
+	if (!mount(NULL, dir, NULL, MS_PRIVATE, NULL))
+		return 0;
+	if (errno != EINVAL)
+		return -1;
+
+	/*
+	 * Not a mount point yet; bind it onto itself to make it one.
+	 */
+	if (mount(dir, dir, NULL, MS_BIND, NULL))
+		return -1;
+	return mount(NULL, dir, NULL, MS_PRIVATE, NULL);
+}
+
+int
+enter_mount_namespace(const char* path)
+{
+	int saved, retval;
+	int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	retval = setns(fd, CLONE_NEWNS);
+	saved = errno;
+	close(fd);
+	errno = saved;
+	return retval;
+}
+
+int
+pin_mount_namespace(const char* path, int hostns)
+{
+	char nspath[32];
+	pid_t parent = getpid();
+	int status, fd;
+	pid_t pid;
+
+	snprintf(nspath, sizeof(nspath), "/proc/%d/ns/mnt", (int) parent);
+
+	/*
+	 * A mount namespace cannot be bind mounted from inside itself, so
+	 * the pin is made by a child that goes back to the old namespace.
+	 */
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		if (setns(hostns, CLONE_NEWNS))
+			_exit(errno);
+		fd = open(path, O_RDONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0444);
+		if (fd < 0)
+			_exit(errno);
+		close(fd);
+		if (mount(nspath, path, NULL, MS_BIND, NULL))
+			_exit(errno);
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		return -1;
+	if (!WIFEXITED(status)) {
+		errno = EINTR;
+		return -1;
+	}
+	if (WEXITSTATUS(status)) {
+		errno = WEXITSTATUS(status);
+		return -1;
+	}
+	return 0;
+}
+
+int
+unpin_mount_namespace(const char* path)
+{
+	if (umount2(path, MNT_DETACH) && errno != EINVAL && errno != ENOENT)
+		return -1;
+	if (unlink(path) && errno != ENOENT)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef NAMESPACE_H
+#define NAMESPACE_H
+
+#include "configfile.h"
+
+/*
+ * Move into a new mount namespace.  Mounts made afterwards are not seen by
+ * the rest of the system, although mounts made on the host still propagate
+ * into the new namespace.
+ */
+int
+private_mount_namespace(void);
+
+/*
+ * Bind mount each file read-only over the file with the same path inside
+ * rootdir, creating an empty file to mount over if there is not one there
+ * already.  Paths inside rootdir are resolved as if rootdir were the root
+ * directory so that symlinks in the new root cannot redirect the mounts.
+ */
+int
+bind_files(const char* rootdir, const char** files, size_t n_files);
+
+/*
+ * Mount an overlay on rootdir made of the colon-separated lowerdir layers,
+ * topmost first, with changes going to upperdir, which needs an empty
+ * workdir on the same filesystem.  If upperdir is NULL the changes are kept
+ * in a tmpfs instead and are lost along with the mount namespace.  This
+ * should only be done in a private mount namespace.
+ */
+int
+mount_overlay(const char* rootdir, const char* lowerdir,
+		const char* upperdir, const char* workdir);
+
+/*
+ * Open the mount namespace this process is in, for use with
+ * pin_mount_namespace().
+ */
+int
+current_mount_namespace(void);
+
+/*
+ * Make dir a mount point with private propagation, which is required
+ * before mount namespaces can be pinned inside it.
+ */
+int
+private_mount_dir(const char* dir);
+
+/*
+ * Switch to the mount namespace pinned at path.  Fails with ENOENT or
+ * EINVAL if nothing is pinned there.
+ */
+int
+enter_mount_namespace(const char* path);
+
+/*
+ * Pin the mount namespace this process is in at path.  The bind mount is
+ * made in the namespace opened as hostns, which must be an older namespace
+ * such as the one we were in before calling private_mount_namespace().
+ */
+int
+pin_mount_namespace(const char* path, int hostns);
+
+/*
+ * Remove a namespace pinned with pin_mount_namespace().  Processes already
+ * inside the namespace are unaffected.
+ */
+int
+unpin_mount_namespace(const char* path);
+
+#endif // NAMESPACE_H
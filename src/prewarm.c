@@ -0,0 +1,607 @@
+/*
+ * Define _GNU_SOURCE so we get readahead(2).
+ */
+#define _GNU_SOURCE
+
+#include "prewarm.h"
+#include "util.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define LD_SO_CONF		"/etc/ld.so.conf"
+#define MAX_INCLUDE_DEPTH	8
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#	define HOST_DATA	ELFDATA2LSB
+#else
+#	define HOST_DATA	ELFDATA2MSB
+#endif
+
+/*
+ * Distributions that install libraries in per-architecture directories
+ * build the dynamic linker to search them before the traditional ones.
+ */
+static const struct {
+	int elf_class;
+	int machine;
+	const char* triplet;
+} MULTIARCH[] = {
+	{ ELFCLASS64, EM_X86_64, "x86_64-linux-gnu" },
+	{ ELFCLASS32, EM_386, "i386-linux-gnu" },
+	{ ELFCLASS64, EM_AARCH64, "aarch64-linux-gnu" },
+	{ ELFCLASS32, EM_ARM, "arm-linux-gnueabihf" }
+};
+
+struct string_list {
+	char** strings;
+	size_t n;
+	size_t alloc;
+};
+
+struct file_id {
+	dev_t dev;
+	ino_t ino;
+};
+
+struct warmer {
+	struct file_id* seen;
+	size_t n_seen;
+	size_t alloc_seen;
+	struct string_list queue;	/* libraries still to be read */
+	struct string_list conf_dirs;	/* from /etc/ld.so.conf */
+	struct prewarm_stats* stats;
+};
+
+/*
+ * An ELF object mapped into memory, with what we need from its header.
+ */
+struct elf_file {
+	const unsigned char* map;
+	size_t size;
+	int elf_class;
+	int machine;
+	uint64_t phoff;
+	unsigned int phnum;
+	unsigned int phentsize;
+};
+
+struct segment {
+	uint32_t type;
+	uint64_t offset;
+	uint64_t vaddr;
+	uint64_t filesz;
+};
+
+static void
+add_string(struct string_list* list, char* str)
+{
+	if (!str)
+		err(EXIT_FAILURE, "out of memory");
+	if (list->n == list->alloc) {
+		list->alloc = list->alloc * 2 + 8;
+		list->strings = realloc(list->strings,
+				list->alloc * sizeof(char*));
+		if (!list->strings)
+			err(EXIT_FAILURE, "out of memory");
+	}
+	list->strings[list->n++] = str;
+}
+
+static void
+free_strings(struct string_list* list)
+{
+	size_t i;
+
+	for (i = 0; i < list->n; ++i)
+		free(list->strings[i]);
+	free(list->strings);
+}
+
+static int
+in_bounds(uint64_t offset, uint64_t len, size_t size)
+{
+	return offset <= size && len <= size - offset;
+}
+
+static char*
+trim(char* str)
+{
+	char* end;
+
+	str += strspn(str, " \t");
+	end = str + strlen(str);
+	while (end > str && strchr(" \t\r\n", end[-1]))
+		--end;
+	*end = '\0';
+	return str;
+}
+
+/*
+ * Collect the directories listed in an ld.so.conf file, following its
+ * include directives.
+ */
+static void
+read_ld_conf(struct string_list* dirs, const char* path, int depth)
+{
+	char* line = NULL;
+	size_t alloc = 0;
+	FILE* fp;
+
+	if (depth > MAX_INCLUDE_DEPTH)
+		return;
+	fp = fopen(path, "re");
+	if (!fp)
+		return;
+
+	while (getline(&line, &alloc, fp) > 0) {
+		char* entry;
+
+		entry = line;
+		entry[strcspn(entry, "#")] = '\0';
+		entry = trim(entry);
+		if (!*entry || !strncmp(entry, "hwcap", 5))
+			continue;
+
+		if (!strncmp(entry, "include", 7)
+				&& strchr(" \t", entry[7])) {
+			char* pattern;
+			char* saveptr;
+
+			for (pattern = strtok_r(entry + 7, " \t", &saveptr);
+					pattern;
+					pattern = strtok_r(NULL, " \t", &saveptr)) {
+				char full[PATH_MAX];
+				glob_t g;
+				size_t i;
+
+				if (*pattern == '/')
+					snprintf(full, sizeof(full), "%s", pattern);
+				else if (snprintf(full, sizeof(full), "%.*s%s",
+						(int) (xbasename(path) - path),
+						path, pattern) >= (int) sizeof(full))
+					continue;
+				if (glob(full, 0, NULL, &g))
+					continue;
+				for (i = 0; i < g.gl_pathc; ++i)
+					read_ld_conf(dirs, g.gl_pathv[i],
+							depth + 1);
+				globfree(&g);
+			}
+			continue;
+		}
+		add_string(dirs, strdup(entry));
+	}
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Whether path is an ELF object that can be loaded with one of the given
+ * class and machine.  The machine is at the same offset in both classes.
+ */
+static int
+compatible(const char* path, int elf_class, int machine)
+{
+	unsigned char ident[EI_NIDENT + 4];
+	uint16_t e_machine;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	ssize_t n;
+
+	if (fd < 0)
+		return 0;
+	n = pread(fd, ident, sizeof(ident), 0);
+	close(fd);
+	if (n != (ssize_t) sizeof(ident) || memcmp(ident, ELFMAG, SELFMAG))
+		return 0;
+	memcpy(&e_machine, ident + EI_NIDENT + 2, sizeof(e_machine));
+	return ident[EI_CLASS] == elf_class && ident[EI_DATA] == HOST_DATA
+		&& e_machine == machine;
+}
+
+static int
+try_dir(char* out, const char* dir, size_t dirlen, const char* name,
+		const struct elf_file* elf)
+{
+	if (snprintf(out, PATH_MAX, "%.*s/%s", (int) dirlen, dir, name)
+			>= PATH_MAX)
+		return 0;
+	return compatible(out, elf->elf_class, elf->machine);
+}
+
+/*
+ * Look for name in a colon-separated list of directories from DT_RPATH or
+ * DT_RUNPATH, in which $ORIGIN is the directory containing the object.
+ * Directories using any other substitution are skipped.
+ */
+static int
+search_run_path(char* out, const char* run_path, const char* origin,
+		const char* name, const struct elf_file* elf)
+{
+	char dir[PATH_MAX];
+
+	while (run_path && *run_path) {
+		size_t len = strcspn(run_path, ":");
+		const char* rest = NULL;
+
+		if (!strncmp(run_path, "$ORIGIN", 7))
+			rest = run_path + 7;
+		else if (!strncmp(run_path, "${ORIGIN}", 9))
+			rest = run_path + 9;
+
+		if (rest && rest <= run_path + len
+				&& (rest == run_path + len || *rest == '/')
+				&& !memchr(rest, '$', run_path + len - rest)) {
+			int n = snprintf(dir, sizeof(dir), "%s%.*s", origin,
+					(int) (run_path + len - rest), rest);
+			if (n < (int) sizeof(dir)
+					&& try_dir(out, dir, n, name, elf))
+				return 1;
+		} else if (len && !memchr(run_path, '$', len)
+				&& try_dir(out, run_path, len, name, elf))
+			return 1;
+
+		run_path += len;
+		if (*run_path == ':')
+			++run_path;
+	}
+	return 0;
+}
+
+static int
+find_library(struct warmer* w, char* out, const char* name,
+		const char* object, const struct elf_file* elf,
+		const char* rpath, const char* runpath)
+{
+	static const char* const DEFAULT_DIRS_64[] = {
+		"/lib64", "/usr/lib64", "/lib", "/usr/lib", NULL
+	};
+	static const char* const DEFAULT_DIRS_32[] = {
+		"/lib", "/usr/lib", "/lib32", "/usr/lib32", NULL
+	};
+	const char* const* dirs;
+	char origin[PATH_MAX];
+	size_t i;
+
+	if (strchr(name, '/')) {
+		snprintf(out, PATH_MAX, "%s", name);
+		return 1;
+	}
+
+	if (xbasename(object) == object)
+		strcpy(origin, ".");
+	else
+		snprintf(origin, sizeof(origin), "%.*s",
+			(int) (xbasename(object) - object - 1), object);
+
+	if (!runpath && search_run_path(out, rpath, origin, name, elf))
+		return 1;
+	if (search_run_path(out, runpath, origin, name, elf))
+		return 1;
+	for (i = 0; i < w->conf_dirs.n; ++i) {
+		const char* dir = w->conf_dirs.strings[i];
+		if (try_dir(out, dir, strlen(dir), name, elf))
+			return 1;
+	}
+	for (i = 0; i < ARRAY_SIZE(MULTIARCH); ++i) {
+		char dir[64];
+		int n;
+
+		if (MULTIARCH[i].elf_class != elf->elf_class
+				|| MULTIARCH[i].machine != elf->machine)
+			continue;
+		n = snprintf(dir, sizeof(dir), "/lib/%s", MULTIARCH[i].triplet);
+		if (try_dir(out, dir, n, name, elf))
+			return 1;
+		n = snprintf(dir, sizeof(dir), "/usr/lib/%s",
+				MULTIARCH[i].triplet);
+		if (try_dir(out, dir, n, name, elf))
+			return 1;
+	}
+	dirs = elf->elf_class == ELFCLASS64 ? DEFAULT_DIRS_64 : DEFAULT_DIRS_32;
+	for (i = 0; dirs[i]; ++i)
+		if (try_dir(out, dirs[i], strlen(dirs[i]), name, elf))
+			return 1;
+	return 0;
+}
+
+static int
+open_elf(struct elf_file* elf, const unsigned char* map, size_t size)
+{
+	elf->map = map;
+	elf->size = size;
+	if (size < EI_NIDENT || memcmp(map, ELFMAG, SELFMAG)
+			|| map[EI_DATA] != HOST_DATA)
+		return -1;
+
+	elf->elf_class = map[EI_CLASS];
+	if (elf->elf_class == ELFCLASS64 && size >= sizeof(Elf64_Ehdr)) {
+		Elf64_Ehdr ehdr;
+
+		memcpy(&ehdr, map, sizeof(ehdr));
+		elf->machine = ehdr.e_machine;
+		elf->phoff = ehdr.e_phoff;
+		elf->phnum = ehdr.e_phnum;
+		elf->phentsize = ehdr.e_phentsize;
+		if (elf->phentsize < sizeof(Elf64_Phdr))
+			return -1;
+	} else if (elf->elf_class == ELFCLASS32 && size >= sizeof(Elf32_Ehdr)) {
+		Elf32_Ehdr ehdr;
+
+		memcpy(&ehdr, map, sizeof(ehdr));
+		elf->machine = ehdr.e_machine;
+		elf->phoff = ehdr.e_phoff;
+		elf->phnum = ehdr.e_phnum;
+		elf->phentsize = ehdr.e_phentsize;
+		if (elf->phentsize < sizeof(Elf32_Phdr))
+			return -1;
+	} else
+		return -1;
+
+	if (!in_bounds(elf->phoff, (uint64_t) elf->phnum * elf->phentsize,
+				size))
+		return -1;
+	return 0;
+}
+
+static void
+get_segment(const struct elf_file* elf, unsigned int i, struct segment* seg)
+{
+	const unsigned char* p = elf->map + elf->phoff + i * elf->phentsize;
+
+	if (elf->elf_class == ELFCLASS64) {
+		Elf64_Phdr phdr;
+
+		memcpy(&phdr, p, sizeof(phdr));
+		seg->type = phdr.p_type;
+		seg->offset = phdr.p_offset;
+		seg->vaddr = phdr.p_vaddr;
+		seg->filesz = phdr.p_filesz;
+	} else {
+		Elf32_Phdr phdr;
+
+		memcpy(&phdr, p, sizeof(phdr));
+		seg->type = phdr.p_type;
+		seg->offset = phdr.p_offset;
+		seg->vaddr = phdr.p_vaddr;
+		seg->filesz = phdr.p_filesz;
+	}
+}
+
+/*
+ * The dynamic section gives the string table by its address once loaded,
+ * which we have to turn back into an offset in the file.
+ */
+static int
+vaddr_offset(const struct elf_file* elf, uint64_t vaddr, uint64_t* offset)
+{
+	struct segment seg;
+	unsigned int i;
+
+	for (i = 0; i < elf->phnum; ++i) {
+		get_segment(elf, i, &seg);
+		if (seg.type == PT_LOAD && vaddr >= seg.vaddr
+				&& vaddr - seg.vaddr < seg.filesz) {
+			*offset = seg.offset + (vaddr - seg.vaddr);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static const char*
+get_string(const struct elf_file* elf, uint64_t offset, uint64_t len)
+{
+	const char* str = (const char*) elf->map + offset;
+
+	if (!in_bounds(offset, len, elf->size) || !memchr(str, '\0', len))
+		return NULL;
+	return str;
+}
+
+/*
+ * Queue the dynamic linker and the libraries that the object at path
+ * needs.  Anything we cannot make sense of is left out.
+ */
+static void
+queue_dependencies(struct warmer* w, const struct elf_file* elf,
+		const char* path)
+{
+	struct segment seg, dynamic = { PT_NULL, 0, 0, 0 };
+	size_t dynsize = elf->elf_class == ELFCLASS64
+		? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+	uint64_t strtab = 0, strsz = 0, rpath = 0, runpath = 0;
+	int have_strtab = 0, have_rpath = 0, have_runpath = 0;
+	const char* rpath_str = NULL;
+	const char* runpath_str = NULL;
+	char lib[PATH_MAX];
+	unsigned int i;
+	uint64_t off;
+
+	for (i = 0; i < elf->phnum; ++i) {
+		get_segment(elf, i, &seg);
+		if (seg.type == PT_INTERP) {
+			const char* interp = get_string(elf, seg.offset,
+					seg.filesz);
+			if (interp)
+				add_string(&w->queue, strdup(interp));
+		} else if (seg.type == PT_DYNAMIC)
+			dynamic = seg;
+	}
+	if (dynamic.type != PT_DYNAMIC
+			|| !in_bounds(dynamic.offset, dynamic.filesz, elf->size))
+		return;
+
+	/*
+	 * First find the string table and run paths, then go through the
+	 * entries again for the libraries.
+	 */
+	for (off = 0; off + dynsize <= dynamic.filesz; off += dynsize) {
+		const unsigned char* p = elf->map + dynamic.offset + off;
+		int64_t tag;
+		uint64_t val;
+
+		if (elf->elf_class == ELFCLASS64) {
+			Elf64_Dyn dyn;
+			memcpy(&dyn, p, sizeof(dyn));
+			tag = dyn.d_tag;
+			val = dyn.d_un.d_val;
+		} else {
+			Elf32_Dyn dyn;
+			memcpy(&dyn, p, sizeof(dyn));
+			tag = dyn.d_tag;
+			val = dyn.d_un.d_val;
+		}
+		if (tag == DT_NULL)
+			break;
+		if (tag == DT_STRTAB)
+			have_strtab = !vaddr_offset(elf, val, &strtab);
+		else if (tag == DT_STRSZ)
+			strsz = val;
+		else if (tag == DT_RPATH) {
+			rpath = val;
+			have_rpath = 1;
+		} else if (tag == DT_RUNPATH) {
+			runpath = val;
+			have_runpath = 1;
+		}
+	}
+	if (!have_strtab || !in_bounds(strtab, strsz, elf->size))
+		return;
+	if (have_rpath && rpath < strsz)
+		rpath_str = get_string(elf, strtab + rpath, strsz - rpath);
+	if (have_runpath && runpath < strsz)
+		runpath_str = get_string(elf, strtab + runpath, strsz - runpath);
+
+	for (off = 0; off + dynsize <= dynamic.filesz; off += dynsize) {
+		const unsigned char* p = elf->map + dynamic.offset + off;
+		const char* name;
+		int64_t tag;
+		uint64_t val;
+
+		if (elf->elf_class == ELFCLASS64) {
+			Elf64_Dyn dyn;
+			memcpy(&dyn, p, sizeof(dyn));
+			tag = dyn.d_tag;
+			val = dyn.d_un.d_val;
+		} else {
+			Elf32_Dyn dyn;
+			memcpy(&dyn, p, sizeof(dyn));
+			tag = dyn.d_tag;
+			val = dyn.d_un.d_val;
+		}
+		if (tag == DT_NULL)
+			break;
+		if (tag != DT_NEEDED || val >= strsz)
+			continue;
+		name = get_string(elf, strtab + val, strsz - val);
+		if (name && find_library(w, lib, name, path, elf,
+					rpath_str, runpath_str))
+			add_string(&w->queue, strdup(lib));
+	}
+}
+
+static int
+already_seen(struct warmer* w, const struct stat* statbuf)
+{
+	size_t i;
+
+	for (i = 0; i < w->n_seen; ++i)
+		if (w->seen[i].dev == statbuf->st_dev
+				&& w->seen[i].ino == statbuf->st_ino)
+			return 1;
+
+	if (w->n_seen == w->alloc_seen) {
+		w->alloc_seen = w->alloc_seen * 2 + 16;
+		w->seen = realloc(w->seen, w->alloc_seen * sizeof(*w->seen));
+		if (!w->seen)
+			err(EXIT_FAILURE, "out of memory");
+	}
+	w->seen[w->n_seen].dev = statbuf->st_dev;
+	w->seen[w->n_seen].ino = statbuf->st_ino;
+	++w->n_seen;
+	return 0;
+}
+
+/*
+ * Read the file at path into the page cache, unless we already have, and
+ * queue whatever it needs.  The whole file is read rather than guessing
+ * which parts will be used, since these are rarely large.
+ */
+static int
+warm_file(struct warmer* w, const char* path)
+{
+	struct stat statbuf;
+	struct elf_file elf;
+	void* map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &statbuf)) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	if (!S_ISREG(statbuf.st_mode)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	if (already_seen(w, &statbuf) || !statbuf.st_size) {
+		close(fd);
+		return 0;
+	}
+
+	if (!readahead(fd, 0, statbuf.st_size)
+			|| !posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED)) {
+		++w->stats->files;
+		w->stats->bytes += statbuf.st_size;
+	}
+
+	map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	if (!open_elf(&elf, map, statbuf.st_size))
+		queue_dependencies(w, &elf, path);
+	munmap(map, statbuf.st_size);
+	return 0;
+}
+
+int
+prewarm(char* const* programs, int n_programs, struct prewarm_stats* stats)
+{
+	struct warmer w;
+	size_t next;
+	int i, ret = 0;
+
+	memset(&w, 0, sizeof(w));
+	w.stats = stats;
+	stats->files = 0;
+	stats->bytes = 0;
+	read_ld_conf(&w.conf_dirs, LD_SO_CONF, 0);
+
+	for (i = 0; i < n_programs && !ret; ++i)
+		ret = warm_file(&w, programs[i]);
+	for (next = 0; next < w.queue.n; ++next)
+		warm_file(&w, w.queue.strings[next]);
+
+	free_strings(&w.queue);
+	free_strings(&w.conf_dirs);
+	free(w.seen);
+	return ret;
+}
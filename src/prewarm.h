@@ -0,0 +1,22 @@
+#ifndef PREWARM_H
+#define PREWARM_H
+
+struct prewarm_stats {
+	unsigned int files;
+	unsigned long long bytes;
+};
+
+/*
+ * Read each of the programs into the page cache along with everything the
+ * dynamic linker would load to run them: the dynamic linker itself and the
+ * shared libraries they need, and those that the libraries need in turn.
+ * Libraries are looked up the way the dynamic linker does, using the
+ * object's run paths, /etc/ld.so.conf and the default directories, so this
+ * should be done after changing into the new root.  Libraries that cannot
+ * be found are skipped, but a program that cannot be read is an error.
+ * Returns 0, or -1 with errno set.
+ */
+int
+prewarm(char* const* programs, int n_programs, struct prewarm_stats* stats);
+
+#endif // PREWARM_H
@@ -0,0 +1,54 @@
+#include "query.h"
+#include "util.h"
+
+static void
+write_field(FILE* out, int format, int* first, const char* key,
+		const char* value)
+{
+	if (format == QUERY_NUL) {
+		if (value)
+			fprintf(out, "%s=%s%c", key, value, '\0');
+		return;
+	}
+
+	fprintf(out, "%s\"%s\":", *first ? "{" : ",", key);
+	if (value)
+		write_json_string(out, value);
+	else
+		fputs("null", out);
+	*first = 0;
+}
+
+int
+write_query(FILE* out, const struct query* query, int format)
+{
+	const struct config_entry* config = query->config;
+	int first = 1;
+	size_t i;
+
+	write_field(out, format, &first, "name", config->name);
+	write_field(out, format, &first, "rootdir", config->rootdir);
+	write_field(out, format, &first, "personality",
+			personality_name(config->personality));
+	write_field(out, format, &first, "lowerdir", config->lowerdir);
+	write_field(out, format, &first, "home", query->home);
+	write_field(out, format, &first, "path", query->path);
+	write_field(out, format, &first, "root_home", query->root_home);
+	write_field(out, format, &first, "root_path", query->root_path);
+
+	if (format == QUERY_NUL) {
+		for (i = 0; i < config->n_files; ++i)
+			write_field(out, format, &first, "copyfile",
+					config->files[i]);
+	} else {
+		fputs(",\"copyfile\":[", out);
+		for (i = 0; i < config->n_files; ++i) {
+			if (i)
+				fputc(',', out);
+			write_json_string(out, config->files[i]);
+		}
+		fputs("]}\n", out);
+	}
+
+	return fflush(out) || ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,35 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdio.h>
+
+#include "configfile.h"
+
+/*
+ * How --query writes its answer.
+ */
+#define QUERY_NUL	0	/* NUL-terminated key=value fields */
+#define QUERY_JSON	1	/* a single JSON object on one line */
+
+/*
+ * What is reported about a configuration, as tools such as the completion
+ * script need it.  The home directories and PATHs are those that commands
+ * get in the new root, for the caller and for root.
+ */
+struct query {
+	const struct config_entry* config;
+	const char* home;
+	const char* path;
+	const char* root_home;
+	const char* root_path;
+};
+
+/*
+ * Write the answer to out.  In the NUL-terminated format there is a field
+ * for each copyfile entry and none for anything that is not set; in JSON
+ * those are an array and null.
+ */
+int
+write_query(FILE* out, const struct query* query, int format);
+
+#endif // QUERY_H
@@ -0,0 +1,577 @@
+/*
+ * Define _GNU_SOURCE so we get accept4(2), setresuid(2), struct ucred and
+ * SO_PEERGROUPS.
+ */
+#define _GNU_SOURCE
+
+#include "server.h"
+#include "cgroup.h"
+#include "util.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
+
+struct request {
+	struct request_header header;
+	gid_t* groups;
+	char** argv;
+	char** env;
+	int fds[3];
+};
+
+static const int FORWARDED_SIGNALS[] = {
+	SIGHUP,
+	SIGINT,
+	SIGQUIT,
+	SIGTERM,
+	SIGUSR1,
+	SIGUSR2,
+	SIGWINCH,
+	0
+};
+
+static int
+forwarded_signal(int sig)
+{
+	const int* s;
+	for (s = FORWARDED_SIGNALS; *s; ++s)
+		if (*s == sig)
+			return 1;
+	return 0;
+}
+
+static int
+read_full(int fd, void* buf, size_t len)
+{
+	char* p = buf;
+	while (len > 0) {
+		ssize_t r = read(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int
+write_full(int fd, const void* buf, size_t len)
+{
+	const char* p = buf;
+	while (len > 0) {
+		ssize_t w = write(fd, p, len);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w < 0)
+			return -1;
+		p += w;
+		len -= w;
+	}
+	return 0;
+}
+
+static int
+listen_on(const char* sockpath)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(sockpath) >= sizeof(addr.sun_path))
+		errx(EXIT_FAILURE, "socket path too long: %s", sockpath);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockpath);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		err(EXIT_FAILURE, "socket");
+	if (unlink(sockpath) && errno != ENOENT)
+		err(EXIT_FAILURE, "unlink %s", sockpath);
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)))
+		err(EXIT_FAILURE, "bind %s", sockpath);
+	/*
+	 * Anyone may connect; we check who they are for each request.
+	 */
+	if (chmod(sockpath, 0666))
+		err(EXIT_FAILURE, "chmod %s", sockpath);
+	if (listen(fd, SOMAXCONN))
+		err(EXIT_FAILURE, "listen");
+	return fd;
+}
+
+static void
+receive_fds(int fd, struct request* req)
+{
+	char control[CMSG_SPACE(sizeof(req->fds))];
+	struct iovec iov = { &req->header, sizeof(req->header) };
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	do
+		n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		errx(EXIT_FAILURE, "failed to receive request");
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+			|| cmsg->cmsg_type != SCM_RIGHTS
+			|| cmsg->cmsg_len != CMSG_LEN(sizeof(req->fds))
+			|| (msg.msg_flags & MSG_CTRUNC))
+		errx(EXIT_FAILURE, "request without standard streams");
+	memcpy(req->fds, CMSG_DATA(cmsg), sizeof(req->fds));
+
+	if (n < sizeof(req->header)
+			&& read_full(fd, (char*) &req->header + n,
+				sizeof(req->header) - n))
+		errx(EXIT_FAILURE, "failed to receive request");
+}
+
+static char**
+split_strings(char** p, const char* end, uint32_t count)
+{
+	char** strings = xmalloc(sizeof(char*) * (count + 1));
+	uint32_t i;
+
+	for (i = 0; i < count; ++i) {
+		char* nul = memchr(*p, '\0', end - *p);
+		if (!nul)
+			errx(EXIT_FAILURE, "malformed request");
+		strings[i] = *p;
+		*p = nul + 1;
+	}
+	strings[count] = NULL;
+	return strings;
+}
+
+static void
+receive_request(int fd, struct request* req)
+{
+	struct request_header* h = &req->header;
+	size_t groups_len;
+	char* strings;
+	char* p;
+
+	receive_fds(fd, req);
+
+	if (h->magic != REQUEST_MAGIC || h->n_groups > NGROUPS_MAX
+			|| h->len > (uint32_t) sysconf(_SC_ARG_MAX)
+			|| h->argc > h->len || h->envc > h->len)
+		errx(EXIT_FAILURE, "malformed request");
+
+	groups_len = sizeof(gid_t) * h->n_groups;
+	req->groups = xmalloc(groups_len + 1);
+	strings = xmalloc(h->len + 1);
+	if (read_full(fd, req->groups, groups_len)
+			|| read_full(fd, strings, h->len))
+		errx(EXIT_FAILURE, "failed to receive request");
+
+	p = strings;
+	req->argv = split_strings(&p, strings + h->len, h->argc);
+	req->env = split_strings(&p, strings + h->len, h->envc);
+	if (p != strings + h->len)
+		errx(EXIT_FAILURE, "malformed request");
+}
+
+static int
+contains(const gid_t* groups, int n, gid_t gid)
+{
+	int i;
+	for (i = 0; i < n; ++i)
+		if (groups[i] == gid)
+			return 1;
+	return 0;
+}
+
+static int
+same_groups(const gid_t* a, int na, const gid_t* b, int nb)
+{
+	int i;
+	if (na != nb)
+		return 0;
+	for (i = 0; i < na; ++i)
+		if (!contains(b, nb, a[i]) || !contains(a, na, b[i]))
+			return 0;
+	return 1;
+}
+
+/*
+ * Check that the client is who it says it is.  The kernel recorded the
+ * credentials of the process that connected, which are the ones we use.
+ */
+static void
+check_credentials(int fd, const struct request* req, struct ucred* cred,
+		gid_t** groups, int* n_groups)
+{
+	socklen_t len = sizeof(*cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, cred, &len))
+		err(EXIT_FAILURE, "SO_PEERCRED");
+	if (cred->uid != req->header.uid || cred->gid != req->header.gid)
+		errx(EXIT_FAILURE, "credentials do not match connection");
+
+	len = 0;
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERGROUPS, NULL, &len)
+			&& errno != ERANGE)
+		err(EXIT_FAILURE, "SO_PEERGROUPS");
+	*groups = xmalloc(len + 1);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERGROUPS, *groups, &len))
+		err(EXIT_FAILURE, "SO_PEERGROUPS");
+	*n_groups = len / sizeof(gid_t);
+
+	if (!same_groups(req->groups, req->header.n_groups,
+				*groups, *n_groups))
+		errx(EXIT_FAILURE, "groups do not match connection");
+}
+
+static void
+start_command(const struct request* req, const char* rootdir,
+		const struct passwd* pw, const gid_t* groups, int n_groups,
+		const struct command* cmd, char** envp,
+		const sigset_t* oldmask, const struct served_cgroup* cgroup)
+{
+	int i;
+
+	/*
+	 * Start a new session so that signals for the command's process
+	 * group reach everything it starts.
+	 */
+	setsid();
+	for (i = 0; i < 3; ++i)
+		if (dup2(req->fds[i], i) < 0)
+			_exit(EXIT_FAILURE);
+
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	sigprocmask(SIG_SETMASK, oldmask, NULL);
+
+	if (cgroup->root && cgroup_enter(cgroup->root, cgroup->config,
+				pw->pw_name, cgroup->limits, cgroup->stamp))
+		err(EXIT_FAILURE, "cgroup %s/%s/%s", cgroup->root,
+			cgroup->config, pw->pw_name);
+
+	switch_root(rootdir, pw->pw_dir);
+	set_user(pw, groups, n_groups);
+
+	exec_command(cmd, envp);
+	err(EXIT_FAILURE, "failed to execute command");
+}
+
+/*
+ * Run one client's command and report back how it finished.  This runs in
+ * its own process and never returns.
+ */
+static void
+handle_client(int fd, const char* rootdir, const struct copy_stats* stats,
+		const struct served_cgroup* cgroup)
+{
+	struct request req;
+	struct ucred cred;
+	struct passwd* pw;
+	struct command cmd;
+	struct pollfd pfds[2];
+	struct signalfd_siginfo si;
+	sigset_t mask, oldmask;
+	gid_t* groups;
+	int n_groups, sfd, status, i;
+	int32_t msg;
+	pid_t pid;
+
+	signal(SIGCHLD, SIG_DFL);
+	receive_request(fd, &req);
+
+	/*
+	 * From now on our complaints go to the client.
+	 */
+	dup2(req.fds[2], STDERR_FILENO);
+
+	check_credentials(fd, &req, &cred, &groups, &n_groups);
+
+	pw = getpwuid(cred.uid);
+	if (!pw)
+		err(EXIT_FAILURE, "getpwuid");
+
+	if ((req.header.flags & REQUEST_DIRECT) && req.header.argc > 0)
+		direct_command(&cmd, req.header.argc, req.argv);
+	else
+		login_command(&cmd, pw, req.header.argc, req.argv);
+	log_session(pw, &cmd, rootdir, stats, NULL);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, &oldmask))
+		err(EXIT_FAILURE, "sigprocmask");
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (sfd < 0)
+		err(EXIT_FAILURE, "signalfd");
+
+	pid = fork();
+	if (pid < 0)
+		err(EXIT_FAILURE, "fork");
+	if (pid == 0)
+		start_command(&req, rootdir, pw, groups, n_groups, &cmd,
+				make_env(pw, req.env), &oldmask, cgroup);
+
+	for (i = 0; i < 3; ++i)
+		close(req.fds[i]);
+
+	pfds[0].fd = sfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = fd;
+	pfds[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "poll");
+		}
+
+		if (pfds[0].revents) {
+			if (read(sfd, &si, sizeof(si)) < 0 && errno != EAGAIN)
+				err(EXIT_FAILURE, "signalfd");
+			if (waitpid(pid, &status, WNOHANG) == pid)
+				break;
+		}
+
+		if (pfds[1].revents) {
+			ssize_t n = read(fd, &msg, sizeof(msg));
+			if (n == sizeof(msg)) {
+				if (forwarded_signal(msg))
+					kill(-pid, msg);
+			} else if (n <= 0) {
+				/*
+				 * The client went away, as if its terminal
+				 * had been hung up.
+				 */
+				kill(-pid, SIGHUP);
+				pfds[1].fd = -1;
+			}
+		}
+	}
+
+	msg = status;
+	write_full(fd, &msg, sizeof(msg));
+	_exit(EXIT_SUCCESS);
+}
+
+void
+serve(const char* sockpath, const char* rootdir,
+		const struct copy_stats* stats,
+		const struct served_cgroup* cgroup)
+{
+	int lfd = listen_on(sockpath);
+
+	/*
+	 * Let the kernel reap the processes handling each client, and do not
+	 * die because a client hung up on us.
+	 */
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		pid_t pid;
+		int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(EXIT_FAILURE, "accept");
+		}
+
+		pid = fork();
+		if (pid < 0)
+			warn("fork");
+		else if (pid == 0) {
+			close(lfd);
+			handle_client(fd, rootdir, stats, cgroup);
+		}
+		close(fd);
+	}
+}
+
+static int server_fd = -1;
+
+static void
+forward_signal(int sig)
+{
+	int32_t msg = sig;
+	int saved = errno;
+	if (write(server_fd, &msg, sizeof(msg)) < 0)
+		;
+	errno = saved;
+}
+
+static int
+connect_as_user(const char* sockpath)
+{
+	struct sockaddr_un addr;
+	uid_t uid = getuid();
+	int fd, saved;
+
+	if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockpath);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	/*
+	 * The server takes our identity from the connection, so make it as
+	 * the real user rather than as root.
+	 */
+	if (seteuid(uid))
+		err(EXIT_FAILURE, "seteuid");
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+		saved = errno;
+		if (seteuid(0))
+			err(EXIT_FAILURE, "seteuid");
+		close(fd);
+		errno = saved;
+		return -1;
+	}
+
+	/*
+	 * The server does everything else, so we have no further use for
+	 * root.
+	 */
+	if (setresuid(uid, uid, uid))
+		err(EXIT_FAILURE, "setresuid");
+	return fd;
+}
+
+static void
+send_request(int fd, uint32_t flags, int argc, char* argv[], char** env)
+{
+	struct request_header header;
+	int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { &header, sizeof(header) };
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	gid_t* groups;
+	size_t len = 0;
+	char* strings;
+	char* p;
+	int n_groups, i, envc;
+
+	n_groups = getgroups(0, NULL);
+	if (n_groups < 0)
+		err(EXIT_FAILURE, "getgroups");
+	groups = xmalloc(sizeof(gid_t) * n_groups + 1);
+	if (getgroups(n_groups, groups) < 0)
+		err(EXIT_FAILURE, "getgroups");
+
+	for (i = 0; i < argc; ++i)
+		len += strlen(argv[i]) + 1;
+	for (envc = 0; env[envc]; ++envc)
+		len += strlen(env[envc]) + 1;
+
+	p = strings = xmalloc(len + 1);
+	for (i = 0; i < argc; ++i)
+		p = stpcpy(p, argv[i]) + 1;
+	for (i = 0; i < envc; ++i)
+		p = stpcpy(p, env[i]) + 1;
+
+	header.magic = REQUEST_MAGIC;
+	header.flags = flags;
+	header.uid = getuid();
+	header.gid = getgid();
+	header.n_groups = n_groups;
+	header.argc = argc;
+	header.envc = envc;
+	header.len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, 0) != sizeof(header)
+			|| write_full(fd, groups, sizeof(gid_t) * n_groups)
+			|| write_full(fd, strings, len))
+		err(EXIT_FAILURE, "failed to send request");
+
+	free(strings);
+	free(groups);
+}
+
+int
+run_on_server(const char* sockpath, int direct, int argc, char* argv[])
+{
+	struct sigaction sa;
+	const int* sig;
+	int32_t status;
+	int fd, i;
+
+	/*
+	 * Make sure there is something to pass as each standard stream.
+	 */
+	for (i = 0; i < 3; ++i)
+		if (fcntl(i, F_GETFD) < 0 && open("/dev/null", O_RDWR) != i)
+			err(EXIT_FAILURE, "open /dev/null");
+
+	fd = connect_as_user(sockpath);
+	if (fd < 0)
+		return -1;
+
+	send_request(fd, direct ? REQUEST_DIRECT : 0, argc, argv,
+			kept_env(environ));
+
+	server_fd = fd;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = forward_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	for (sig = FORWARDED_SIGNALS; *sig; ++sig)
+		sigaction(*sig, &sa, NULL);
+
+	if (read_full(fd, &status, sizeof(status)))
+		errx(EXIT_FAILURE, "server did not report an exit status");
+
+	if (WIFSIGNALED(status)) {
+		signal(WTERMSIG(status), SIG_DFL);
+		raise(WTERMSIG(status));
+		exit(128 + WTERMSIG(status));
+	}
+	exit(WEXITSTATUS(status));
+}
@@ -0,0 +1,64 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "session.h"
+
+#include <stdint.h>
+
+/*
+ * A request is this header followed by the client's supplementary groups
+ * and then len bytes holding argc arguments and envc environment variables
+ * as NUL-terminated strings.  The client's standard input, output and error
+ * are passed with the header.  Once the command finishes the server replies
+ * with its wait status; until then the client may send signal numbers to
+ * be delivered to the command.
+ */
+#define REQUEST_MAGIC	0x43505232	/* "CPR2" */
+
+#define REQUEST_DIRECT	0x1	/* execute argv directly, not with the shell */
+
+struct request_header {
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t n_groups;
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t len;
+};
+
+/*
+ * The cgroup served commands are put in, given as to cgroup_enter() with
+ * the user left out.  There is none if root is NULL.
+ */
+struct served_cgroup {
+	const char* root;
+	const char* config;
+	const char* const* limits;
+	const char* stamp;
+};
+
+/*
+ * Listen on the Unix socket at sockpath and run each client's command in
+ * rootdir, which the caller has already prepared.  Every client gets its
+ * own process, which checks the credentials the client claims against
+ * those of the connection and then starts the command as that user, in
+ * that user's cgroup under cgroup.  This function never returns.
+ */
+void
+serve(const char* sockpath, const char* rootdir,
+		const struct copy_stats* stats,
+		const struct served_cgroup* cgroup);
+
+/*
+ * Ask the server listening on sockpath to run a command for us, executing
+ * argv directly rather than with the login shell if direct is set.  Returns
+ * -1 if there is no server, in which case the caller should run the
+ * command itself.  Otherwise exits with the command's status, forwarding
+ * signals to it until it finishes.
+ */
+int
+run_on_server(const char* sockpath, int direct, int argc, char* argv[]);
+
+#endif // SERVER_H
@@ -0,0 +1,358 @@
+#include "session.h"
+#include "audit.h"
+#include "util.h"
+
+#include <err.h>
+#include <errno.h>
+#include <grp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef SHELL_PATH
+#	define SHELL_PATH	"/bin/sh"
+#endif
+#ifndef ENV_PATH
+#	define ENV_PATH		"/bin:/usr/bin"
+#endif
+#ifndef ENV_SUPATH
+#	define ENV_SUPATH	"/sbin:/bin:/usr/sbin:/usr/bin"
+#endif
+
+
+static const char *const ENV_TO_KEEP[] = {
+	"TERM",
+	"COLORTERM",
+	"DISPLAY",
+	"XAUTHORITY",
+	NULL
+};
+
+struct pw_env {
+	const char name[8];
+	const size_t offset;
+};
+static const struct pw_env ENV_FROM_PASSWD[] = {
+	{ "HOME", offsetof(struct passwd, pw_dir) },
+	{ "SHELL", offsetof(struct passwd, pw_shell) },
+	{ "USER", offsetof(struct passwd, pw_name) },
+	{ "LOGNAME", offsetof(struct passwd, pw_name) },
+	{ "", -1 }
+};
+
+
+static void*
+lookup_user(void* data)
+{
+	struct user_lookup* lookup = data;
+	long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+
+	if (size <= 0)
+		size = 1024;
+	for (;;) {
+		lookup->buf = xmalloc(size);
+		lookup->error = getpwuid_r(lookup->uid, &lookup->pw,
+				lookup->buf, size, &lookup->result);
+		if (lookup->error != ERANGE)
+			break;
+		free(lookup->buf);
+		size *= 2;
+	}
+	return NULL;
+}
+
+void
+start_user_lookup(struct user_lookup* lookup, uid_t uid)
+{
+	lookup->uid = uid;
+	lookup->result = NULL;
+	lookup->buf = NULL;
+	lookup->error = 0;
+	lookup->started = !pthread_create(&lookup->thread, NULL,
+			lookup_user, lookup);
+}
+
+struct passwd*
+finish_user_lookup(struct user_lookup* lookup)
+{
+	if (lookup->started) {
+		if (pthread_join(lookup->thread, NULL))
+			err(EXIT_FAILURE, "pthread_join");
+		lookup->started = 0;
+	} else if (!lookup->buf)
+		lookup_user(lookup);
+
+	errno = lookup->error;
+	return lookup->result;
+}
+
+void
+switch_root(const char* root, const char* dir)
+{
+	if (chroot(root))
+		err(EXIT_FAILURE, "chroot");
+	if (chdir("/"))
+		err(EXIT_FAILURE, "chdir to /");
+	if (chdir(dir))
+		err(EXIT_FAILURE, "chdir to home (%s)", dir);
+}
+
+void
+set_user(const struct passwd* pw, const gid_t* groups, int n_groups)
+{
+	/*
+	 * Change the group first, while we are still allowed to.  Without a
+	 * list of groups we keep the ones we already have.
+	 */
+	if (groups && setgroups(n_groups, groups))
+		err(EXIT_FAILURE, "setgroups");
+	if (setgid(pw->pw_gid))
+		err(EXIT_FAILURE, "setgid");
+	if (setuid(pw->pw_uid))
+		err(EXIT_FAILURE, "setuid to user");
+}
+
+static inline int
+need_sh_quote(char c)
+{
+	return (c == '\'' || c == '!');
+}
+
+static size_t
+quoted_length(const char* arg)
+{
+	size_t len = 2;
+	for (; *arg; ++arg)
+		len += need_sh_quote(*arg) ? 4 : 1;
+	return len;
+}
+
+static char*
+cmd_string(int argc, char* argv[])
+{
+	size_t len = 1;
+	char* cmd;
+	char* p;
+	int i;
+
+	/*
+	 * Work out exactly how much space the quoted arguments need, with a
+	 * separator after each one.
+	 */
+	for (i = 0; i < argc; ++i)
+		len += quoted_length(argv[i]) + 1;
+	cmd = xmalloc(len);
+
+	for (p = cmd; argc > 0; --argc) {
+		const char* src = *argv++;
+		if (p != cmd)
+			*p++ = ' ';
+		*p++ = '\'';
+		while (*src) {
+			size_t len = strcspn(src, "'!");
+			memcpy(p, src, len);
+			src += len;
+			p += len;
+			while (need_sh_quote(*src)) {
+				*p++ = '\'';
+				*p++ = '\\';
+				*p++ = *src++;
+				*p++ = '\'';
+			}
+		}
+		*p++ = '\'';
+	}
+	*p = '\0';
+	return cmd;
+}
+
+static char*
+login_arg0(const char* arg0)
+{
+	const char* base = xbasename(arg0);
+	const size_t len = strlen(base);
+	char* ret = xmalloc(len + 2);
+	ret[0] = '-';
+	strncpy(ret + 1, base, len + 1);
+	return ret;
+}
+
+void
+shell_command(struct command* cmd, const struct passwd* pw, char* line)
+{
+	char** args = xmalloc(sizeof(char*) * 4);
+
+	cmd->path = pw->pw_shell;
+	if (!cmd->path)
+		cmd->path = SHELL_PATH;
+
+	args[0] = login_arg0(cmd->path);
+	if (line) {
+		args[1] = "-c";
+		args[2] = line;
+		args[3] = NULL;
+		cmd->description = line;
+	} else {
+		args[1] = NULL;
+		cmd->description = cmd->path;
+	}
+	cmd->args = args;
+}
+
+void
+login_command(struct command* cmd, const struct passwd* pw,
+		int argc, char* argv[])
+{
+	shell_command(cmd, pw, argc > 0 ? cmd_string(argc, argv) : NULL);
+}
+
+void
+direct_command(struct command* cmd, int argc, char* argv[])
+{
+	cmd->path = argv[0];
+	cmd->args = argv;
+	cmd->description = cmd_string(argc, argv);
+}
+
+static inline char*
+make_env_var(const char* name, const char* value)
+{
+	size_t len = strlen(name) + strlen(value) + 2;
+	char *ret = xmalloc(len);
+	if (len != 1 + snprintf(ret, len, "%s=%s", name, value))
+		errx(EXIT_FAILURE, "failed to copy environment");
+	return ret;
+}
+
+static inline const char*
+pw_at_offset(const struct passwd* pw, size_t offset)
+{
+	return *(const char**) ((const char*) pw + offset);
+}
+
+static const char*
+env_value(char* const* env, const char* name)
+{
+	size_t len = strlen(name);
+	for (; *env; ++env)
+		if (!strncmp(*env, name, len) && (*env)[len] == '=')
+			return *env + len + 1;
+	return NULL;
+}
+
+void
+exec_command(const struct command* cmd, char* const* envp)
+{
+	const char* path = env_value(envp, "PATH");
+	size_t namelen = strlen(cmd->path);
+	int denied = 0;
+	char* buf;
+
+	if (strchr(cmd->path, '/') || !path) {
+		execve(cmd->path, cmd->args, envp);
+		return;
+	}
+
+	buf = xmalloc(strlen(path) + namelen + 3);
+	for (;;) {
+		size_t dirlen = strcspn(path, ":");
+		char* p = buf;
+
+		/*
+		 * An empty element means the current directory, as for
+		 * execvp(3).
+		 */
+		if (dirlen) {
+			memcpy(p, path, dirlen);
+			p += dirlen;
+		} else
+			*p++ = '.';
+		*p++ = '/';
+		memcpy(p, cmd->path, namelen + 1);
+
+		execve(buf, cmd->args, envp);
+		if (errno == EACCES)
+			denied = 1;
+		else if (errno != ENOENT && errno != ENOTDIR)
+			break;
+
+		if (!path[dirlen]) {
+			errno = denied ? EACCES : ENOENT;
+			break;
+		}
+		path += dirlen + 1;
+	}
+	free(buf);
+}
+
+char**
+kept_env(char* const* env)
+{
+	char** kept = xmalloc(sizeof(char*) * ARRAY_SIZE(ENV_TO_KEEP));
+	char** next_slot = kept;
+	const char *const * to_keep;
+
+	for (to_keep = ENV_TO_KEEP; *to_keep; ++to_keep) {
+		const char* value = env_value(env, *to_keep);
+		if (!value)
+			continue;
+		*next_slot++ = make_env_var(*to_keep, value);
+	}
+
+	*next_slot = NULL;
+	return kept;
+}
+
+const char*
+command_path(uid_t uid)
+{
+	return uid ? ENV_PATH : ENV_SUPATH;
+}
+
+char**
+make_env(const struct passwd* pw, char* const* kept)
+{
+	/*
+	 * Add one to size of ENV_TO_KEEP and ENV_FROM_PASSWD to include
+	 * $PATH (note that ENV_TO_KEEP includes a null terminator).
+	 */
+	char** envp = xmalloc(sizeof(char*) * (ARRAY_SIZE(ENV_TO_KEEP)
+					+ ARRAY_SIZE(ENV_FROM_PASSWD) + 1));
+	char** next_slot = envp;
+	const char *const * to_keep;
+	const struct pw_env* from_pw;
+
+	*next_slot++ = make_env_var("PATH", command_path(pw->pw_uid));
+
+	for (from_pw = ENV_FROM_PASSWD; *from_pw->name; ++from_pw)
+		*next_slot++ = make_env_var(from_pw->name,
+				pw_at_offset(pw, from_pw->offset));
+
+	/*
+	 * Only take the variables we know about, even if kept came from
+	 * somewhere we do not trust.
+	 */
+	for (to_keep = ENV_TO_KEEP; *to_keep; ++to_keep) {
+		const char* value = env_value(kept, *to_keep);
+		if (!value)
+			continue;
+		*next_slot++ = make_env_var(*to_keep, value);
+	}
+
+	*next_slot = NULL;
+	return envp;
+}
+
+void
+log_session(const struct passwd* pw, const struct command* cmd,
+		const char* root, const struct copy_stats* stats,
+		const char* extra)
+{
+	audit_log(LOG_NOTICE,
+		"[chpersroot user=\"%s\" command=\"%s\" root=\"%s\""
+		" copied=\"%u\" unchanged=\"%u\"%s]",
+		pw->pw_name, cmd->description, root,
+		stats->copied, stats->unchanged, extra ? extra : "");
+}
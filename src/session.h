@@ -0,0 +1,124 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <pthread.h>
+#include <pwd.h>
+#include <sys/types.h>
+
+/*
+ * The command to run in the new root.
+ */
+struct command {
+	const char* path;	/* program to execute */
+	char** args;		/* its arguments, including argument zero */
+	const char* description; /* what to record in the audit log */
+};
+
+struct copy_stats {
+	unsigned int copied;
+	unsigned int unchanged;
+};
+
+/*
+ * Fill in cmd to run the user's login shell, passing it line as a command
+ * string if it is not NULL.
+ */
+void
+shell_command(struct command* cmd, const struct passwd* pw, char* line);
+
+/*
+ * Fill in cmd to run the user's login shell, passing it the quoted
+ * arguments as a command string if there are any.
+ */
+void
+login_command(struct command* cmd, const struct passwd* pw,
+		int argc, char* argv[]);
+
+/*
+ * Fill in cmd to execute argv directly, with the arguments unchanged.
+ * argc must be at least one.
+ */
+void
+direct_command(struct command* cmd, int argc, char* argv[]);
+
+/*
+ * Execute the command with the environment envp.  A program name without a
+ * slash is looked up in the PATH from envp, so that it is found in the
+ * restricted path of the new root.  Only returns if the command could not
+ * be executed.
+ */
+void
+exec_command(const struct command* cmd, char* const* envp);
+
+/*
+ * Return the variables from env (in the same format as environ) that are
+ * passed through to the new root.
+ */
+char**
+kept_env(char* const* env);
+
+/*
+ * The PATH that commands run as uid get.
+ */
+const char*
+command_path(uid_t uid);
+
+/*
+ * Build the environment for the command from the user's password entry and
+ * the variables from kept_env().
+ */
+char**
+make_env(const struct passwd* pw, char* const* kept);
+
+/*
+ * Looking up the user's password entry can take as long as the rest of our
+ * setup put together when it goes to a network name service, so it is done
+ * by a helper thread while we get on with the rest.
+ */
+struct user_lookup {
+	uid_t uid;
+	int started;		/* whether the thread is running */
+	pthread_t thread;
+	struct passwd pw;
+	struct passwd* result;
+	char* buf;
+	int error;
+};
+
+/*
+ * Start looking up the password entry for uid.  If no thread can be started
+ * the lookup is done by finish_user_lookup() instead.
+ */
+void
+start_user_lookup(struct user_lookup* lookup, uid_t uid);
+
+/*
+ * Wait for the lookup and return the password entry, or NULL with errno set
+ * if there is none.  The thread is gone once this returns, which must happen
+ * before anything that needs a single-threaded process or changes our
+ * effective user.
+ */
+struct passwd*
+finish_user_lookup(struct user_lookup* lookup);
+
+void
+switch_root(const char* root, const char* dir);
+
+/*
+ * Become the user from pw with the given supplementary groups, or keeping
+ * the current ones if groups is NULL.
+ */
+void
+set_user(const struct passwd* pw, const gid_t* groups, int n_groups);
+
+/*
+ * Record the session in the system log, which must already be open.  If
+ * extra is not NULL it is added to the end of the entry and should start
+ * with a space.
+ */
+void
+log_session(const struct passwd* pw, const struct command* cmd,
+		const char* root, const struct copy_stats* stats,
+		const char* extra);
+
+#endif // SESSION_H
@@ -0,0 +1,113 @@
+#include "supervise.h"
+#include "audit.h"
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Signals sent to us rather than to the whole process group.  Those from
+ * the terminal reach the command directly, so we ignore them.
+ */
+static const int FORWARDED_SIGNALS[] = {
+	SIGHUP,
+	SIGTERM,
+	SIGUSR1,
+	SIGUSR2,
+	SIGALRM,
+	0
+};
+
+static const int IGNORED_SIGNALS[] = {
+	SIGINT,
+	SIGQUIT,
+	0
+};
+
+static pid_t command_pid;
+
+static void
+forward_signal(int sig)
+{
+	int saved = errno;
+	kill(command_pid, sig);
+	errno = saved;
+}
+
+static void
+log_exit(const struct passwd* pw, const char* description, const char* root,
+		int status, const struct timespec* wall, const struct rusage* ru)
+{
+	char how[32];
+
+	if (WIFEXITED(status))
+		snprintf(how, sizeof(how), "exit=\"%d\"", WEXITSTATUS(status));
+	else
+		snprintf(how, sizeof(how), "signal=\"%d\"", WTERMSIG(status));
+
+	audit_log(LOG_NOTICE,
+		"[chpersroot-exit user=\"%s\" command=\"%s\" root=\"%s\" %s"
+		" wall=\"%ld.%06ld\" utime=\"%ld.%06ld\" stime=\"%ld.%06ld\""
+		" maxrss=\"%ld\" inblock=\"%ld\" oublock=\"%ld\"]",
+		pw->pw_name, description, root, how,
+		(long) wall->tv_sec, wall->tv_nsec / 1000,
+		(long) ru->ru_utime.tv_sec, (long) ru->ru_utime.tv_usec,
+		(long) ru->ru_stime.tv_sec, (long) ru->ru_stime.tv_usec,
+		ru->ru_maxrss, ru->ru_inblock, ru->ru_oublock);
+}
+
+void
+supervise(const struct passwd* pw, const char* description, const char* root)
+{
+	struct timespec start, end;
+	struct sigaction sa;
+	struct rusage ru;
+	const int* sig;
+	int status;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	command_pid = fork();
+	if (command_pid < 0)
+		err(EXIT_FAILURE, "fork");
+	if (!command_pid)
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = forward_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	for (sig = FORWARDED_SIGNALS; *sig; ++sig)
+		sigaction(*sig, &sa, NULL);
+	for (sig = IGNORED_SIGNALS; *sig; ++sig)
+		signal(*sig, SIG_IGN);
+
+	while (wait4(command_pid, &status, 0, &ru) < 0)
+		if (errno != EINTR)
+			err(EXIT_FAILURE, "wait");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	end.tv_sec -= start.tv_sec;
+	end.tv_nsec -= start.tv_nsec;
+	if (end.tv_nsec < 0) {
+		--end.tv_sec;
+		end.tv_nsec += 1000000000;
+	}
+	log_exit(pw, description, root, status, &end, &ru);
+	audit_close();
+
+	if (WIFSIGNALED(status)) {
+		signal(WTERMSIG(status), SIG_DFL);
+		raise(WTERMSIG(status));
+		exit(128 + WTERMSIG(status));
+	}
+	exit(WEXITSTATUS(status));
+}
@@ -0,0 +1,18 @@
+#ifndef SUPERVISE_H
+#define SUPERVISE_H
+
+#include <pwd.h>
+
+/*
+ * Fork, returning in the child, which carries on to set up the new root and
+ * execute the command as usual.  The parent waits for it and adds a record
+ * of how the command finished and what it used (wall clock, CPU time,
+ * maximum resident set size and block I/O) to the audit log, which must
+ * already be open, and then exits in the same way as the command.  It
+ * stays behind on the host as root, so the user cannot stop the record from
+ * being written, and passes on signals meant for the command.
+ */
+void
+supervise(const struct passwd* pw, const char* description, const char* root);
+
+#endif // SUPERVISE_H
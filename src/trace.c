@@ -0,0 +1,110 @@
+#include "trace.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+trace_start(struct trace* trace)
+{
+	trace->enabled = 0;
+	trace->start = trace->last = now();
+	trace->n_phases = 0;
+}
+
+void
+trace_record(struct trace* trace, const char* name)
+{
+	uint64_t t = now();
+
+	if (trace->n_phases < TRACE_MAX_PHASES) {
+		trace->phases[trace->n_phases].name = name;
+		trace->phases[trace->n_phases].ns = t - trace->last;
+		++trace->n_phases;
+	}
+	trace->last = t;
+}
+
+/*
+ * Like snprintf(3) at offset pos in buf, but safe to call again once the
+ * buffer is full.  Returns the new offset, which is at least size if the
+ * output did not fit.
+ */
+static size_t
+append(char* buf, size_t size, size_t pos, const char* fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (pos >= size)
+		return pos;
+	va_start(ap, fmt);
+	n = vsnprintf(buf + pos, size - pos, fmt, ap);
+	va_end(ap);
+	return n < 0 ? size : pos + n;
+}
+
+int
+trace_write_json(const struct trace* trace, int fd, const char* config)
+{
+	char* buf = NULL;
+	size_t len = 0;
+	unsigned int i;
+	int ret;
+	FILE* out = open_memstream(&buf, &len);
+
+	if (!out)
+		return -1;
+
+	/*
+	 * Built up in memory so that the line goes out in a single write.
+	 */
+	fputs("{\"config\":", out);
+	write_json_string(out, config);
+	fputs(",\"phases_ns\":{", out);
+	for (i = 0; i < trace->n_phases; ++i)
+		fprintf(out, "%s\"%s\":%" PRIu64, i ? "," : "",
+			trace->phases[i].name, trace->phases[i].ns);
+	fprintf(out, "},\"total_ns\":%" PRIu64 "}\n",
+		trace->last - trace->start);
+	if (fclose(out)) {
+		free(buf);
+		return -1;
+	}
+
+	ret = write(fd, buf, len) == (ssize_t) len ? 0 : -1;
+	free(buf);
+	return ret;
+}
+
+char*
+trace_fields(const struct trace* trace)
+{
+	size_t size = 48 * (TRACE_MAX_PHASES + 1);
+	char* buf = malloc(size);
+	size_t pos = 0;
+	unsigned int i;
+
+	if (!buf)
+		return NULL;
+
+	for (i = 0; i < trace->n_phases; ++i)
+		pos = append(buf, size, pos, " %s_ns=\"%" PRIu64 "\"",
+				trace->phases[i].name, trace->phases[i].ns);
+	append(buf, size, pos, " total_ns=\"%" PRIu64 "\"",
+			trace->last - trace->start);
+	return buf;
+}
@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAX_PHASES	8
+
+struct trace_phase {
+	const char* name;
+	uint64_t ns;
+};
+
+/*
+ * How long each stage of setting up the new root took, measured with the
+ * monotonic clock.  Each phase runs from the end of the previous one, or
+ * from trace_start() for the first.
+ */
+struct trace {
+	int enabled;
+	uint64_t start;
+	uint64_t last;
+	unsigned int n_phases;
+	struct trace_phase phases[TRACE_MAX_PHASES];
+};
+
+/*
+ * Start the clock.  This is always done so that a trace which is only
+ * enabled once the configuration has been read still covers reading it.
+ */
+void
+trace_start(struct trace* trace);
+
+void
+trace_record(struct trace* trace, const char* name);
+
+/*
+ * End the current phase, calling it name.  Does nothing unless the trace
+ * is enabled, so it is cheap enough to leave in place.
+ */
+static inline void
+trace_mark(struct trace* trace, const char* name)
+{
+	if (trace->enabled)
+		trace_record(trace, name);
+}
+
+/*
+ * Write the trace to fd as a single line of JSON.
+ */
+int
+trace_write_json(const struct trace* trace, int fd, const char* config);
+
+/*
+ * Format the trace as name_ns="N" fields for the audit log entry.  The
+ * result is allocated with malloc(3).
+ */
+char*
+trace_fields(const struct trace* trace);
+
+#endif // TRACE_H
@@ -0,0 +1,52 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+static inline void*
+xmalloc(size_t size)
+{
+	void* result = malloc(size);
+	if (!result)
+		err(EXIT_FAILURE, "out of memory");
+
+	return result;
+}
+
+static inline const char*
+xbasename(const char* path)
+{
+	const char* ret = strrchr(path, '/');
+	if (!ret)
+		ret = path;
+	else
+		++ret;
+	return ret;
+}
+
+/*
+ * Write str to out as a JSON string, quoted and escaped.
+ */
+static inline void
+write_json_string(FILE* out, const char* str)
+{
+	const unsigned char* p;
+
+	fputc('"', out);
+	for (p = (const unsigned char*) str; *p; ++p) {
+		if (*p == '"' || *p == '\\')
+			fprintf(out, "\\%c", *p);
+		else if (*p < 0x20 || *p == 0x7f)
+			fprintf(out, "\\u%04x", *p);
+		else
+			fputc(*p, out);
+	}
+	fputc('"', out);
+}
+
+#endif // UTIL_H
@@ -0,0 +1,408 @@
+/*
+ * Benchmarks for chpersroot, driven by test/bench.sh.  Every result is
+ * printed as a line of JSON so that runs can be compared mechanically.
+ *
+ *   bench parse DIR
+ *	parse generated configuration files of increasing size
+ *   bench copy DIR
+ *	copy files of increasing size with copyfile()
+ *   bench invoke NAME RUNS [-r PATH]... -- COMMAND [ARGS...]
+ *	run COMMAND RUNS times and report latency percentiles, removing
+ *	each PATH before every run
+ *   bench burst NAME JOBS RUNS [-r PATH]... -- COMMAND [ARGS...]
+ *	start JOBS copies of COMMAND at once, RUNS times, and report their
+ *	latency percentiles and the number finished per second
+ */
+#include "configfile.h"
+#include "copyfile.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Repeat each measurement until it has taken at least this long.
+ */
+#define MIN_TIME_NS	200000000
+#define MIN_ITERATIONS	3
+
+static const int SECTION_COUNTS[] = { 10, 100, 1000, 10000, 0 };
+static const long FILE_SIZES[] = {
+	4096, 65536, 1024 * 1024, 16 * 1024 * 1024, 0
+};
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char*
+path_in(const char* dir, const char* name)
+{
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char* path = malloc(len);
+	if (!path)
+		err(EXIT_FAILURE, "out of memory");
+	snprintf(path, len, "%s/%s", dir, name);
+	return path;
+}
+
+static off_t
+write_config(const char* path, int n_sections)
+{
+	FILE* f = fopen(path, "w");
+	off_t size;
+	int i;
+
+	if (!f)
+		err(EXIT_FAILURE, "%s", path);
+	for (i = 0; i < n_sections; ++i)
+		fprintf(f, "[root%d]\n"
+			"\trootdir = /srv/roots/root%d\n"
+			"\tpersonality = linux32\n"
+			"\tcopyfile = /etc/resolv.conf\n"
+			"\tcopyfile = /etc/hosts\n"
+			"\n", i, i);
+	size = ftello(f);
+	if (fclose(f))
+		err(EXIT_FAILURE, "%s", path);
+	return size;
+}
+
+static void
+report_rate(const char* bench, const char* param, long value, off_t bytes,
+		unsigned long iterations, uint64_t elapsed)
+{
+	double per_op = (double) elapsed / iterations;
+
+	printf("{\"bench\":\"%s\",\"%s\":%ld,\"bytes\":%lld,"
+		"\"iterations\":%lu,\"ns_per_op\":%.0f,\"mb_per_s\":%.1f}\n",
+		bench, param, value, (long long) bytes, iterations, per_op,
+		bytes / per_op * 1e9 / (1024 * 1024));
+	fflush(stdout);
+}
+
+static void
+bench_parse(const char* dir)
+{
+	char* path = path_in(dir, "bench.conf");
+	const int* n;
+
+	for (n = SECTION_COUNTS; *n; ++n) {
+		off_t size = write_config(path, *n);
+		unsigned long iterations = 0;
+		uint64_t start, elapsed;
+		char name[32];
+		int fd = open(path, O_RDONLY);
+		if (fd < 0)
+			err(EXIT_FAILURE, "%s", path);
+
+		start = now();
+		do {
+			struct config* config;
+			if (lseek(fd, 0, SEEK_SET)
+					|| parse_configfile(fd, &config))
+				errx(EXIT_FAILURE, "failed to parse %s", path);
+			free_config(config);
+			++iterations;
+			elapsed = now() - start;
+		} while (elapsed < MIN_TIME_NS || iterations < MIN_ITERATIONS);
+		report_rate("parse", "sections", *n, size, iterations, elapsed);
+
+		/*
+		 * The last section is the worst case for a targeted parse.
+		 */
+		snprintf(name, sizeof(name), "root%d", *n - 1);
+		iterations = 0;
+		start = now();
+		do {
+			struct config* config;
+			if (lseek(fd, 0, SEEK_SET)
+					|| parse_configsection(fd, name, &config)
+					|| !config_find(config, name))
+				errx(EXIT_FAILURE, "failed to parse %s", path);
+			free_config(config);
+			++iterations;
+			elapsed = now() - start;
+		} while (elapsed < MIN_TIME_NS || iterations < MIN_ITERATIONS);
+		report_rate("parse_section", "sections", *n, size, iterations,
+				elapsed);
+
+		close(fd);
+	}
+	unlink(path);
+	free(path);
+}
+
+static void
+write_data(const char* path, long size)
+{
+	char buf[4096];
+	FILE* f = fopen(path, "w");
+	long done;
+	size_t i;
+
+	if (!f)
+		err(EXIT_FAILURE, "%s", path);
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = i * 7;
+	for (done = 0; done < size; done += sizeof(buf))
+		fwrite(buf, 1, sizeof(buf), f);
+	if (fclose(f))
+		err(EXIT_FAILURE, "%s", path);
+}
+
+static void
+bench_copy(const char* dir)
+{
+	char* src = path_in(dir, "bench.src");
+	char* dst = path_in(dir, "bench.dst");
+	const long* size;
+
+	for (size = FILE_SIZES; *size; ++size) {
+		unsigned long iterations = 0;
+		uint64_t start, elapsed;
+
+		write_data(src, *size);
+
+		start = now();
+		do {
+			if (copyfile(src, dst, COPYFILE_ALWAYS) < 0)
+				err(EXIT_FAILURE, "copyfile");
+			++iterations;
+			elapsed = now() - start;
+		} while (elapsed < MIN_TIME_NS || iterations < MIN_ITERATIONS);
+		report_rate("copy", "size", *size, *size, iterations, elapsed);
+
+		iterations = 0;
+		start = now();
+		do {
+			if (copyfile(src, dst, 0) != COPYFILE_UNCHANGED)
+				errx(EXIT_FAILURE, "copy is not current");
+			++iterations;
+			elapsed = now() - start;
+		} while (elapsed < MIN_TIME_NS || iterations < MIN_ITERATIONS);
+		report_rate("copy_current", "size", *size, *size, iterations,
+				elapsed);
+	}
+	unlink(src);
+	unlink(dst);
+	free(src);
+	free(dst);
+}
+
+static int
+compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * The nearest-rank percentile of sorted samples.
+ */
+static double
+percentile_us(const uint64_t* samples, int n, int p)
+{
+	int rank = (n * p + 99) / 100;
+	if (rank < 1)
+		rank = 1;
+	return samples[rank - 1] / 1000.0;
+}
+
+static void
+remove_paths(char** remove, int n_remove)
+{
+	int i;
+
+	for (i = 0; i < n_remove; ++i)
+		if (unlink(remove[i]) && errno != ENOENT)
+			err(EXIT_FAILURE, "unlink %s", remove[i]);
+}
+
+static pid_t
+start_command(char** command)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		err(EXIT_FAILURE, "fork");
+	if (pid == 0) {
+		execvp(command[0], command);
+		err(127, "%s", command[0]);
+	}
+	return pid;
+}
+
+static void
+check_status(int status, char** command)
+{
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		errx(EXIT_FAILURE, "%s failed", command[0]);
+}
+
+static void
+print_latency(const char* bench, const char* name, int runs, int n,
+		uint64_t* samples)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		total += samples[i];
+	qsort(samples, n, sizeof(uint64_t), compare_u64);
+	printf("{\"bench\":\"%s\",\"mode\":\"%s\",\"runs\":%d,"
+		"\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,"
+		"\"max_us\":%.1f,\"mean_us\":%.1f",
+		bench, name, runs, percentile_us(samples, n, 50),
+		percentile_us(samples, n, 90),
+		percentile_us(samples, n, 99),
+		samples[n - 1] / 1000.0, total / 1000.0 / n);
+}
+
+static void
+bench_invoke(const char* name, int runs, char** remove, int n_remove,
+		char** command)
+{
+	uint64_t* samples = calloc(runs, sizeof(uint64_t));
+	int i;
+
+	if (!samples)
+		err(EXIT_FAILURE, "out of memory");
+
+	for (i = 0; i < runs; ++i) {
+		uint64_t start;
+		int status;
+		pid_t pid;
+
+		remove_paths(remove, n_remove);
+
+		start = now();
+		pid = start_command(command);
+		if (waitpid(pid, &status, 0) != pid)
+			err(EXIT_FAILURE, "waitpid");
+		samples[i] = now() - start;
+		check_status(status, command);
+	}
+
+	print_latency("invoke", name, runs, runs, samples);
+	printf("}\n");
+	fflush(stdout);
+	free(samples);
+}
+
+/*
+ * Each sample is the time from starting the burst until that copy of the
+ * command has been reaped, so the slowest shows how long the others can
+ * hold one up.
+ */
+static void
+bench_burst(const char* name, int jobs, int runs, char** remove,
+		int n_remove, char** command)
+{
+	uint64_t* samples = calloc((size_t) jobs * runs, sizeof(uint64_t));
+	uint64_t elapsed = 0;
+	int n = 0, i, j;
+
+	if (!samples)
+		err(EXIT_FAILURE, "out of memory");
+
+	for (i = 0; i < runs; ++i) {
+		uint64_t start;
+
+		remove_paths(remove, n_remove);
+
+		start = now();
+		for (j = 0; j < jobs; ++j)
+			start_command(command);
+		for (j = 0; j < jobs; ++j) {
+			int status;
+
+			if (wait(&status) < 0)
+				err(EXIT_FAILURE, "wait");
+			samples[n++] = now() - start;
+			check_status(status, command);
+		}
+		elapsed += now() - start;
+	}
+
+	print_latency("burst", name, runs, n, samples);
+	printf(",\"jobs\":%d,\"per_s\":%.1f}\n", jobs, n * 1e9 / elapsed);
+	fflush(stdout);
+	free(samples);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: bench parse DIR\n"
+		"       bench copy DIR\n"
+		"       bench invoke NAME RUNS [-r PATH]... -- COMMAND...\n"
+		"       bench burst NAME JOBS RUNS [-r PATH]... -- COMMAND...\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * The paths to remove, from argv[i] on, and the command after "--".
+ */
+static char**
+parse_command(int argc, char* argv[], int i, char** remove, int* n_remove)
+{
+	if (!remove)
+		err(EXIT_FAILURE, "out of memory");
+	*n_remove = 0;
+	for (; i < argc && strcmp(argv[i], "--"); i += 2) {
+		if (strcmp(argv[i], "-r") || i + 1 >= argc)
+			usage();
+		remove[(*n_remove)++] = argv[i + 1];
+	}
+	if (i + 1 >= argc)
+		usage();
+	return argv + i + 1;
+}
+
+int
+main(int argc, char* argv[])
+{
+	if (argc == 3 && !strcmp(argv[1], "parse")) {
+		bench_parse(argv[2]);
+	} else if (argc == 3 && !strcmp(argv[1], "copy")) {
+		bench_copy(argv[2]);
+	} else if (argc > 5 && !strcmp(argv[1], "invoke")) {
+		char** remove = malloc(sizeof(char*) * argc);
+		int n_remove, runs = atoi(argv[3]);
+		char** command = parse_command(argc, argv, 4, remove,
+				&n_remove);
+
+		if (runs < 1)
+			usage();
+		bench_invoke(argv[2], runs, remove, n_remove, command);
+		free(remove);
+	} else if (argc > 6 && !strcmp(argv[1], "burst")) {
+		char** remove = malloc(sizeof(char*) * argc);
+		int n_remove, jobs = atoi(argv[3]), runs = atoi(argv[4]);
+		char** command = parse_command(argc, argv, 5, remove,
+				&n_remove);
+
+		if (jobs < 1 || runs < 1)
+			usage();
+		bench_burst(argv[2], jobs, runs, remove, n_remove, command);
+		free(remove);
+	} else
+		usage();
+
+	return EXIT_SUCCESS;
+}
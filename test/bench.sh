@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# Benchmarks for chpersroot.  Each result is printed as a line of JSON.
+#
+# Invocations of the whole program use test/chpersroot, like
+# t-chpersroot.sh.  When not run as root they run in a user namespace where
+# we are root, so that no privileges are needed.
+
+cd "$(dirname "$0")"
+
+: ${BENCH_RUNS:=200}
+: ${BENCH_JOBS:=32}
+: ${BENCH_BURSTS:=20}
+
+if test "$(id -u)" != 0 && test -z "$BENCH_USERNS"
+then
+	if command -v unshare >/dev/null && unshare -r true 2>/dev/null
+	then
+		BENCH_USERNS=1 exec unshare -r sh "$PWD/bench.sh" "$@"
+	fi
+fi
+
+trash=$PWD/trash
+root=$trash/root
+
+# Copy a program and the libraries it needs into the new root.
+install_program() {
+	for f in "$1" $(ldd "$1" 2>/dev/null | grep -o '/[^ ]*')
+	do
+		mkdir -p "$root$(dirname "$f")" &&
+		cp -L "$f" "$root$f" || return 1
+	done
+}
+
+rm -rf "$trash" &&
+mkdir -p "$trash/run" "$root$(getent passwd 0 | cut -d: -f6)" ||
+exit 1
+
+./bench parse "$trash" &&
+./bench copy "$trash" || exit 1
+
+if test "$(id -u)" != 0
+then
+	echo >&2 "skipping invocation benchmarks: cannot become root"
+elif ! command -v ldd >/dev/null || ! install_program /bin/true
+then
+	echo >&2 "skipping invocation benchmarks: cannot set up root"
+else
+	# The copied file must be our own: in a user namespace we cannot give
+	# the copy any other owner.
+	mkdir -p "$root$trash" &&
+	head -c 65536 /dev/zero >"$trash/data" &&
+	head -c 16777216 /dev/zero >"$trash/bigdata" &&
+	ln -s "$PWD/chpersroot" "$trash/burst" &&
+	cat >"$trash/chpersroot.conf" <<-EOT
+	[chpersroot]
+		rootdir = $root
+		copyfile = $trash/data
+		exec = direct
+	[burst]
+		rootdir = $root
+		copyfile = $trash/bigdata
+		exec = direct
+	EOT
+	chmod 644 "$trash/chpersroot.conf"
+
+	# A cold run has to parse the configuration and copy files into the
+	# new root; a warm one finds both already done.
+	./bench invoke cold "$BENCH_RUNS" -r "$trash/run/config.cache" \
+		-r "$root$trash/data" -- ./chpersroot true &&
+	./bench invoke warm "$BENCH_RUNS" -- ./chpersroot true &&
+
+	# A burst starts many at once with a large copy out of date, as when a
+	# build farm launches its jobs, to see how they share copying.
+	./bench burst cold "$BENCH_JOBS" "$BENCH_BURSTS" \
+		-r "$root$trash/bigdata" -- "$trash/burst" true &&
+	./bench burst warm "$BENCH_JOBS" "$BENCH_BURSTS" \
+		-- "$trash/burst" true || exit 1
+fi
+
+rm -rf "$trash"
@@ -0,0 +1,88 @@
+/*
+ * A client for the chpersroot server that claims whatever credentials it is
+ * told to, for testing that the server checks them against the connection.
+ * It asks for "echo" to be run directly and exits with its status.  Without
+ * any groups it claims its own supplementary groups.
+ */
+#include "server.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_GROUPS	64
+
+int
+main(int argc, char* argv[])
+{
+	static const char command[] = "echo";
+	struct request_header header;
+	struct sockaddr_un addr;
+	int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { &header, sizeof(header) };
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	gid_t groups[MAX_GROUPS];
+	int n_groups, fd, i;
+	int32_t status;
+
+	if (argc < 4 || argc - 4 > MAX_GROUPS)
+		errx(EXIT_FAILURE, "usage: %s SOCKET UID GID [GROUP...]",
+			argv[0]);
+	if (argc > 4) {
+		n_groups = argc - 4;
+		for (i = 0; i < n_groups; ++i)
+			groups[i] = atoi(argv[i + 4]);
+	} else {
+		n_groups = getgroups(MAX_GROUPS, groups);
+		if (n_groups < 0)
+			err(EXIT_FAILURE, "getgroups");
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)))
+		err(EXIT_FAILURE, "connect %s", argv[1]);
+
+	header.magic = REQUEST_MAGIC;
+	header.flags = REQUEST_DIRECT;
+	header.uid = atoi(argv[2]);
+	header.gid = atoi(argv[3]);
+	header.n_groups = n_groups;
+	header.argc = 1;
+	header.envc = 0;
+	header.len = sizeof(command);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, 0) != sizeof(header)
+			|| write(fd, groups, sizeof(gid_t) * n_groups)
+				!= (ssize_t) (sizeof(gid_t) * n_groups)
+			|| write(fd, command, sizeof(command))
+				!= sizeof(command))
+		err(EXIT_FAILURE, "failed to send request");
+
+	if (read(fd, &status, sizeof(status)) != sizeof(status))
+		errx(EXIT_FAILURE, "server did not report an exit status");
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
@@ -0,0 +1,236 @@
+/*
+ * Differential test of the ways iniparser reads its input: scanning a
+ * buffer in place, reading a file descriptor a block at a time and pulling
+ * events from a buffer.  Random input built from the characters the parser
+ * cares about is run through each, and the callbacks, line numbers, errors
+ * and results must agree.
+ */
+#include "iniparser.h"
+
+#include <err.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define N_CASES		20000
+#define MAX_INPUT	32768
+
+static const char *const PIECES[] = {
+	"[", "]", "=", ";", "'", "\"", "\\", "\r", "\n", " ", "\t",
+	"a", "b", "key", "value", "[a]\n", "[b]\n", "[A]", "k = v\n",
+	"\\\n", "\\\r\n", "\r\n", "\xc3\xa9", "\x80", "\0",
+	"; comment\n", "x = 'q'\n", "y = \"q\"\n",
+};
+
+static const char *const TARGETS[] = { NULL, "a", "b", "A", "key" };
+
+struct transcript {
+	char* str;
+	size_t len;
+	size_t alloc;
+};
+
+static void
+record(struct transcript* t, const char* fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(t->str + t->len, t->alloc - t->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			err(EXIT_FAILURE, "vsnprintf");
+		if (t->len + n < t->alloc)
+			break;
+		t->alloc = (t->len + n + 1) * 2;
+		t->str = realloc(t->str, t->alloc);
+		if (!t->str)
+			err(EXIT_FAILURE, "out of memory");
+	}
+	t->len += n;
+}
+
+static int
+diff_begin_section(void* data, const char* section_name)
+{
+	record(data, "section [%s]\n", section_name);
+	return 0;
+}
+
+static int
+diff_value_pair(void* data, const char* key, const char* value)
+{
+	record(data, "value [%s] = [%s]\n", key, value);
+	return 0;
+}
+
+static void
+diff_fatal_error(void* data, int lineno, const char* msg)
+{
+	record(data, "error on line %d: %s\n", lineno, msg);
+}
+
+static iniparser_callbacks callbacks = {
+	diff_begin_section,
+	diff_value_pair,
+	diff_fatal_error
+};
+
+static size_t
+generate(char* buf)
+{
+	size_t len = 0;
+	int n_pieces = rand() % 8 ? rand() % 64 : rand() % 4096;
+
+	while (n_pieces-- > 0) {
+		int i = rand() % (sizeof(PIECES) / sizeof(PIECES[0]));
+		/*
+		 * The NUL piece is the only one strlen() cannot measure.
+		 */
+		size_t n = *PIECES[i] ? strlen(PIECES[i]) : 1;
+		if (len + n > MAX_INPUT)
+			break;
+		memcpy(buf + len, PIECES[i], n);
+		len += n;
+	}
+	return len;
+}
+
+static void
+parse_buffer(struct transcript* t, const char* buf, size_t len,
+		const char* target)
+{
+	iniparser* parser = iniparser_alloc(&callbacks, t);
+	int result;
+
+	if (!parser)
+		errx(EXIT_FAILURE, "out of memory");
+	result = iniparser_parsebuf_section(parser, buf, len, target);
+	record(t, "result %d\n", result);
+	iniparser_free(parser);
+}
+
+/*
+ * Pulling events should give exactly what the callbacks see.
+ */
+static void
+pull_buffer(struct transcript* t, const char* buf, size_t len,
+		const char* target)
+{
+	iniparser* parser = iniparser_alloc(NULL, NULL);
+	iniparser_event event;
+	int result = 0;
+
+	if (!parser)
+		errx(EXIT_FAILURE, "out of memory");
+	iniparser_begin(parser, buf, len, target);
+	while (iniparser_next(parser, &event) != INIPARSER_END) {
+		if (event.type == INIPARSER_SECTION) {
+			record(t, "section [%.*s]\n",
+				(int) event.section.len, event.section.str);
+		} else if (event.type == INIPARSER_VALUE) {
+			record(t, "value [%.*s] = [%.*s]\n",
+				(int) event.key.len, event.key.str,
+				(int) event.value.len, event.value.str);
+		} else {
+			record(t, "error on line %d: %s\n", event.lineno,
+				event.error);
+			result = -1;
+			break;
+		}
+	}
+	iniparser_end(parser);
+	record(t, "result %d\n", result);
+	iniparser_free(parser);
+}
+
+/*
+ * A pipe cannot be mapped, so the parser has to read it.
+ */
+static void
+parse_pipe(struct transcript* t, const char* buf, size_t len,
+		const char* target)
+{
+	iniparser* parser = iniparser_alloc(&callbacks, t);
+	int fds[2];
+	int result;
+
+	if (!parser)
+		errx(EXIT_FAILURE, "out of memory");
+	if (pipe(fds))
+		err(EXIT_FAILURE, "pipe");
+	if (len && write(fds[1], buf, len) != (ssize_t) len)
+		err(EXIT_FAILURE, "write");
+	close(fds[1]);
+
+	result = iniparser_parsefd_section(parser, fds[0], target);
+	record(t, "result %d\n", result);
+	close(fds[0]);
+	iniparser_free(parser);
+}
+
+static void
+dump_input(const char* buf, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		unsigned char c = buf[i];
+		if (c == '\\')
+			fputs("\\\\", stderr);
+		else if (c >= 0x20 && c < 0x7f)
+			fputc(c, stderr);
+		else
+			fprintf(stderr, "\\x%02x", c);
+	}
+	fputc('\n', stderr);
+}
+
+int
+main(int argc, char* argv[])
+{
+	struct transcript from_buffer = { NULL, 0, 0 };
+	struct transcript from_pipe = { NULL, 0, 0 };
+	struct transcript pulled = { NULL, 0, 0 };
+	char* buf = malloc(MAX_INPUT);
+	unsigned int seed = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+	int i;
+
+	if (!buf)
+		err(EXIT_FAILURE, "out of memory");
+	srand(seed);
+
+	for (i = 0; i < N_CASES; ++i) {
+		size_t len = generate(buf);
+		const char* target = TARGETS[rand() %
+			(sizeof(TARGETS) / sizeof(TARGETS[0]))];
+
+		from_buffer.len = from_pipe.len = pulled.len = 0;
+		record(&from_buffer, "");
+		record(&from_pipe, "");
+		record(&pulled, "");
+		parse_buffer(&from_buffer, buf, len, target);
+		parse_pipe(&from_pipe, buf, len, target);
+		pull_buffer(&pulled, buf, len, target);
+
+		if (strcmp(from_buffer.str, from_pipe.str)
+				|| strcmp(from_buffer.str, pulled.str)) {
+			fprintf(stderr, "case %d (seed %u, section %s) differs\n"
+				"input: ", i, seed, target ? target : "(all)");
+			dump_input(buf, len);
+			fprintf(stderr, "scanned:\n%sread:\n%spulled:\n%s",
+				from_buffer.str, from_pipe.str, pulled.str);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%d inputs parsed the same every way\n", N_CASES);
+	free(from_buffer.str);
+	free(from_pipe.str);
+	free(pulled.str);
+	free(buf);
+	return EXIT_SUCCESS;
+}
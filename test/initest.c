@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -51,9 +52,16 @@ main(int argc, char* argv[])
 {
 	print_config config;
 	int fd, retval = -1;
+	int targeted = 0;
 	iniparser* parser;
+
+	if (argc > 1 && !strcmp(argv[1], "-s")) {
+		targeted = 1;
+		--argc;
+		++argv;
+	}
 	if (4 != argc)
-		errx(EXIT_FAILURE, "usage: %s [inifile] [section] [key]",
+		errx(EXIT_FAILURE, "usage: %s [-s] [inifile|-] [section] [key]",
 			argv[0]);
 
 	config.section = argv[2];
@@ -64,11 +72,22 @@ main(int argc, char* argv[])
 	if (!parser)
 		errx(EXIT_FAILURE, "out of memory");
 
-	fd = open(argv[1], O_RDONLY);
-	if (fd < 1)
-		err(EXIT_FAILURE, "open");
+	/*
+	 * Reading from a pipe on standard input exercises the parser's
+	 * block-at-a-time path instead of mapping the file.
+	 */
+	if (!strcmp(argv[1], "-"))
+		fd = STDIN_FILENO;
+	else {
+		fd = open(argv[1], O_RDONLY);
+		if (fd < 0)
+			err(EXIT_FAILURE, "open");
+	}
 
-	retval = iniparser_parsefd(parser, fd);
+	if (targeted)
+		retval = iniparser_parsefd_section(parser, fd, config.section);
+	else
+		retval = iniparser_parsefd(parser, fd);
 
 	close(fd);
 	return retval;
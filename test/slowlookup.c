@@ -0,0 +1,29 @@
+/*
+ * Preloaded into chpersroot to make looking up a password entry as slow as
+ * a network name service can be, so that the helper thread doing it is
+ * still running while the rest of the setup happens.  The delay in seconds
+ * is taken from SLOW_LOOKUP.
+ */
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+
+int
+getpwuid_r(uid_t uid, struct passwd* pw, char* buf, size_t size,
+		struct passwd** result)
+{
+	int (*real)(uid_t, struct passwd*, char*, size_t, struct passwd**);
+	const char* delay = getenv("SLOW_LOOKUP");
+	struct timespec left = { delay ? atoi(delay) : 0, 0 };
+
+	while (nanosleep(&left, &left) && errno == EINTR)
+		;
+
+	real = dlsym(RTLD_NEXT, "getpwuid_r");
+	return real(uid, pw, buf, size, result);
+}
@@ -0,0 +1,849 @@
+#!/bin/sh
+#
+# End-to-end tests of the chpersroot binary built as test/chpersroot, which
+# reads test/trash/chpersroot.conf and keeps its runtime files in
+# test/trash/run.  These need to be run as root since they really do enter a
+# chroot, which is built in test/trash/root from the host's binaries.
+
+cd "$(dirname "$0")"
+
+n_passed=0
+n_failed=0
+
+if test "$(id -u)" != 0
+then
+	echo "skipping chpersroot tests: not running as root"
+	exit 0
+fi
+if ! command -v ldd >/dev/null
+then
+	echo "skipping chpersroot tests: ldd not found"
+	exit 0
+fi
+
+trash=$PWD/trash
+root=$trash/root
+shell=$(getent passwd 0 | cut -d: -f7)
+home=$(getent passwd 0 | cut -d: -f6)
+
+# Copy a program and the libraries it needs into the new root.
+install_program() {
+	for f in "$1" $(ldd "$1" 2>/dev/null | grep -o '/[^ ]*')
+	do
+		mkdir -p "$root$(dirname "$f")" &&
+		cp -L "$f" "$root$f" || return 1
+	done
+}
+
+setup_root() {
+	rm -rf "$trash" &&
+	mkdir -p "$root$home" "$trash/run" &&
+	for p in "$shell" /bin/sh /bin/cat /bin/echo
+	do
+		install_program "$p" || return 1
+	done
+}
+
+write_config() {
+	cat >"$trash/chpersroot.conf" &&
+	chmod 644 "$trash/chpersroot.conf"
+}
+
+start_server() {
+	./chpersroot --serve 2>"$trash/server.log" &
+	server_pid=$!
+	n=0
+	while ! test -S "$trash/run/server/chpersroot"
+	do
+		n=$((n + 1))
+		test $n -lt 50 || return 1
+		sleep 0.1
+	done
+}
+
+stop_server() {
+	kill $server_pid
+	wait $server_pid 2>/dev/null
+	rm -f "$trash/run/server/chpersroot"
+}
+
+# Run a setuid copy of the binary as an ordinary user, from a directory
+# they can reach even if this one is private.
+userbin=$(mktemp -d) &&
+chmod 755 "$userbin" || exit 1
+as_nobody() {
+	prog=$userbin/$1
+	shift
+	setpriv --reuid=65534 --regid=65534 --clear-groups "$prog" "$@"
+}
+if command -v setpriv >/dev/null
+then
+	can_drop=yes
+else
+	echo "skipping tests as an ordinary user: setpriv not found"
+fi
+
+test_expect_success() {
+	if (eval "$2") >"$trash/output" 2>&1
+	then
+		echo "test passed: $1"
+		n_passed=$((n_passed + 1))
+	else
+		echo "test failed: $1"
+		sed -e 's/^/	/' "$trash/output"
+		n_failed=$((n_failed + 1))
+	fi
+}
+
+if ! setup_root
+then
+	echo "failed to set up test root"
+	exit 1
+fi
+
+test_expect_success 'run command in root' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+	EOT
+	echo hello >"$trash/expected" &&
+	./chpersroot echo hello >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual"
+'
+
+test_expect_success 'exit status is passed through' '
+	./chpersroot sh -c "exit 3"
+	test $? = 3
+'
+
+test_expect_success 'copyfile entries are copied, also from the cache' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+		copyfile = $trash/one
+		copyfile = $trash/two
+	[other]
+		rootdir = $root
+		copyfile = $trash/two
+	EOT
+	mkdir -p "$root$trash" &&
+	echo one >"$trash/one" &&
+	echo two >"$trash/two" &&
+	printf "one\ntwo\n" >"$trash/expected" &&
+	./chpersroot cat "$trash/one" "$trash/two" >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	rm -f "$root$trash/one" "$root$trash/two" &&
+	./chpersroot cat "$trash/one" "$trash/two" >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	write_config <<-EOT
+	[chpersroot]
+		rootdir = $root
+	EOT
+'
+
+test_expect_success 'simultaneous invocations coordinate copying' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+		copyfile = $trash/one
+	EOT
+	echo changed >"$trash/one" &&
+	for i in 1 2 3 4 5 6 7 8
+	do
+		./chpersroot cat "$trash/one" >"$trash/actual.$i" &
+	done &&
+	wait &&
+	for i in 1 2 3 4 5 6 7 8
+	do
+		echo changed | diff -u - "$trash/actual.$i" || return 1
+	done &&
+	test -f "$trash/run/copy/chpersroot" &&
+	write_config <<-EOT
+	[chpersroot]
+		rootdir = $root
+	EOT
+'
+
+test_expect_success 'a stuck copy lock is only waited for so long' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+		copyfile = $trash/one
+	EOT
+	echo stuck >"$trash/one" &&
+	flock -o "$trash/run/copy/chpersroot" sleep 60 &
+	holder=$! &&
+	while flock -n "$trash/run/copy/chpersroot" true
+	do
+		sleep 0.1
+	done &&
+	start=$(date +%s) &&
+	LD_PRELOAD=$PWD/slowlookup.so SLOW_LOOKUP=4 \
+		timeout 30 ./chpersroot cat "$trash/one" >"$trash/actual"
+	status=$?
+	end=$(date +%s)
+	kill $holder &&
+	test $status = 0 &&
+	echo stuck | diff -u - "$trash/actual" &&
+	test $((end - start)) -lt 10 &&
+	write_config <<-EOT
+	[chpersroot]
+		rootdir = $root
+	EOT
+'
+
+test_expect_success 'sparse files are copied with their holes' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+		copyfile = $trash/sparse
+	EOT
+	truncate -s 4M "$trash/sparse" &&
+	echo data | dd of="$trash/sparse" bs=1 seek=1048576 conv=notrunc &&
+	test $(stat -c %b "$trash/sparse") -lt 64 &&
+	./chpersroot true &&
+	cmp "$trash/sparse" "$root$trash/sparse" &&
+	test $(stat -c %s "$root$trash/sparse") = 4194304 &&
+	test $(stat -c %b "$root$trash/sparse") -le $(stat -c %b "$trash/sparse") &&
+	test $(du -k "$root$trash/sparse" | cut -f1) -le \
+		$(du -k "$trash/sparse" | cut -f1)
+'
+
+test_expect_success 'files that report no size are copied to the end' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+		copyfile = /proc/version
+	EOT
+	test $(stat -c %s /proc/version) = 0 &&
+	mkdir -p "$root/proc" &&
+	./chpersroot true &&
+	test -s "$root/proc/version" &&
+	diff -u /proc/version "$root/proc/version" &&
+	rm -r "$root/proc" &&
+	write_config <<-EOT
+	[chpersroot]
+		rootdir = $root
+	EOT
+'
+
+test_expect_success 'copymode bind mounts files read-only in the root only' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+		copymode = bind
+		copyfile = $trash/bound
+	EOT
+	echo bound >"$trash/bound" &&
+	rm -f "$root$trash/bound" &&
+	./chpersroot cat "$trash/bound" >"$trash/actual" &&
+	echo bound | diff -u - "$trash/actual" &&
+	! ./chpersroot sh -c "echo changed >>\"$trash/bound\"" &&
+	echo bound | diff -u - "$trash/bound" &&
+	test -f "$root$trash/bound" &&
+	! test -s "$root$trash/bound" &&
+	! grep " $root$trash/bound " /proc/self/mountinfo
+'
+
+test_expect_success 'copymode bind does not follow symlinks out of the root' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+		copymode = bind
+		copyfile = $trash/linked/file
+	EOT
+	mkdir -p "$trash/linked" "$trash/host" "$root$trash/host" &&
+	echo source >"$trash/linked/file" &&
+	echo host >"$trash/host/file" &&
+	echo inside >"$root$trash/host/file" &&
+	ln -s "$trash/host" "$root$trash/linked" &&
+	./chpersroot cat "$trash/host/file" >"$trash/actual" &&
+	echo source | diff -u - "$trash/actual" &&
+	echo host | diff -u - "$trash/host/file" &&
+	echo inside | diff -u - "$root$trash/host/file" &&
+	write_config <<-EOT
+	[chpersroot]
+		rootdir = $root
+	EOT
+'
+
+# Change a file without changing its size or modification time.
+rewrite_in_place() {
+	touch -r "$1" "$trash/stamp" &&
+	echo "$2" >"$1" &&
+	touch -r "$trash/stamp" "$1"
+}
+
+# Check the copied and unchanged counts in the last audit record.
+last_copy_counts() {
+	tr "\\0" "\\n" <"$trash/run/audit.spool" | tail -n 1 |
+	grep "copied=\"$1\" unchanged=\"$2\""
+}
+
+test_expect_success 'copycheck decides which files are copied again' '
+	mkdir -p "$root$trash" &&
+	echo old >"$trash/check1" &&
+	echo two >"$trash/check2" &&
+	for check in metadata content none
+	do
+		write_config <<-EOT &&
+		[chpersroot]
+			rootdir = $root
+			copycheck = $check
+			copyfile = $trash/check1
+			copyfile = $trash/check2
+		EOT
+		./chpersroot true || return 1
+	done &&
+	last_copy_counts 2 0 &&
+	rewrite_in_place "$trash/check1" new &&
+	sed -i "s/= none/= metadata/" "$trash/chpersroot.conf" &&
+	./chpersroot cat "$trash/check1" >"$trash/actual" &&
+	echo old | diff -u - "$trash/actual" &&
+	last_copy_counts 0 2 &&
+	sed -i "s/= metadata/= content/" "$trash/chpersroot.conf" &&
+	./chpersroot cat "$trash/check1" >"$trash/actual" &&
+	echo new | diff -u - "$trash/actual" &&
+	last_copy_counts 1 1 &&
+	./chpersroot true &&
+	last_copy_counts 0 2 &&
+	rewrite_in_place "$trash/check1" NEW &&
+	sed -i "s/= content/= none/" "$trash/chpersroot.conf" &&
+	./chpersroot cat "$trash/check1" >"$trash/actual" &&
+	echo NEW | diff -u - "$trash/actual" &&
+	last_copy_counts 2 0 &&
+	./chpersroot true &&
+	last_copy_counts 2 0 &&
+	write_config <<-EOT
+	[chpersroot]
+		rootdir = $root
+	EOT
+'
+
+test_expect_success 'sections are read from drop-in files' '
+	mkdir "$trash/chpersroot.d" &&
+	cat >"$trash/chpersroot.d/a.conf" <<-EOT &&
+	[dropin]
+		rootdir = $root
+	EOT
+	cat >"$trash/chpersroot.d/b.conf" <<-EOT &&
+	[other]
+		rootdir = /nonexistent
+	EOT
+	ln -s "$PWD/chpersroot" "$trash/dropin" &&
+	ln -s "$PWD/chpersroot" "$trash/late" &&
+	echo dropin >"$trash/expected" &&
+	"$trash/dropin" echo dropin >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	test -f "$trash/run/config.d/index" &&
+	test -f "$trash/run/config.d/b.conf" &&
+	"$trash/dropin" echo dropin >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual"
+'
+
+test_expect_success 'editing a drop-in file leaves the others cached' '
+	cache=$(stat -c %i "$trash/run/config.d/a.conf") &&
+	cat >>"$trash/chpersroot.d/b.conf" <<-EOT &&
+	[late]
+		rootdir = $root
+	EOT
+	echo late >"$trash/expected" &&
+	"$trash/late" echo late >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	test $(stat -c %i "$trash/run/config.d/a.conf") = $cache &&
+	rm "$trash/chpersroot.d/b.conf" &&
+	! "$trash/late" true &&
+	! test -f "$trash/run/config.d/b.conf" &&
+	test $(stat -c %i "$trash/run/config.d/a.conf") = $cache
+'
+
+test_expect_success 'a section added to an earlier drop-in file wins' '
+	cat >"$trash/chpersroot.d/c.conf" <<-EOT &&
+	[moved]
+		rootdir = /nonexistent
+	EOT
+	ln -s "$PWD/chpersroot" "$trash/moved" &&
+	! "$trash/moved" true &&
+	cat >>"$trash/chpersroot.d/a.conf" <<-EOT &&
+	[moved]
+		rootdir = $root
+	EOT
+	echo moved >"$trash/expected" &&
+	"$trash/moved" echo moved >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	rm "$trash/chpersroot.d/c.conf"
+'
+
+test_expect_success 'errors in other sections are ignored with or without a cache' '
+	write_config <<-EOT &&
+	[broken]
+		personality = nosuch
+		not a value
+	[chpersroot]
+		rootdir = $root
+	EOT
+	cat >"$trash/chpersroot.d/d.conf" <<-EOT &&
+	[broken]
+		exec = nosuch
+	[dropped]
+		rootdir = $root
+	EOT
+	ln -s "$PWD/chpersroot" "$trash/broken" &&
+	ln -s "$PWD/chpersroot" "$trash/dropped" &&
+	for cached in yes yes no
+	do
+		if test $cached = no
+		then
+			chmod 777 "$trash/run"
+		fi &&
+		./chpersroot echo ok >"$trash/actual.$cached" 2>&1 &&
+		"$trash/dropped" echo ok >>"$trash/actual.$cached" 2>&1 &&
+		! "$trash/broken" true >>"$trash/actual.$cached" 2>&1 ||
+		return 1
+	done &&
+	chmod 755 "$trash/run" &&
+	grep "unknown personality: nosuch" "$trash/actual.yes" &&
+	diff -u "$trash/actual.yes" "$trash/actual.no" &&
+	! test -f "$trash/run/config.d/d.conf" &&
+	rm "$trash/chpersroot.d/d.conf"
+'
+
+test_expect_success 'direct exec passes arguments unchanged' '
+	echo "a  b \$HOME '\''!" >"$trash/expected" &&
+	./chpersroot --exec echo "a  b" "\$HOME" "'\''!" >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual"
+'
+
+test_expect_success 'direct exec from configuration searches the path' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+		exec = direct
+	EOT
+	echo "\$HOME" >"$trash/expected" &&
+	./chpersroot echo "\$HOME" >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	! ./chpersroot no-such-command &&
+	write_config <<-EOT
+	[chpersroot]
+		rootdir = $root
+	EOT
+'
+
+test_expect_success 'query describes the configuration' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+		personality = linux32
+		copyfile = /etc/one
+		copyfile = /etc/two
+	EOT
+	path=/sbin:/bin:/usr/sbin:/usr/bin &&
+	printf "%s\\n" name=chpersroot "rootdir=$root" personality=linux32 \
+		"home=$home" "path=$path" "root_home=$home" "root_path=$path" \
+		copyfile=/etc/one copyfile=/etc/two >"$trash/expected" &&
+	./chpersroot --query | tr "\\0" "\\n" >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	./chpersroot --query=json >"$trash/actual" &&
+	grep "^{\"name\":\"chpersroot\",\"rootdir\":\"$root\",\"personality\":\"linux32\",\"lowerdir\":null,.*,\"copyfile\":\[\"/etc/one\",\"/etc/two\"\]}$" \
+		"$trash/actual" &&
+	write_config <<-EOT
+	[chpersroot]
+		rootdir = $root
+	EOT
+'
+
+test_expect_success 'commands are completed from an index of the path' '
+	./chpersroot --complete-command=ca | tr "\\0" "\\n" >"$trash/actual" &&
+	echo cat >"$trash/expected" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	test -f "$trash/run/commands/chpersroot" &&
+	cp "$root/bin/cat" "$root/bin/catalog" &&
+	./chpersroot --complete-command=ca | tr "\\0" "\\n" >"$trash/actual" &&
+	printf "cat\\ncatalog\\n" >"$trash/expected" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	rm "$root/bin/catalog"
+'
+
+if test -n "$can_drop"
+then
+test_expect_success 'only readable directories are completed' '
+	mkdir -m 700 "$root/sbin" &&
+	cp "$root/bin/cat" "$root/sbin/secret" &&
+	./chpersroot --complete-root-command=sec | tr "\\0" "\\n" \
+		>"$trash/actual" &&
+	echo secret >"$trash/expected" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	test $(stat -c %a "$trash/run/commands/chpersroot") = 600 &&
+	cp chpersroot "$userbin/chpersroot" &&
+	chmod 4755 "$userbin/chpersroot" &&
+	as_nobody chpersroot --complete-root-command=sec >"$trash/actual" &&
+	! test -s "$trash/actual" &&
+	as_nobody chpersroot --complete-command=ca | tr "\\0" "\\n" \
+		>"$trash/actual" &&
+	echo cat >"$trash/expected" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	rm -r "$root/sbin"
+'
+fi
+
+test_expect_success 'trace is written to the requested descriptor' '
+	./chpersroot --trace-fd=3 true 3>"$trash/trace" &&
+	test $(wc -l <"$trash/trace") = 1 &&
+	for phase in config passwd prepare openlog chroot env
+	do
+		grep "\"$phase\":[0-9]*[,}]" "$trash/trace" || return 1
+	done &&
+	grep "^{\"config\":\"chpersroot\",.*\"total_ns\":[0-9]*}$" \
+		"$trash/trace"
+'
+
+test_expect_success 'trace escapes the configuration name' '
+	name=$(printf "odd\\042name\\134x") &&
+	write_config <<-EOT &&
+	[$name]
+		rootdir = $root
+	EOT
+	ln -s "$PWD/chpersroot" "$trash/$name" &&
+	"$trash/$name" --trace-fd=3 true 3>"$trash/trace" &&
+	printf "{\\042config\\042:\\042odd\\134\\042name\\134\\134x\\042,\\042phases_ns\\042:{" \
+		>"$trash/expected" &&
+	grep -F -f "$trash/expected" "$trash/trace" &&
+	write_config <<-EOT
+	[chpersroot]
+		rootdir = $root
+	EOT
+'
+
+# The test binary sends its audit records to $trash/log, which does not
+# exist, so they all end up in the spool.
+test_expect_success 'audit records are spooled without a system log' '
+	./chpersroot echo audit-me &&
+	tr "\\0" "\\n" <"$trash/run/audit.spool" >"$trash/records" &&
+	grep "^<85>.* [^ ]*chpersroot\[[0-9]*\]: \[chpersroot user=\"root\" command=\"[^\"]*audit-me[^\"]*\" root=\"$root\" " \
+		"$trash/records" &&
+	! ./chpersroot --drain-audit &&
+	tr "\\0" "\\n" <"$trash/run/audit.spool" >"$trash/kept" &&
+	cmp "$trash/records" "$trash/kept"
+'
+
+test_expect_success 'a full audit spool counts the records it drops' '
+	{
+		yes "$(printf %0999d 0)" | head -n 4194 | tr "\\n" "\\0" &&
+		printf "%0284d\\0" 0
+	} >"$trash/run/audit.spool" &&
+	size=$(stat -c %s "$trash/run/audit.spool") &&
+	for i in 1 2 3
+	do
+		./chpersroot true || return 1
+	done &&
+	tr "\\0" "\\n" <"$trash/run/audit.spool" | tail -n 1 |
+	grep "^<84>.*: \[chpersroot-dropped records=\"3\"\]$" &&
+	test $(stat -c %s "$trash/run/audit.spool") -lt $((size + 256)) &&
+	: >"$trash/run/audit.spool" &&
+	./chpersroot true &&
+	tr "\\0" "\\n" <"$trash/run/audit.spool" | tail -n 1 |
+	grep "\[chpersroot user=\"root\" command=\"'\''true'\''\""
+'
+
+test_expect_success 'supervised commands are recorded as they exit' '
+	./chpersroot --supervise sh -c "exit 5"
+	test $? = 5 &&
+	tr "\\0" "\\n" <"$trash/run/audit.spool" >"$trash/records" &&
+	grep "\[chpersroot-exit user=\"root\" command=\"[^\"]*exit 5[^\"]*\" root=\"$root\" exit=\"5\" wall=\"[0-9.]*\" utime=\"[0-9.]*\" stime=\"[0-9.]*\" maxrss=\"[0-9]*\" inblock=\"[0-9]*\" oublock=\"[0-9]*\"\]$" \
+		"$trash/records" &&
+	./chpersroot --supervise sh -c "kill -TERM \$\$"
+	test $? = 143 &&
+	tr "\\0" "\\n" <"$trash/run/audit.spool" | grep "signal=\"15\""
+'
+
+test_expect_success 'root is composed from overlay layers' '
+	mkdir -p "$trash/merged" "$trash/upper" "$trash/work" &&
+	write_config <<-EOT &&
+	[layered]
+		rootdir = $trash/merged
+		lowerdir = $root
+	[layered-upper]
+		rootdir = $trash/merged
+		lowerdir = $root
+		upperdir = $trash/upper
+		workdir = $trash/work
+		namespace = pinned
+	[layered-shared]
+		rootdir = $trash/merged
+		lowerdir = $root
+		upperdir = $trash/upper
+		workdir = $trash/work
+	EOT
+	ln -s "$PWD/chpersroot" "$trash/layered" &&
+	ln -s "$PWD/chpersroot" "$trash/layered-upper" &&
+	ln -s "$PWD/chpersroot" "$trash/layered-shared" &&
+	"$trash/layered" sh -c "echo lost >/scratch && cat /scratch" >"$trash/actual" &&
+	echo lost >"$trash/expected" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	"$trash/layered" sh -c "! test -e /scratch" &&
+	"$trash/layered-upper" sh -c "echo kept >/scratch" &&
+	"$trash/layered-upper" cat /scratch >"$trash/actual" &&
+	echo kept >"$trash/expected" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	test -f "$trash/upper/scratch" &&
+	! test -e "$root/scratch" &&
+	! test -e "$trash/merged/scratch" &&
+	"$trash/layered-upper" --complete-command=ca | tr "\\0" "\\n" |
+	grep "^cat$" &&
+	! "$trash/layered-shared" true 2>"$trash/errors" &&
+	grep "upperdir needs namespace = pinned" "$trash/errors" &&
+	"$trash/layered-upper" --teardown
+'
+umount "$trash/run/ns" 2>/dev/null
+write_config <<-EOT
+[chpersroot]
+	rootdir = $root
+EOT
+
+# ld.so and libc are found in the root just as install_program put them.
+test_expect_success 'prewarm reads a program and the libraries it needs' '
+	n=$(ldd /bin/cat | grep -o "/[^ ]*" | sort -u | wc -l) &&
+	./chpersroot --prewarm /bin/cat >"$trash/actual" &&
+	grep "^prewarmed $((n + 1)) files ([0-9]* bytes) in [0-9.]*s$" \
+		"$trash/actual" &&
+	./chpersroot --prewarm >"$trash/actual" &&
+	grep "^prewarmed [1-9]" "$trash/actual" &&
+	! ./chpersroot --prewarm /bin/missing
+'
+
+# Only run where there is a cgroup v2 hierarchy we can make a directory in
+# to delegate; no controllers are needed just to be placed in a cgroup.
+cgroup2=$(awk '$3 == "cgroup2" { print $2; exit }' /proc/mounts)
+cgdir=$cgroup2/chpersroot-test.$$
+if test -n "$cgroup2" && mkdir "$cgdir" 2>/dev/null
+then
+	test_expect_success 'commands are placed in a cgroup per configuration and user' '
+		write_config <<-EOT &&
+		[chpersroot]
+			rootdir = $root
+			cgroup = $cgdir
+		EOT
+		./chpersroot true &&
+		test -d "$cgdir/chpersroot/$(id -un)" &&
+		test -f "$trash/run/cgroup/chpersroot" &&
+		./chpersroot true &&
+		write_config <<-EOT
+		[chpersroot]
+			rootdir = $root
+		EOT
+	'
+
+	test_expect_success 'served commands are placed in the cgroup too' '
+		write_config <<-EOT &&
+		[chpersroot]
+			rootdir = $root
+			cgroup = $cgdir
+			server = yes
+		EOT
+		start_server &&
+		write_config <<-EOT &&
+		[chpersroot]
+			rootdir = $trash/missing
+			cgroup = $cgdir
+			server = yes
+		EOT
+		mkdir -p "$root/proc" &&
+		mount -t proc proc "$root/proc" &&
+		./chpersroot cat /proc/self/cgroup >"$trash/actual"
+		status=$?
+		stop_server
+		umount -l "$root/proc"
+		test $status = 0 &&
+		grep "^0::.*/${cgdir##*/}/chpersroot/$(id -un)\$" "$trash/actual" &&
+		write_config <<-EOT
+		[chpersroot]
+			rootdir = $root
+		EOT
+	'
+	rmdir "$cgdir/chpersroot/$(id -un)" "$cgdir/chpersroot" "$cgdir"
+else
+	echo "skipping cgroup test: no cgroup v2 hierarchy to use"
+fi
+
+# Copies made while setting up a pinned namespace are only made again when
+# it is refreshed.
+test_expect_success 'pinned namespace is reused until refreshed' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+		namespace = pinned
+		copyfile = $trash/pinned
+	EOT
+	echo first >"$trash/pinned" &&
+	./chpersroot cat "$trash/pinned" >"$trash/actual" &&
+	diff -u "$trash/pinned" "$trash/actual" &&
+	grep " $trash/run/ns/chpersroot " /proc/self/mountinfo &&
+	tr "\0" "\n" <"$trash/run/audit.spool" | tail -n 1 |
+	grep "copied=\"1\" unchanged=\"0\"" &&
+	echo second >"$trash/pinned" &&
+	./chpersroot cat "$trash/pinned" >"$trash/actual" &&
+	echo first | diff -u - "$trash/actual" &&
+	tr "\0" "\n" <"$trash/run/audit.spool" | tail -n 1 |
+	grep "copied=\"0\" unchanged=\"0\"" &&
+	./chpersroot --refresh cat "$trash/pinned" >"$trash/actual" &&
+	diff -u "$trash/pinned" "$trash/actual"
+'
+
+test_expect_success 'teardown removes the pinned namespace' '
+	./chpersroot --teardown &&
+	! grep " $trash/run/ns/chpersroot " /proc/self/mountinfo &&
+	! test -e "$trash/run/ns/chpersroot" &&
+	echo third >"$trash/pinned" &&
+	./chpersroot cat "$trash/pinned" >"$trash/actual" &&
+	diff -u "$trash/pinned" "$trash/actual" &&
+	./chpersroot --teardown
+'
+umount "$trash/run/ns" 2>/dev/null
+
+if test -n "$can_drop"
+then
+	test_expect_success 'only root can refresh or tear down a namespace' '
+		write_config <<-EOT &&
+		[chpersroot]
+			rootdir = $root
+			namespace = pinned
+		EOT
+		cp chpersroot "$userbin/chpersroot" &&
+		chmod 4755 "$userbin/chpersroot" &&
+		! as_nobody chpersroot --teardown 2>"$trash/errors" &&
+		grep "only root can tear down a pinned namespace" \
+			"$trash/errors" &&
+		! as_nobody chpersroot --refresh true 2>"$trash/errors" &&
+		grep "only root can refresh a pinned namespace" \
+			"$trash/errors" &&
+		! as_nobody chpersroot --fan-out=chpersroot --refresh true \
+			2>"$trash/errors" &&
+		grep "only root can refresh a pinned namespace" \
+			"$trash/errors" &&
+		write_config <<-EOT
+		[chpersroot]
+			rootdir = $root
+		EOT
+	'
+fi
+
+test_expect_success 'batch runs each command' '
+	printf "echo one\\0echo two\\0exit 4\\0" >"$trash/batch" &&
+	printf "one\\ntwo\\n" >"$trash/expected" &&
+	! ./chpersroot --batch="$trash/batch" --results="$trash/results" \
+		>"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	test $(wc -l <"$trash/results") = 3 &&
+	grep "\"command\":\"exit 4\",\"exit\":4," "$trash/results"
+'
+
+test_expect_success 'batch reads standard input with parallel jobs' '
+	printf "echo a\\0echo b\\0echo c\\0echo d\\0" |
+	./chpersroot --batch --jobs=3 >"$trash/actual" &&
+	printf "a\\nb\\nc\\nd\\n" >"$trash/expected" &&
+	sort "$trash/actual" | diff -u "$trash/expected" -
+'
+
+test_expect_success 'fan-out runs the command in each matching root' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+	[fan-one]
+		rootdir = $root
+	[fan-two]
+		rootdir = $root
+	EOT
+	! ./chpersroot --fan-out="fan-*,dropin" --jobs=2 \
+		sh -c "echo out; echo err >&2; exit 3" \
+		>"$trash/actual" 2>"$trash/errors" &&
+	printf "[dropin] out\n[fan-one] out\n[fan-two] out\n" >"$trash/expected" &&
+	sort "$trash/actual" | diff -u "$trash/expected" - &&
+	grep "^\[fan-two\] err$" "$trash/errors" &&
+	grep "^fan-one  *exit 3  *[0-9]*\.[0-9]*s$" "$trash/errors" &&
+	test $(grep -c "exit 3" "$trash/errors") = 3 &&
+	mkdir "$trash/fan" &&
+	./chpersroot --fan-out=FAN-ONE --output-dir="$trash/fan" echo hello &&
+	echo hello >"$trash/expected" &&
+	diff -u "$trash/expected" "$trash/fan/fan-one.log" &&
+	! ./chpersroot --fan-out=nothing true &&
+	write_config <<-EOT
+	[chpersroot]
+		rootdir = $root
+	EOT
+'
+
+test_expect_success 'server falls back when not running' '
+	write_config <<-EOT &&
+	[chpersroot]
+		rootdir = $root
+		server = yes
+	EOT
+	echo direct >"$trash/expected" &&
+	./chpersroot echo direct >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual"
+'
+
+if ! start_server
+then
+	echo "failed to start server"
+	sed -e 's/^/	/' "$trash/server.log"
+	exit 1
+fi
+
+# From here on the configuration names a root that does not exist, so any
+# command that is not run by the server fails.
+write_config <<-EOT
+[chpersroot]
+	rootdir = $trash/missing
+	server = yes
+EOT
+
+test_expect_success 'command runs through server' '
+	echo served >"$trash/expected" &&
+	./chpersroot echo served >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	tr "\\0" "\\n" <"$trash/run/audit.spool" | tail -n 1 |
+	grep "\\[chpersroot user=\"root\" command=\"[^\"]*echo[^\"]*served[^\"]*\" root=\"$root\" "
+'
+
+test_expect_success 'server passes stdin and exit status' '
+	echo input >"$trash/expected" &&
+	./chpersroot cat <"$trash/expected" >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual" &&
+	{ ./chpersroot sh -c "exit 5"; test $? = 5; }
+'
+
+test_expect_success 'server reports death by signal' '
+	./chpersroot sh -c "kill -TERM \$\$"
+	test $? = 143
+'
+
+test_expect_success 'server executes commands directly' '
+	echo "\$HOME" >"$trash/expected" &&
+	./chpersroot --exec echo "\$HOME" >"$trash/actual" &&
+	diff -u "$trash/expected" "$trash/actual"
+'
+
+test_expect_success 'server runs commands in the root' '
+	echo in-root >"$root/marker" &&
+	./chpersroot cat /marker >"$trash/actual" &&
+	diff -u "$root/marker" "$trash/actual"
+'
+
+test_expect_success 'server checks credentials against the connection' '
+	sock=$trash/run/server/chpersroot &&
+	./fakeclient "$sock" 0 0 &&
+	! ./fakeclient "$sock" 65534 0 2>"$trash/errors" &&
+	grep "credentials do not match connection" "$trash/errors" &&
+	! ./fakeclient "$sock" 0 65534 2>"$trash/errors" &&
+	grep "credentials do not match connection" "$trash/errors" &&
+	! ./fakeclient "$sock" 0 0 65534 2>"$trash/errors" &&
+	grep "groups do not match connection" "$trash/errors"
+'
+
+stop_server
+
+printf '%d/%d passed\n' $n_passed $((n_passed + n_failed))
+rm -rf "$trash" "$userbin"
+test $n_failed = 0
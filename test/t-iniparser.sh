@@ -5,16 +5,34 @@ cd "$(dirname "$0")"
 n_passed=0
 n_failed=0
 
+# The file is given by name and through a pipe.  These files are small
+# enough to be read rather than mapped either way, so inidiff checks that
+# scanning and pulling events give the same results.
 _run_success_test() {
-	echo "$2" >"test.$$.ini" &&
-	echo "$5" >"test.$$.expected" &&
-	./initest "test.$$.ini" "$3" "$4" >"test.$$.actual" &&
+	echo "$3" >"test.$$.ini" &&
+	echo "$6" >"test.$$.expected" &&
+	./initest $1 "test.$$.ini" "$4" "$5" >"test.$$.actual" &&
+	diff -u "test.$$.expected" "test.$$.actual" &&
+	cat "test.$$.ini" | ./initest $1 - "$4" "$5" >"test.$$.actual" &&
 	diff -u "test.$$.expected" "test.$$.actual" &&
 	rm -f "test.$$."*
 }
 
+# Every test is run both as a full parse and as a targeted parse of the
+# section being queried, which must give the same answer.
 test_expect_success() {
-	if _run_success_test "$@"
+	if _run_success_test "" "$@" && _run_success_test -s "$@"
+	then
+		echo "test passed: $1"
+		n_passed=$((n_passed + 1))
+	else
+		echo "test failed: $1"
+		n_failed=$((n_failed + 1))
+	fi
+}
+
+test_expect_section_success() {
+	if _run_success_test -s "$@"
 	then
 		echo "test passed: $1"
 		n_passed=$((n_passed + 1))
@@ -66,6 +84,53 @@ test_expect_success 'second section' '
 [section two]
 	rootdir = /jail' 'section two' rootdir '/jail'
 
+test_expect_success 'later section' '
+[section one]
+	rootdir = /one
+[section two]
+	rootdir = /two
+[section three]
+	rootdir = /three' 'section two' rootdir '/two'
+
+test_expect_section_success 'skipped sections are not checked' "
+[broken]
+	this line has no value
+	rootdir = 'unterminated
+[gentoo32]
+	rootdir = /gentoo32" gentoo32 rootdir '/gentoo32'
+
+test_expect_section_success 'stops after wanted section' '
+[gentoo32]
+	rootdir = /gentoo32
+[broken
+	rootdir = /jail' gentoo32 rootdir '/gentoo32'
+
+test_expect_section_success 'first of repeated sections' '
+[gentoo32]
+	rootdir = /first
+[other]
+	rootdir = /other
+[gentoo32]
+	rootdir = /second' gentoo32 rootdir '/first'
+
+test_expect_section_success 'bracket in skipped value' '
+[other]
+	rootdir = /other \
+[gentoo32]
+	rootdir = /wrong
+[gentoo32]
+	rootdir = /gentoo32' gentoo32 rootdir '/gentoo32'
+
+if ./inidiff >"test.$$.actual" 2>&1
+then
+	echo "test passed: scanning, reading and pulling agree"
+	n_passed=$((n_passed + 1))
+else
+	echo "test failed: scanning, reading and pulling agree"
+	sed -e 's/^/	/' "test.$$.actual"
+	n_failed=$((n_failed + 1))
+fi
+rm -f "test.$$.actual"
 
 printf '%d/%d passed\n' $n_passed $((n_passed + n_failed))
 test $n_failed = 0